@@ -0,0 +1,103 @@
+// TYPE A line ending benchmark; not run by ctest. Compares the word-at-a-
+// time ascii_encode()/ascii_decode() with byte-at-a-time loops, on 8 KB
+// chunks of CSV-like text.
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "ftpAscii.h"
+
+using namespace FtpServer;
+
+// Byte-at-a-time versions of the two conversions, with the same interface
+static size_t bytewise_encode(uint8_t* out, const uint8_t* in, size_t len, bool* cr) {
+    size_t o = 0;
+    bool prev = *cr;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] == '\n' && !prev) {
+            out[o++] = '\r';
+        }
+        out[o++] = in[i];
+        prev = in[i] == '\r';
+    }
+    *cr = prev;
+    return o;
+}
+
+static size_t bytewise_decode(uint8_t* data, size_t len, bool* cr) {
+    size_t o = 0;
+    bool held = *cr;
+    for (size_t i = 0; i < len; i++) {
+        if (held) {
+            held = false;
+            if (data[i] == '\n') {
+                data[o++] = '\n';
+                continue;
+            }
+            data[o++] = '\r';
+        }
+        if (data[i] == '\r') {
+            held = true;
+        } else {
+            data[o++] = data[i];
+        }
+    }
+    *cr = held;
+    return o;
+}
+
+// Keeps the conversions from being optimised away
+volatile size_t bench_sink;
+
+// Input MB/s of fn over src in 8 KB chunks
+template <typename Convert>
+static double mb_per_second(const std::string& src, Convert fn) {
+    const size_t CHUNK = 8192;
+    const int ROUNDS = 20;
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t pos = 0; pos < src.size(); pos += CHUNK) {
+            total += fn((const uint8_t*)src.data() + pos, std::min(CHUNK, src.size() - pos));
+        }
+    }
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    bench_sink = total;
+    return src.size() * (double)ROUNDS / secs.count() / 1e6;
+}
+
+int main() {
+    std::string text, crlf;
+    char line[128];
+    for (int i = 0; text.size() < (8 << 20); i++) {
+        int len = snprintf(line, sizeof(line), "%d,2024-05-01T12:%02d:%02d,%d.%03d,%s", i, i % 60,
+                           (i * 7) % 60, 20 + i % 13, i * 37 % 1000, i % 5 ? "OK" : "WARN");
+        text.append(line, len).append("\n");
+        crlf.append(line, len).append("\r\n");
+    }
+
+    std::vector<uint8_t> out(2 * 8192);
+    auto encode = [&out](size_t (*fn)(uint8_t*, const uint8_t*, size_t, bool*)) {
+        return [&out, fn](const uint8_t* in, size_t len) {
+            bool cr = false;
+            return fn(out.data(), in, len, &cr);
+        };
+    };
+    auto decode = [&out](size_t (*fn)(uint8_t*, size_t, bool*)) {
+        return [&out, fn](const uint8_t* in, size_t len) {
+            bool cr = false;
+            memcpy(out.data(), in, len);
+            return fn(out.data(), len, &cr);
+        };
+    };
+    printf("                  byte-at-a-time  word-at-a-time\n");
+    printf("encode LF->CRLF   %8.0f MB/s   %8.0f MB/s\n",
+           mb_per_second(text, encode(bytewise_encode)), mb_per_second(text, encode(ascii_encode)));
+    printf("decode CRLF->LF   %8.0f MB/s   %8.0f MB/s\n",
+           mb_per_second(crlf, decode(bytewise_decode)), mb_per_second(crlf, decode(ascii_decode)));
+    return 0;
+}
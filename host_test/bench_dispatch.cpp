@@ -0,0 +1,90 @@
+// Command lookup benchmark; not run by ctest. Compares the registry's
+// pop_command() with the lookup it replaced, over a mix of command lines.
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include <atomic>
+#include <chrono>
+
+// pop_command() is private to the session; open it up for this file only
+#define private public
+#include "ftpServer.h"
+#undef private
+
+using FtpServer::Server;
+
+static const char* const LINES[] = {
+    "NOOP\r\n",        "TYPE I\r\n",          "PASV\r\n",          "EPSV\r\n",
+    "RETR /sdcard/movie.mp4\r\n", "STOR upload.bin\r\n", "LIST -la\r\n",
+    "CWD /sdcard/photos\r\n",     "SIZE a.txt\r\n",      "MDTM a.txt\r\n",
+    "MLSD\r\n",        "XSHA256 a.bin\r\n",   "retr lower.txt\r\n", "XYZZ\r\n",
+};
+static const int LINE_COUNT = sizeof(LINES) / sizeof(LINES[0]);
+
+// The verbs in registry order, for the lookup the registry replaced
+static const char* const VERBS[] = {
+    "USER", "PASS", "QUIT", "FEAT", "OPTS", "AUTH", "SYST", "CDUP", "CWD", "PWD",
+    "XPWD", "SIZE", "MDTM", "TYPE", "MODE", "PASV", "EPSV", "LIST", "NLST", "MLSD",
+    "MLST", "RETR", "STOR", "APPE", "DELE", "RMD", "MKD", "RNFR", "RNTO", "REST",
+    "NOOP", "STAT", "HASH", "RANG", "XCRC", "XMD5", "XSHA1", "XSHA256", "XSHA512",
+};
+
+// That lookup: copy the verb, upper-case it and strcmp() it against each
+// name in turn
+static int strcmp_lookup(char** str) {
+    char verb[9];
+    size_t len = 0;
+    while (**str == ' ') (*str)++;
+    while (**str != '\0' && **str != ' ' && **str != '\r' && **str != '\n') {
+        if (len < sizeof(verb) - 1) {
+            verb[len++] = (char)toupper((int)**str);
+        }
+        (*str)++;
+    }
+    verb[len] = '\0';
+    if (**str != '\0') {
+        (*str)++;
+    }
+    for (int i = 0; i < (int)(sizeof(VERBS) / sizeof(VERBS[0])); i++) {
+        if (strcmp(verb, VERBS[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Keeps the lookups from being optimised away
+volatile uintptr_t bench_sink;
+
+template <typename Lookup>
+static double commands_per_second(Lookup lookup) {
+    const int ROUNDS = 1000000;
+    char lines[LINE_COUNT][64];
+    for (int i = 0; i < LINE_COUNT; i++) {
+        strcpy(lines[i], LINES[i]);
+    }
+    uintptr_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < LINE_COUNT; i++) {
+            char* p = lines[i];
+            sink += lookup(&p);
+        }
+    }
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    bench_sink = sink;
+    return (double)ROUNDS * LINE_COUNT / secs.count();
+}
+
+int main() {
+    Server::Session session;
+    double before = commands_per_second([](char** p) { return (uintptr_t)strcmp_lookup(p); });
+    double after = commands_per_second([&session](char** p) {
+        return (uintptr_t)session.pop_command(p);
+    });
+    printf("strcmp loop  %.1f M commands/s\n", before / 1e6);
+    printf("registry     %.1f M commands/s\n", after / 1e6);
+    return 0;
+}
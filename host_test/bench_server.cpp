@@ -0,0 +1,272 @@
+// Server benchmarks over loopback; not run by ctest. The server runs in a
+// child process, so its CPU time can be told apart from the client's.
+//
+//   bench_server <name>     run one benchmark; no name lists them
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "ftpServer.h"
+#include "test_client.h"
+
+static pid_t server_pid;
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// CPU seconds used by the server process so far
+static double server_cpu() {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)server_pid);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    char stat[1024];
+    size_t len = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[len] = '\0';
+    // utime and stime are the 12th and 13th fields after the command name
+    const char* p = strrchr(stat, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static bool login(Client* c) {
+    if (!c->login()) {
+        fprintf(stderr, "Cannot log in to the server\n");
+        return false;
+    }
+    return true;
+}
+
+static void report_failed(int failed) {
+    if (failed) {
+        fprintf(stderr, "%d transfer(s) failed, the figures are not valid\n", failed);
+    }
+}
+
+// Round trip of a command that does no work, and the server's CPU use
+// while a logged-in client sits idle
+static void bench_noop() {
+    Client c;
+    if (!login(&c)) return;
+    const int COUNT = 2000;
+    double start = now();
+    for (int i = 0; i < COUNT; i++) {
+        c.cmd("NOOP");
+    }
+    double rtt = (now() - start) / COUNT;
+    double cpu = server_cpu();
+    sleep(3);
+    cpu = server_cpu() - cpu;
+    printf("NOOP round trip %.3f ms, idle CPU %.1f%%\n", rtt * 1e3, cpu / 3 * 100);
+}
+
+// Files per second for many small files, each on a new data connection
+// opened with PASV and then with EPSV
+static void bench_small() {
+    Client c;
+    if (!login(&c)) return;
+    const int COUNT = 300;
+    std::string file = pattern(1024, 1);
+    std::string data;
+    int failed = 0;
+    c.cmd("MKD /sdcard/small");
+    for (bool epsv : {false, true}) {
+        c.use_epsv = epsv;
+        double start = now();
+        for (int i = 0; i < COUNT; i++) {
+            failed += c.upload("STOR /sdcard/small/f" + std::to_string(i), file) != 226;
+        }
+        double stor = COUNT / (now() - start);
+        start = now();
+        for (int i = 0; i < COUNT; i++) {
+            failed += c.download("RETR /sdcard/small/f" + std::to_string(i), &data) != 226 ||
+                      data != file;
+        }
+        double retr = COUNT / (now() - start);
+        printf("%s: STOR %.0f files/s, RETR %.0f files/s\n", epsv ? "EPSV" : "PASV", stor, retr);
+    }
+    for (int i = 0; i < COUNT; i++) {
+        c.cmd("DELE /sdcard/small/f" + std::to_string(i));
+    }
+    c.cmd("RMD /sdcard/small");
+    report_failed(failed);
+}
+
+// Files per second for many small files in stream mode, with a data
+// connection per file, and in block mode, over one data connection
+static void bench_block() {
+    Client c;
+    if (!login(&c)) return;
+    const int COUNT = 500;
+    std::string file = pattern(1024, 2);
+    std::string data;
+    int failed = 0;
+    c.cmd("MKD /sdcard/block");
+    for (bool block : {false, true}) {
+        c.cmd(block ? "MODE B" : "MODE S");
+        double start = now();
+        for (int i = 0; i < COUNT; i++) {
+            std::string line = "STOR /sdcard/block/f" + std::to_string(i);
+            failed += (block ? c.block_upload(line, file) : c.upload(line, file)) != 226;
+        }
+        double stor = COUNT / (now() - start);
+        start = now();
+        for (int i = 0; i < COUNT; i++) {
+            std::string line = "RETR /sdcard/block/f" + std::to_string(i);
+            failed += (block ? c.block_download(line, &data) : c.download(line, &data)) != 226 ||
+                      data != file;
+        }
+        double retr = COUNT / (now() - start);
+        printf("%s: STOR %.0f files/s, RETR %.0f files/s\n", block ? "BLOCK " : "STREAM", stor,
+               retr);
+    }
+    c.cmd("MODE S");
+    c.close_block();
+    for (int i = 0; i < COUNT; i++) {
+        c.cmd("DELE /sdcard/block/f" + std::to_string(i));
+    }
+    c.cmd("RMD /sdcard/block");
+    report_failed(failed);
+}
+
+// Middle of five timings
+static double median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+// MB/s for an 8.3 MB text file moved in TYPE A, with line end conversion,
+// and in TYPE I
+static void bench_ascii() {
+    Client c;
+    if (!login(&c)) return;
+    std::string text, crlf;
+    char line[128];
+    for (int i = 0; text.size() < 8300000; i++) {
+        int len = snprintf(line, sizeof(line), "%d,2024-05-01T12:%02d:%02d,%d.%03d,%s", i, i % 60,
+                           (i * 7) % 60, 20 + i % 13, i * 37 % 1000, i % 5 ? "OK" : "WARN");
+        text.append(line, len).append("\n");
+        crlf.append(line, len).append("\r\n");
+    }
+    std::string data;
+    int failed = c.upload("STOR /sdcard/ascii.txt", text) != 226;
+    std::vector<double> retr_a, retr_i, stor_a, stor_i;
+    for (int round = 0; round < 5; round++) {
+        c.cmd("TYPE A");
+        double start = now();
+        failed += c.download("RETR /sdcard/ascii.txt", &data) != 226 || data != crlf;
+        retr_a.push_back(crlf.size() / (now() - start) / 1e6);
+        start = now();
+        failed += c.upload("STOR /sdcard/ascii2.txt", crlf) != 226;
+        stor_a.push_back(crlf.size() / (now() - start) / 1e6);
+        c.cmd("TYPE I");
+        start = now();
+        failed += c.download("RETR /sdcard/ascii.txt", &data) != 226 || data != text;
+        retr_i.push_back(text.size() / (now() - start) / 1e6);
+        start = now();
+        failed += c.upload("STOR /sdcard/ascii2.txt", crlf) != 226;
+        stor_i.push_back(crlf.size() / (now() - start) / 1e6);
+    }
+    printf("RETR: TYPE A %.0f MB/s, TYPE I %.0f MB/s\n", median(retr_a), median(retr_i));
+    printf("STOR: TYPE A %.0f MB/s, TYPE I %.0f MB/s\n", median(stor_a), median(stor_i));
+    c.cmd("DELE /sdcard/ascii.txt");
+    c.cmd("DELE /sdcard/ascii2.txt");
+    report_failed(failed);
+}
+
+// Server CPU per MB moved for a 64 MB file. The transfer checksum is
+// whatever this binary was built with; bench_server_hash_none and
+// bench_server_hash_selected are the other choices.
+static void bench_cpu() {
+    Client c;
+    if (!login(&c)) return;
+    std::string file = pattern(64 << 20, 3);
+    double mb = file.size() / (double)(1 << 20);
+    std::string data, reply;
+    int failed = c.upload("STOR /sdcard/cpu.bin", file) != 226;
+    std::vector<double> stor, retr;
+    for (int round = 0; round < 5; round++) {
+        double cpu = server_cpu();
+        failed += c.upload("STOR /sdcard/cpu.bin", file) != 226;
+        stor.push_back((server_cpu() - cpu) * 1e3 / mb);
+        reply = c.last;
+        cpu = server_cpu();
+        failed += c.download("RETR /sdcard/cpu.bin", &data) != 226 || data != file;
+        retr.push_back((server_cpu() - cpu) * 1e3 / mb);
+    }
+    printf("STOR reply: %s\n", reply.c_str());
+    printf("server CPU: STOR %.2f ms/MB, RETR %.2f ms/MB\n", median(stor), median(retr));
+    c.cmd("DELE /sdcard/cpu.bin");
+    report_failed(failed);
+}
+
+typedef struct {
+    const char* name;
+    void (*run)();
+    const char* help;
+} bench_t;
+
+static const bench_t BENCHES[] = {
+    {"noop", bench_noop, "NOOP round trip and idle server CPU"},
+    {"small", bench_small, "300 x 1 KiB files, PASV and EPSV"},
+    {"block", bench_block, "500 x 1 KiB files, MODE S and MODE B"},
+    {"ascii", bench_ascii, "8.3 MB text file, TYPE A and TYPE I"},
+    {"cpu", bench_cpu, "server CPU per MB for a 64 MB file"},
+};
+
+int main(int argc, char** argv) {
+    const bench_t* bench = nullptr;
+    for (const bench_t& b : BENCHES) {
+        if (argc > 1 && strcmp(argv[1], b.name) == 0) {
+            bench = &b;
+        }
+    }
+    if (!bench) {
+        fprintf(stderr, "usage: %s <benchmark>\n", argv[0]);
+        for (const bench_t& b : BENCHES) {
+            fprintf(stderr, "  %-8s %s\n", b.name, b.help);
+        }
+        return 2;
+    }
+
+    // The server lives until the pipe closes
+    int done[2];
+    if (pipe(done) != 0) {
+        return 1;
+    }
+    server_pid = fork();
+    if (server_pid == 0) {
+        close(done[1]);
+        signal(SIGPIPE, SIG_IGN);
+        FtpServer::Server* server = new FtpServer::Server();
+        server->start();
+        char c;
+        while (read(done[0], &c, 1) > 0) {
+        }
+        server->stop();
+        delete server;
+        _exit(0);
+    }
+    close(done[0]);
+    signal(SIGPIPE, SIG_IGN);
+    bench->run();
+    close(done[1]);
+    waitpid(server_pid, nullptr, 0);
+    return 0;
+}
@@ -0,0 +1,229 @@
+// An in-memory FatFs volume and the mount calls around it, so that
+// filesystem.cpp itself runs on the host. Files are whole strings; each
+// has a start cluster and a fragment count standing in for its FAT chain.
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include "diskio_sdmmc.h"
+#include "diskio_wl.h"
+#include "esp_vfs_fat.h"
+#include "ff.h"
+
+struct host_ff_file {
+    std::string data;
+    DWORD sclust;
+    DWORD fragments;
+};
+
+static std::map<std::string, host_ff_file> s_files;
+static DWORD s_next_cluster = 2;
+
+int host_ff_link_maps_built = 0;
+int host_ff_fast_seeks = 0;
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char* dst, const char* src, size_t size) {
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t n = std::min(len, size - 1);
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+#endif
+
+void host_ff_put(const char* path, const char* data, size_t len, DWORD fragments) {
+    host_ff_file& file = s_files[path];
+    file.data.assign(data, len);
+    file.sclust = s_next_cluster++;
+    file.fragments = fragments;
+}
+
+bool host_ff_remove(const char* path) {
+    return s_files.erase(path) > 0;
+}
+
+FRESULT f_open(FIL* fp, const char* path, BYTE mode) {
+    auto it = s_files.find(path);
+    if (it == s_files.end()) {
+        if (!(mode & (FA_CREATE_ALWAYS | FA_OPEN_ALWAYS))) {
+            return FR_NO_FILE;
+        }
+        host_ff_put(path, "", 0, 1);
+        it = s_files.find(path);
+    } else if ((mode & FA_CREATE_ALWAYS) == FA_CREATE_ALWAYS) {
+        // The old chain is freed and the file starts again elsewhere
+        host_ff_put(path, "", 0, 1);
+    }
+    strlcpy(fp->host_path, path, sizeof(fp->host_path));
+    fp->obj.sclust = it->second.sclust;
+    fp->obj.objsize = it->second.data.size();
+    fp->flag = mode;
+    fp->fptr = (mode & FA_OPEN_APPEND) == FA_OPEN_APPEND ? fp->obj.objsize : 0;
+    fp->cltbl = nullptr;
+    return FR_OK;
+}
+
+FRESULT f_close(FIL* fp) {
+    fp->host_path[0] = '\0';
+    return FR_OK;
+}
+
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br) {
+    auto it = s_files.find(fp->host_path);
+    if (it == s_files.end() || !(fp->flag & FA_READ)) {
+        return FR_INVALID_OBJECT;
+    }
+    const std::string& data = it->second.data;
+    size_t n = fp->fptr < data.size() ? std::min((size_t)btr, data.size() - fp->fptr) : 0;
+    memcpy(buff, data.data() + fp->fptr, n);
+    fp->fptr += n;
+    *br = n;
+    return FR_OK;
+}
+
+FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw) {
+    auto it = s_files.find(fp->host_path);
+    if (it == s_files.end() || !(fp->flag & FA_WRITE)) {
+        return FR_INVALID_OBJECT;
+    }
+    host_ff_file& file = it->second;
+    if (btw > 0 && fp->fptr >= file.data.size() && file.data.size() > 0) {
+        file.fragments++;  // Growing the chain lands somewhere else
+    }
+    if (fp->fptr + btw > file.data.size()) {
+        file.data.resize(fp->fptr + btw);
+    }
+    memcpy(&file.data[fp->fptr], buff, btw);
+    fp->fptr += btw;
+    fp->obj.objsize = file.data.size();
+    *bw = btw;
+    return FR_OK;
+}
+
+// A map is [size, fragments, start cluster, ...]: FatFs needs two entries
+// per fragment plus one. A seek through a map checks that it describes
+// the file being read.
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs) {
+    auto it = s_files.find(fp->host_path);
+    if (it == s_files.end()) {
+        return FR_INVALID_OBJECT;
+    }
+    const host_ff_file& file = it->second;
+    if (ofs == CREATE_LINKMAP) {
+        DWORD needed = file.fragments * 2 + 1;
+        if (fp->cltbl == nullptr) {
+            return FR_INVALID_PARAMETER;
+        }
+        if (fp->cltbl[0] < needed) {
+            fp->cltbl[0] = needed;
+            return FR_NOT_ENOUGH_CORE;
+        }
+        fp->cltbl[0] = needed;
+        fp->cltbl[1] = file.fragments;
+        fp->cltbl[2] = fp->obj.sclust;
+        host_ff_link_maps_built++;
+        return FR_OK;
+    }
+    if (fp->cltbl != nullptr) {
+        if (fp->cltbl[1] != file.fragments || fp->cltbl[2] != fp->obj.sclust) {
+            return FR_INT_ERR;
+        }
+        host_ff_fast_seeks++;
+        // Fast seek does not grow the file
+        ofs = std::min(ofs, fp->obj.objsize);
+    }
+    fp->fptr = ofs;
+    return FR_OK;
+}
+
+FRESULT f_opendir(FF_DIR* dp, const char* path) {
+    snprintf(dp->host_path, sizeof(dp->host_path), "%s%s", path,
+             path[strlen(path) - 1] == '/' ? "" : "/");
+    dp->host_index = 0;
+    return FR_OK;
+}
+
+// Only files are kept, so every entry is a file directly below the
+// directory; the date is 2024-05-01 12:34:56
+FRESULT f_readdir(FF_DIR* dp, FILINFO* fno) {
+    size_t len = strlen(dp->host_path);
+    UINT index = 0;
+    fno->fname[0] = '\0';
+    for (const auto& entry : s_files) {
+        const std::string& path = entry.first;
+        if (path.compare(0, len, dp->host_path) != 0 || path.find('/', len) != std::string::npos) {
+            continue;
+        }
+        if (index++ == dp->host_index) {
+            strlcpy(fno->fname, path.c_str() + len, sizeof(fno->fname));
+            fno->fsize = entry.second.data.size();
+            fno->fattrib = 0;
+            fno->fdate = (WORD)(((2024 - 1980) << 9) | (5 << 5) | 1);
+            fno->ftime = (WORD)((12 << 11) | (34 << 5) | (56 / 2));
+            dp->host_index++;
+            break;
+        }
+    }
+    return FR_OK;
+}
+
+FRESULT f_closedir(FF_DIR* dp) {
+    return FR_OK;
+}
+
+static sdmmc_card_t* const s_card = (sdmmc_card_t*)&s_next_cluster;
+
+esp_err_t esp_vfs_fat_spiflash_mount_rw_wl(const char* base_path, const char* partition_label,
+                                           const esp_vfs_fat_mount_config_t* mount_config,
+                                           wl_handle_t* wl_handle) {
+    *wl_handle = 0;
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_spiflash_unmount_rw_wl(const char* base_path, wl_handle_t wl_handle) {
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_sdspi_mount(const char* base_path, const sdmmc_host_t* host_config,
+                                  const sdspi_device_config_t* slot_config,
+                                  const esp_vfs_fat_mount_config_t* mount_config,
+                                  sdmmc_card_t** out_card) {
+    *out_card = s_card;
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_sdcard_unmount(const char* base_path, sdmmc_card_t* card) {
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_info(const char* base_path, uint64_t* out_total_bytes,
+                           uint64_t* out_free_bytes) {
+    *out_total_bytes = 16 << 20;
+    *out_free_bytes = 8 << 20;
+    return ESP_OK;
+}
+
+BYTE ff_diskio_get_pdrv_wl(wl_handle_t flash_handle) {
+    return 0;
+}
+
+BYTE ff_diskio_get_pdrv_card(const sdmmc_card_t* card) {
+    return 1;
+}
+
+void sdmmc_card_print_info(FILE* stream, const sdmmc_card_t* card) {}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host_id, const spi_bus_config_t* bus_config,
+                             int dma_chan) {
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_free(spi_host_device_t host_id) {
+    return ESP_OK;
+}
@@ -0,0 +1,104 @@
+// The storage_* layer of filesystem.cpp on stdio and dirent, for the host
+// tests. Mounting is left to the test, which creates the mount point
+// directories.
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "filesystem.h"
+#include "ftpServer.h"
+
+struct storage_dir {
+    DIR* dir;
+    char path[256];
+    char name[256];
+};
+
+struct storage_file {
+    FILE* fp;
+};
+
+size_t storage_io_size(const char* path) {
+    if (strncmp(path, VFS_NATIVE_EXTERNAL_MP, strlen(VFS_NATIVE_EXTERNAL_MP)) == 0) {
+        return CONFIG_FTP_SDCARD_IO_SIZE;
+    }
+    return CONFIG_FTP_DATA_IO_SIZE;
+}
+
+storage_dir_t* storage_opendir(const char* path) {
+    DIR* dir = opendir(path);
+    if (dir == nullptr) return nullptr;
+    storage_dir_t* sd = (storage_dir_t*)malloc(sizeof(storage_dir_t));
+    sd->dir = dir;
+    snprintf(sd->path, sizeof(sd->path), "%s", path);
+    return sd;
+}
+
+bool storage_readdir(storage_dir_t* dir, storage_dirent_t* entry, bool with_meta) {
+    struct dirent* de;
+    do {
+        de = readdir(dir->dir);
+        if (de == nullptr) return false;
+    } while (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0);  // f_readdir does not report these
+    snprintf(dir->name, sizeof(dir->name), "%s", de->d_name);
+    entry->name = dir->name;
+    entry->is_dir = (de->d_type == DT_DIR);
+    entry->size = 0;
+    entry->mtime = 0;
+    if (with_meta) {
+        char full[520];
+        struct stat st;
+        snprintf(full, sizeof(full), "%s/%s", dir->path, de->d_name);
+        if (stat(full, &st) == 0) {
+            entry->size = st.st_size;
+            entry->mtime = st.st_mtime;
+        }
+    }
+    return true;
+}
+
+void storage_closedir(storage_dir_t* dir) {
+    if (dir == nullptr) return;
+    closedir(dir->dir);
+    free(dir);
+}
+
+storage_file_t* storage_fopen(const char* path, const char* mode) {
+    FILE* fp = fopen(path, mode);
+    if (fp == nullptr) return nullptr;
+    setvbuf(fp, nullptr, _IONBF, 0);  // FatFs has no buffer of its own either
+    storage_file_t* file = (storage_file_t*)malloc(sizeof(storage_file_t));
+    file->fp = fp;
+    return file;
+}
+
+bool storage_fread(storage_file_t* file, void* buf, size_t len, size_t* done) {
+    *done = fread(buf, 1, len, file->fp);
+    return *done == len || !ferror(file->fp);
+}
+
+bool storage_fwrite(storage_file_t* file, const void* buf, size_t len) {
+    return fwrite(buf, 1, len, file->fp) == len;
+}
+
+bool storage_fseek(storage_file_t* file, uint64_t offset) {
+    if (offset > storage_fsize(file)) return false;
+    return fseeko(file->fp, (off_t)offset, SEEK_SET) == 0;
+}
+
+uint64_t storage_fsize(storage_file_t* file) {
+    struct stat st;
+    fflush(file->fp);
+    if (fstat(fileno(file->fp), &st) != 0) return 0;
+    return st.st_size;
+}
+
+void storage_fclose(storage_file_t* file) {
+    if (file == nullptr) return;
+    fclose(file->fp);
+    free(file);
+}
+
+void storage_file_changed(const char* path, bool tree) {}
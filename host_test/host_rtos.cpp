@@ -0,0 +1,193 @@
+// The FreeRTOS calls used by the server, on std::thread primitives. Ticks
+// are milliseconds since start.
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+int host_log_verbose = getenv("FTP_HOST_VERBOSE") != nullptr;
+
+struct host_task {
+    TaskFunction_t fn;
+    void* arg;
+};
+
+struct host_sem {
+    std::mutex m;
+    std::condition_variable cv;
+    int count;
+};
+
+struct host_queue {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::vector<char>> items;
+    size_t length;
+    size_t item_size;
+};
+
+struct host_event_group {
+    std::mutex m;
+    std::condition_variable cv;
+    EventBits_t bits = 0;
+};
+
+static const auto host_start = std::chrono::steady_clock::now();
+
+// Waits on cv until ready() or the timeout, with portMAX_DELAY as forever
+template <typename Pred>
+static bool host_wait(std::condition_variable& cv, std::unique_lock<std::mutex>& lock,
+                      TickType_t ticks, Pred ready) {
+    if (ticks == portMAX_DELAY) {
+        cv.wait(lock, ready);
+        return true;
+    }
+    return cv.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+TickType_t xTaskGetTickCount() {
+    return (TickType_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - host_start)
+        .count();
+}
+
+void vTaskDelay(TickType_t ticks) {
+    if (ticks == 0) {
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+    }
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack, void* arg,
+                       UBaseType_t priority, TaskHandle_t* handle) {
+    host_task* task = new host_task{fn, arg};
+    if (handle) *handle = task;
+    std::thread([task] { task->fn(task->arg); }).detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack,
+                                   void* arg, UBaseType_t priority, TaskHandle_t* handle,
+                                   BaseType_t core) {
+    return xTaskCreate(fn, name, stack, arg, priority, handle);
+}
+
+// A task deleting itself ends its thread. Deleting another task is only
+// done to one that is stuck, which a test reports as a failure anyway.
+void vTaskDelete(TaskHandle_t handle) {
+    if (handle == nullptr) {
+        pthread_exit(nullptr);
+    }
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    host_sem* sem = new host_sem;
+    sem->count = 1;
+    return sem;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(sem->m);
+    if (!host_wait(sem->cv, lock, ticks, [sem] { return sem->count > 0; })) {
+        return pdFALSE;
+    }
+    sem->count--;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    {
+        std::lock_guard<std::mutex> lock(sem->m);
+        if (sem->count > 0) return pdFALSE;
+        sem->count++;
+    }
+    sem->cv.notify_one();
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) {
+    delete sem;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    host_queue* queue = new host_queue;
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(queue->m);
+    if (!host_wait(queue->cv, lock, ticks,
+                   [queue] { return queue->items.size() < queue->length; })) {
+        return pdFALSE;
+    }
+    const char* bytes = (const char*)item;
+    queue->items.emplace_back(bytes, bytes + queue->item_size);
+    queue->cv.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(queue->m);
+    if (!host_wait(queue->cv, lock, ticks, [queue] { return !queue->items.empty(); })) {
+        return pdFALSE;
+    }
+    memcpy(item, queue->items.front().data(), queue->item_size);
+    queue->items.pop_front();
+    queue->cv.notify_all();
+    return pdTRUE;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    delete queue;
+}
+
+EventGroupHandle_t xEventGroupCreate() {
+    return new host_event_group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+    delete group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(group->m);
+    group->bits |= bits;
+    group->cv.notify_all();
+    return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(group->m);
+    EventBits_t old = group->bits;
+    group->bits &= ~bits;
+    return old;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear,
+                                BaseType_t all, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(group->m);
+    auto ready = [group, bits, all] {
+        return all ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+    };
+    host_wait(group->cv, lock, ticks, ready);
+    EventBits_t result = group->bits;
+    if (ready() && clear) {
+        group->bits &= ~bits;
+    }
+    return result;
+}
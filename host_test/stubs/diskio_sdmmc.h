@@ -0,0 +1,6 @@
+#pragma once
+
+#include "ff.h"
+#include "sdmmc_cmd.h"
+
+BYTE ff_diskio_get_pdrv_card(const sdmmc_card_t* card);
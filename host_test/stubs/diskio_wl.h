@@ -0,0 +1,6 @@
+#pragma once
+
+#include "esp_vfs_fat.h"
+#include "ff.h"
+
+BYTE ff_diskio_get_pdrv_wl(wl_handle_t flash_handle);
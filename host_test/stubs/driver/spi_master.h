@@ -0,0 +1,29 @@
+#pragma once
+
+#include "esp_err.h"
+
+typedef int spi_host_device_t;
+
+#define SDSPI_DEFAULT_DMA 3
+#define ESP_INTR_CPU_AFFINITY_AUTO 0
+
+typedef struct {
+    int mosi_io_num;
+    int miso_io_num;
+    int sclk_io_num;
+    int quadwp_io_num;
+    int quadhd_io_num;
+    int data4_io_num;
+    int data5_io_num;
+    int data6_io_num;
+    int data7_io_num;
+    int data_io_default_level;
+    int max_transfer_sz;
+    unsigned flags;
+    int isr_cpu_id;
+    int intr_flags;
+} spi_bus_config_t;
+
+esp_err_t spi_bus_initialize(spi_host_device_t host_id, const spi_bus_config_t* bus_config,
+                             int dma_chan);
+esp_err_t spi_bus_free(spi_host_device_t host_id);
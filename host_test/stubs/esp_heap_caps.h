@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdlib.h>
+
+// No PSRAM on the host: every capability comes from the C heap
+#define MALLOC_CAP_SPIRAM (1 << 0)
+#define MALLOC_CAP_8BIT (1 << 1)
+#define MALLOC_CAP_DEFAULT (1 << 2)
+#define MALLOC_CAP_INTERNAL (1 << 3)
+#define MALLOC_CAP_DMA (1 << 4)
+
+static inline void* heap_caps_malloc(size_t size, unsigned caps) {
+    return malloc(size);
+}
+
+static inline void* heap_caps_calloc(size_t n, size_t size, unsigned caps) {
+    return calloc(n, size);
+}
+
+static inline void* heap_caps_aligned_alloc(size_t align, size_t size, unsigned caps) {
+    return aligned_alloc(align, (size + align - 1) / align * align);
+}
+
+static inline void heap_caps_free(void* ptr) {
+    free(ptr);
+}
+
+static inline void* heap_caps_malloc_prefer(size_t size, size_t num, ...) {
+    return malloc(size);
+}
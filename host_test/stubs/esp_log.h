@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdio.h>
+
+// Errors and warnings go to stderr; info and debug only with
+// FTP_HOST_VERBOSE set in the environment
+extern int host_log_verbose;
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...)                                         \
+    do {                                                                \
+        if (host_log_verbose) fprintf(stderr, "I %s: " fmt "\n", tag, ##__VA_ARGS__); \
+    } while (0)
+#define ESP_LOGD(tag, fmt, ...)                                         \
+    do {                                                                \
+        if (0) fprintf(stderr, fmt, ##__VA_ARGS__);  /* format checks only */ \
+    } while (0)
+#define ESP_LOGV(tag, fmt, ...) ESP_LOGD(tag, fmt, ##__VA_ARGS__)
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+static inline void esp_log_level_set(const char* tag, esp_log_level_t level) {}
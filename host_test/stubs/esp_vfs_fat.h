@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "esp_err.h"
+#include "sdmmc_cmd.h"
+
+typedef int wl_handle_t;
+
+typedef struct {
+    bool format_if_mount_failed;
+    int max_files;
+    size_t allocation_unit_size;
+    bool disk_status_check_enable;
+    bool use_one_fat;
+} esp_vfs_fat_mount_config_t;
+
+typedef esp_vfs_fat_mount_config_t esp_vfs_fat_sdmmc_mount_config_t;
+
+typedef struct {
+    spi_host_device_t host_id;
+    gpio_num_t gpio_cs;
+} sdspi_device_config_t;
+
+#define SDSPI_HOST_DEFAULT() \
+    { .slot = 1, .max_freq_khz = 20000 }
+#define SDSPI_DEVICE_CONFIG_DEFAULT() \
+    { .host_id = 1, .gpio_cs = 13 }
+
+// Mounting only records the drive numbers; host_fatfs.cpp hands out
+// drive 0 for flash and 1 for the card
+esp_err_t esp_vfs_fat_spiflash_mount_rw_wl(const char* base_path, const char* partition_label,
+                                           const esp_vfs_fat_mount_config_t* mount_config,
+                                           wl_handle_t* wl_handle);
+esp_err_t esp_vfs_fat_spiflash_unmount_rw_wl(const char* base_path, wl_handle_t wl_handle);
+esp_err_t esp_vfs_fat_sdspi_mount(const char* base_path, const sdmmc_host_t* host_config,
+                                  const sdspi_device_config_t* slot_config,
+                                  const esp_vfs_fat_mount_config_t* mount_config,
+                                  sdmmc_card_t** out_card);
+esp_err_t esp_vfs_fat_sdcard_unmount(const char* base_path, sdmmc_card_t* card);
+esp_err_t esp_vfs_fat_info(const char* base_path, uint64_t* out_total_bytes,
+                           uint64_t* out_free_bytes);
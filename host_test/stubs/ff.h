@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// The FatFs API used by filesystem.cpp, backed by the in-memory volume in
+// host_fatfs.cpp. Cluster numbers and fragment counts are made up, but a
+// link map has the size FatFs would ask for and is checked on every seek.
+#define FF_USE_FASTSEEK 1
+#define FF_MAX_LFN 255
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef unsigned int UINT;
+typedef uint64_t FSIZE_t;
+
+typedef enum {
+    FR_OK = 0,
+    FR_DISK_ERR,
+    FR_INT_ERR,
+    FR_NOT_READY,
+    FR_NO_FILE,
+    FR_NO_PATH,
+    FR_INVALID_NAME,
+    FR_DENIED,
+    FR_EXIST,
+    FR_INVALID_OBJECT,
+    FR_WRITE_PROTECTED,
+    FR_INVALID_DRIVE,
+    FR_NOT_ENABLED,
+    FR_NO_FILESYSTEM,
+    FR_MKFS_ABORTED,
+    FR_TIMEOUT,
+    FR_LOCKED,
+    FR_NOT_ENOUGH_CORE,
+    FR_TOO_MANY_OPEN_FILES,
+    FR_INVALID_PARAMETER
+} FRESULT;
+
+#define FA_READ 0x01
+#define FA_WRITE 0x02
+#define FA_OPEN_EXISTING 0x00
+#define FA_CREATE_NEW 0x04
+#define FA_CREATE_ALWAYS 0x08
+#define FA_OPEN_ALWAYS 0x10
+#define FA_OPEN_APPEND 0x30
+
+#define AM_DIR 0x10
+
+#define CREATE_LINKMAP ((FSIZE_t)0 - 1)
+
+typedef struct {
+    DWORD sclust;
+    FSIZE_t objsize;
+} FFOBJID;
+
+typedef struct {
+    FFOBJID obj;
+    BYTE flag;
+    FSIZE_t fptr;
+    DWORD* cltbl;
+    char host_path[FF_MAX_LFN + 8];
+} FIL;
+
+typedef struct {
+    char host_path[FF_MAX_LFN + 8];
+    UINT host_index;
+} FF_DIR;
+
+typedef struct {
+    FSIZE_t fsize;
+    WORD fdate;
+    WORD ftime;
+    BYTE fattrib;
+    char fname[FF_MAX_LFN + 1];
+} FILINFO;
+
+#define f_size(fp) ((fp)->obj.objsize)
+
+FRESULT f_open(FIL* fp, const char* path, BYTE mode);
+FRESULT f_close(FIL* fp);
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br);
+FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw);
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs);
+FRESULT f_opendir(FF_DIR* dp, const char* path);
+FRESULT f_readdir(FF_DIR* dp, FILINFO* fno);
+FRESULT f_closedir(FF_DIR* dp);
+
+// Newlib has strlcpy(), glibc only from 2.38
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char* dst, const char* src, size_t size);
+#endif
+
+// Host only: the volume behind "<pdrv>:/path". host_ff_put() creates or
+// replaces a file in that many fragments, on a new start cluster.
+void host_ff_put(const char* path, const char* data, size_t len, DWORD fragments);
+bool host_ff_remove(const char* path);
+// Link maps built with f_lseek(CREATE_LINKMAP), and seeks that used one
+extern int host_ff_link_maps_built;
+extern int host_ff_fast_seeks;
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+typedef struct host_sem* SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+void vSemaphoreDelete(SemaphoreHandle_t sem);
@@ -0,0 +1,13 @@
+#pragma once
+
+// lwIP's BSD socket API is the POSIX one
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define closesocket(s) close(s)
+// Linux sockaddr_in has no length field; the assignment lands in the padding
+#define sin_len sin_zero[0]
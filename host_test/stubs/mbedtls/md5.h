@@ -0,0 +1,23 @@
+#pragma once
+
+// mbedTLS MD5 API on OpenSSL
+#define OPENSSL_SUPPRESS_DEPRECATED  // The one-shot context API is all this needs
+#include <openssl/md5.h>
+
+typedef MD5_CTX mbedtls_md5_context;
+
+static inline void mbedtls_md5_init(mbedtls_md5_context* ctx) {}
+static inline void mbedtls_md5_free(mbedtls_md5_context* ctx) {}
+
+static inline int mbedtls_md5_starts(mbedtls_md5_context* ctx) {
+    return MD5_Init(ctx) ? 0 : -1;
+}
+
+static inline int mbedtls_md5_update(mbedtls_md5_context* ctx, const unsigned char* data,
+                                       size_t len) {
+    return MD5_Update(ctx, data, len) ? 0 : -1;
+}
+
+static inline int mbedtls_md5_finish(mbedtls_md5_context* ctx, unsigned char* out) {
+    return MD5_Final(out, ctx) ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// mbedTLS SHA1 API on OpenSSL
+#define OPENSSL_SUPPRESS_DEPRECATED  // The one-shot context API is all this needs
+#include <openssl/sha.h>
+
+typedef SHA_CTX mbedtls_sha1_context;
+
+static inline void mbedtls_sha1_init(mbedtls_sha1_context* ctx) {}
+static inline void mbedtls_sha1_free(mbedtls_sha1_context* ctx) {}
+
+static inline int mbedtls_sha1_starts(mbedtls_sha1_context* ctx) {
+    return SHA1_Init(ctx) ? 0 : -1;
+}
+
+static inline int mbedtls_sha1_update(mbedtls_sha1_context* ctx, const unsigned char* data,
+                                       size_t len) {
+    return SHA1_Update(ctx, data, len) ? 0 : -1;
+}
+
+static inline int mbedtls_sha1_finish(mbedtls_sha1_context* ctx, unsigned char* out) {
+    return SHA1_Final(out, ctx) ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// mbedTLS SHA256 API on OpenSSL
+#define OPENSSL_SUPPRESS_DEPRECATED  // The one-shot context API is all this needs
+#include <openssl/sha.h>
+
+typedef SHA256_CTX mbedtls_sha256_context;
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context* ctx) {}
+static inline void mbedtls_sha256_free(mbedtls_sha256_context* ctx) {}
+
+static inline int mbedtls_sha256_starts(mbedtls_sha256_context* ctx, int is224) {
+    return SHA256_Init(ctx) ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_update(mbedtls_sha256_context* ctx, const unsigned char* data,
+                                       size_t len) {
+    return SHA256_Update(ctx, data, len) ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_finish(mbedtls_sha256_context* ctx, unsigned char* out) {
+    return SHA256_Final(out, ctx) ? 0 : -1;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// mbedTLS SHA512 API on OpenSSL
+#define OPENSSL_SUPPRESS_DEPRECATED  // The one-shot context API is all this needs
+#include <openssl/sha.h>
+
+typedef SHA512_CTX mbedtls_sha512_context;
+
+static inline void mbedtls_sha512_init(mbedtls_sha512_context* ctx) {}
+static inline void mbedtls_sha512_free(mbedtls_sha512_context* ctx) {}
+
+static inline int mbedtls_sha512_starts(mbedtls_sha512_context* ctx, int is384) {
+    return SHA512_Init(ctx) ? 0 : -1;
+}
+
+static inline int mbedtls_sha512_update(mbedtls_sha512_context* ctx, const unsigned char* data,
+                                       size_t len) {
+    return SHA512_Update(ctx, data, len) ? 0 : -1;
+}
+
+static inline int mbedtls_sha512_finish(mbedtls_sha512_context* ctx, unsigned char* out) {
+    return SHA512_Final(out, ctx) ? 0 : -1;
+}
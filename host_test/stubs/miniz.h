@@ -0,0 +1,114 @@
+#pragma once
+
+// The tdefl/tinfl subset of the ROM miniz that ftpDeflate.cpp uses, on
+// zlib. Output is a valid zlib stream either way; only the exact bytes and
+// the compression ratio differ from the device.
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+typedef uint8_t mz_uint8;
+typedef uint32_t mz_uint32;
+
+enum {
+    TDEFL_MAX_PROBES_MASK = 0x00FFF,
+    TDEFL_WRITE_ZLIB_HEADER = 0x01000,
+    TDEFL_GREEDY_PARSING_FLAG = 0x04000
+};
+
+typedef enum {
+    TDEFL_STATUS_BAD_PARAM = -2,
+    TDEFL_STATUS_PUT_BUF_FAILED = -1,
+    TDEFL_STATUS_OKAY = 0,
+    TDEFL_STATUS_DONE = 1
+} tdefl_status;
+
+typedef enum {
+    TDEFL_NO_FLUSH = 0,
+    TDEFL_SYNC_FLUSH = 2,
+    TDEFL_FULL_FLUSH = 3,
+    TDEFL_FINISH = 4
+} tdefl_flush;
+
+// Set once a z_stream has been initialised in the state. ftpDeflate.cpp
+// allocates the state uninitialised and restarts streams in place.
+#define MINIZ_SHIM_LIVE 0x5A5A5A5Au
+
+typedef struct {
+    z_stream z;
+    uint32_t live;
+} tdefl_compressor;
+
+static inline tdefl_status tdefl_init(tdefl_compressor* d, void* put_buf_func, void* put_buf_user,
+                                      int flags) {
+    if (d->live == MINIZ_SHIM_LIVE) deflateEnd(&d->z);
+    memset(d, 0, sizeof(*d));
+    int probes = flags & TDEFL_MAX_PROBES_MASK;
+    int level = (probes <= 1) ? 1 : (probes <= 6) ? 2 : (probes <= 32) ? 5 : 9;
+    if (deflateInit(&d->z, level) != Z_OK) return TDEFL_STATUS_BAD_PARAM;
+    d->live = MINIZ_SHIM_LIVE;
+    return TDEFL_STATUS_OKAY;
+}
+
+static inline tdefl_status tdefl_compress(tdefl_compressor* d, const void* in, size_t* in_len,
+                                          void* out, size_t* out_len, tdefl_flush flush) {
+    d->z.next_in = (Bytef*)in;
+    d->z.avail_in = (uInt)*in_len;
+    d->z.next_out = (Bytef*)out;
+    d->z.avail_out = (uInt)*out_len;
+    int r = deflate(&d->z, (flush == TDEFL_FINISH) ? Z_FINISH : Z_NO_FLUSH);
+    *in_len -= d->z.avail_in;
+    *out_len -= d->z.avail_out;
+    if (r == Z_STREAM_END) return TDEFL_STATUS_DONE;
+    return (r == Z_OK || r == Z_BUF_ERROR) ? TDEFL_STATUS_OKAY : TDEFL_STATUS_BAD_PARAM;
+}
+
+enum {
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+    TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_LZ_DICT_SIZE = 32768
+};
+
+typedef enum {
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+// zlib keeps its own history, but the ROM inflate takes its matches from
+// the caller's wrapping 32 KB window. next_out holds where that window
+// must be written next, so a caller that gets the wrap wrong fails here
+// as it would on the device.
+typedef struct {
+    z_stream z;
+    uint32_t live;
+    size_t next_out;
+} tinfl_decompressor;
+
+static inline void tinfl_init(tinfl_decompressor* r) {
+    if (r->live == MINIZ_SHIM_LIVE) inflateEnd(&r->z);
+    memset(r, 0, sizeof(*r));
+    if (inflateInit(&r->z) == Z_OK) r->live = MINIZ_SHIM_LIVE;
+}
+
+static inline tinfl_status tinfl_decompress(tinfl_decompressor* r, const mz_uint8* in,
+                                            size_t* in_len, mz_uint8* out_start, mz_uint8* out,
+                                            size_t* out_len, mz_uint32 flags) {
+    size_t pos = out - out_start;
+    if (pos != r->next_out || *out_len == 0 || pos + *out_len > TINFL_LZ_DICT_SIZE) {
+        return TINFL_STATUS_FAILED;
+    }
+    r->z.next_in = (Bytef*)in;
+    r->z.avail_in = (uInt)*in_len;
+    r->z.next_out = out;
+    r->z.avail_out = (uInt)*out_len;
+    int res = inflate(&r->z, Z_NO_FLUSH);
+    *in_len -= r->z.avail_in;
+    *out_len -= r->z.avail_out;
+    r->next_out = (pos + *out_len) & (TINFL_LZ_DICT_SIZE - 1);
+    if (res == Z_STREAM_END) return TINFL_STATUS_DONE;
+    if (res != Z_OK && res != Z_BUF_ERROR) return TINFL_STATUS_FAILED;
+    return (r->z.avail_out == 0) ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_NEEDS_MORE_INPUT;
+}
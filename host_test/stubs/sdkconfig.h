@@ -0,0 +1,34 @@
+#pragma once
+
+// Kconfig values for the host build: the Kconfig.projbuild defaults, with
+// one more session and more passive ports so the concurrency tests have
+// room, and the passive range moved above the privileged ports
+#define CONFIG_FTP_USER "esp32"
+#define CONFIG_FTP_PASSWORD "esp32"
+#define CONFIG_FTP_PASSIVE_PORT 52024
+#define CONFIG_FTP_PASSIVE_PORT_COUNT 8
+#define CONFIG_FTP_MAX_SESSIONS 4
+#define CONFIG_FTP_RETR_READAHEAD 1
+#define CONFIG_FTP_SDCARD_IO_SIZE 16384
+#define CONFIG_FTP_DATA_IO_SIZE 4096
+#define CONFIG_FTP_STOR_SPOOL_SIZE 64
+#define CONFIG_FTP_DEFLATE_LEVEL 1
+#define CONFIG_FTP_HASH_CACHE_ENTRIES 32
+// CRC32 unless the build picks another transfer checksum, as the
+// bench_server_hash_* variants do
+#if !defined(CONFIG_FTP_TRANSFER_HASH_NONE) && !defined(CONFIG_FTP_TRANSFER_HASH_SELECTED)
+#define CONFIG_FTP_TRANSFER_HASH_CRC32 1
+#endif
+#define CONFIG_FTP_LIST_CACHE_SIZE 64
+#define CONFIG_FTP_LIST_CACHE_DIRS 4
+#define CONFIG_FTP_STAT_CACHE_ENTRIES 64
+#define CONFIG_FTP_DIR_INDEX_SIZE 1024
+#define CONFIG_FTP_DIR_INDEX_DIRS 2
+#define CONFIG_FTP_DIR_INDEX_MIN_ENTRIES 512
+#define CONFIG_FTP_FAST_SEEK_FILES 4
+#define CONFIG_FATFS_API_ENCODING_UTF_8 1
+#define CONFIG_WL_SECTOR_SIZE 4096
+#define CONFIG_SDCARD_MOSI_GPIO 11
+#define CONFIG_SDCARD_MISO_GPIO 13
+#define CONFIG_SDCARD_SCLK_GPIO 12
+#define CONFIG_SDCARD_CS_GPIO 10
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdio.h>
+
+typedef struct sdmmc_card_t sdmmc_card_t;
+
+typedef struct {
+    int slot;
+    int max_freq_khz;
+} sdmmc_host_t;
+
+void sdmmc_card_print_info(FILE* stream, const sdmmc_card_t* card);
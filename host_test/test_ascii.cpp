@@ -0,0 +1,96 @@
+// ftpAscii: the word-at-a-time LF search and the CRLF conversions against
+// byte-at-a-time references, at every alignment and chunking
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "ftpAscii.h"
+#include "test_check.h"
+
+using namespace FtpServer;
+
+int test_failures = 0;
+
+// LF becomes CRLF unless it already follows a CR, across chunk boundaries
+static std::string ref_encode(const std::string& in) {
+    std::string out;
+    char prev = 0;
+    for (char c : in) {
+        if (c == '\n' && prev != '\r') out += '\r';
+        out += c;
+        prev = c;
+    }
+    return out;
+}
+
+// CRLF becomes LF; a lone CR stays
+static std::string ref_decode(const std::string& in) {
+    std::string out;
+    for (size_t i = 0; i < in.size(); i++) {
+        if (in[i] == '\r' && i + 1 < in.size() && in[i + 1] == '\n') continue;
+        out += in[i];
+    }
+    return out;
+}
+
+static std::string random_text(size_t len) {
+    static const char ALPHABET[] = "ab\r\n\n\rxyz \t";
+    std::string s(len, 0);
+    for (char& c : s) c = ALPHABET[rand() % (sizeof(ALPHABET) - 1)];
+    return s;
+}
+
+static std::string encode_chunked(const std::string& in, size_t chunk, size_t misalign) {
+    std::string out;
+    std::vector<uint8_t> src(chunk + 16), dst(2 * chunk + 16);
+    bool cr = false;
+    for (size_t pos = 0; pos < in.size(); pos += chunk) {
+        size_t n = std::min(chunk, in.size() - pos);
+        memcpy(src.data() + misalign, in.data() + pos, n);
+        size_t len = ascii_encode(dst.data(), src.data() + misalign, n, &cr);
+        out.append((const char*)dst.data(), len);
+    }
+    return out;
+}
+
+// Mirrors Session::write_data(): a CR held back at the end of one chunk is
+// written before the next unless that one starts with LF
+static std::string decode_chunked(const std::string& in, size_t chunk, size_t misalign) {
+    std::string out;
+    std::vector<uint8_t> buf(chunk + 16);
+    bool cr = false;
+    for (size_t pos = 0; pos < in.size(); pos += chunk) {
+        size_t n = std::min(chunk, in.size() - pos);
+        memcpy(buf.data() + misalign, in.data() + pos, n);
+        if (ascii_cr_alone(cr, buf.data() + misalign, n)) out += '\r';
+        size_t len = ascii_decode(buf.data() + misalign, n, &cr);
+        out.append((const char*)buf.data() + misalign, len);
+    }
+    if (ascii_cr_alone(cr, nullptr, 0)) out += '\r';
+    return out;
+}
+
+int main() {
+    srand(1);
+    CHECK(encode_chunked("a\nb\r\nc\n", 64, 0) == "a\r\nb\r\nc\r\n");
+    CHECK(decode_chunked("a\r\nb\rc\r\n\r", 64, 0) == "a\nb\rc\n\r");
+    CHECK(decode_chunked("", 64, 0).empty());
+
+    for (int round = 0; round < 200; round++) {
+        std::string text = random_text(rand() % 3000);
+        std::string want_enc = ref_encode(text);
+        std::string want_dec = ref_decode(text);
+        for (size_t chunk : {1, 2, 3, 7, 8, 9, 64, 4096}) {
+            size_t misalign = rand() % 8;
+            CHECK(encode_chunked(text, chunk, misalign) == want_enc);
+            CHECK(decode_chunked(text, chunk, misalign) == want_dec);
+        }
+    }
+    // Long runs without line ends go through the word loop only
+    std::string flat(100000, 'q');
+    flat[77777] = '\n';
+    CHECK(encode_chunked(flat, 8192, 3) == ref_encode(flat));
+    TEST_MAIN_END();
+}
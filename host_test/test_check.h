@@ -0,0 +1,24 @@
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <stdio.h>
+
+// Minimal assertions for the host tests: a failed CHECK is reported and
+// counted, and the test binary exits non-zero at the end
+extern int test_failures;
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            test_failures++;                                                     \
+        }                                                                        \
+    } while (0)
+
+#define TEST_MAIN_END()                                                          \
+    do {                                                                         \
+        if (test_failures) fprintf(stderr, "%d check(s) failed\n", test_failures); \
+        return test_failures ? 1 : 0;                                            \
+    } while (0)
+
+#endif /* TEST_CHECK_H */
@@ -0,0 +1,272 @@
+#ifndef TEST_CLIENT_H
+#define TEST_CLIENT_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "sdkconfig.h"
+
+// Blocking FTP client with just enough of the protocol for the tests and
+// benchmarks
+class Client {
+public:
+    Client() : fd(-1) {}
+    ~Client() {
+        close_block();
+        disconnect();
+    }
+
+    bool connect_server() {
+        for (int attempt = 0; attempt < 50; attempt++) {
+            fd = connect_port(FTP_CMD_PORT);
+            if (fd >= 0) {
+                return reply() == 220;
+            }
+            usleep(100000);
+        }
+        return false;
+    }
+
+    bool login() {
+        return connect_server() && cmd("USER " CONFIG_FTP_USER) == 331 &&
+               cmd("PASS " CONFIG_FTP_PASSWORD) == 230;
+    }
+
+    void disconnect() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+
+    // Sends a command line and returns the reply code
+    int cmd(const std::string& line) {
+        std::string out = line + "\r\n";
+        if (send(fd, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size()) {
+            return -1;
+        }
+        return reply();
+    }
+
+    // Reads one reply, multi-line or not; the text is kept in last
+    int reply() {
+        last.clear();
+        std::string line;
+        if (!read_line(&line) || line.size() < 3) {
+            return -1;
+        }
+        last = line;
+        int code = atoi(line.substr(0, 3).c_str());
+        if (line.size() > 3 && line[3] == '-') {
+            std::string end = line.substr(0, 3) + " ";
+            do {
+                if (!read_line(&line)) return -1;
+                last += "\n" + line;
+            } while (line.compare(0, 4, end) != 0);
+        }
+        return code;
+    }
+
+    // PASV, or EPSV with use_epsv set, and a connection to the port it
+    // names
+    int open_data() {
+        if (use_epsv) {
+            size_t bars = std::string::npos;
+            if (cmd("EPSV") != 229 || (bars = last.find("(|||")) == std::string::npos) {
+                return -1;
+            }
+            return connect_port(atoi(last.c_str() + bars + 4));
+        }
+        if (cmd("PASV") != 227) {
+            return -1;
+        }
+        size_t open = last.find('(');
+        unsigned h[4], p[2];
+        if (open == std::string::npos ||
+            sscanf(last.c_str() + open, "(%u,%u,%u,%u,%u,%u)", &h[0], &h[1], &h[2], &h[3],
+                   &p[0], &p[1]) != 6) {
+            return -1;
+        }
+        return connect_port(p[0] * 256 + p[1]);
+    }
+
+    // RETR, LIST and the like: returns the final reply code, with the
+    // received data in *data. With drop_after, the data connection is
+    // reset once that much has arrived, as if the link had gone down.
+    int download(const std::string& line, std::string* data, size_t drop_after = SIZE_MAX) {
+        data->clear();
+        int dfd = open_data();
+        if (dfd < 0) {
+            return -1;
+        }
+        int code = cmd(line);
+        if (code != 150) {
+            close(dfd);
+            return code;
+        }
+        char buf[8192];
+        ssize_t n;
+        size_t paced = 0;
+        while (data->size() < drop_after && (n = recv(dfd, buf, sizeof(buf), 0)) > 0) {
+            data->append(buf, n);
+            if (pace_us && (paced += n) >= 32768) {
+                usleep(pace_us);
+                paced = 0;
+            }
+        }
+        close_data(dfd, data->size() >= drop_after);
+        return reply();
+    }
+
+    // STOR and APPE, with drop_after as for download()
+    int upload(const std::string& line, const std::string& data, size_t drop_after = SIZE_MAX) {
+        int dfd = open_data();
+        if (dfd < 0) {
+            return -1;
+        }
+        int code = cmd(line);
+        if (code != 150) {
+            close(dfd);
+            return code;
+        }
+        size_t end = std::min(data.size(), drop_after);
+        for (size_t pos = 0; pos < end;) {
+            ssize_t n = send(dfd, data.data() + pos, end - pos, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            pos += n;
+        }
+        close_data(dfd, end < data.size());
+        return reply();
+    }
+
+    // MODE B transfer on the data connection kept from the last one, or
+    // on a new one
+    int block_download(const std::string& line, std::string* data) {
+        data->clear();
+        if (block_fd < 0 && (block_fd = open_data()) < 0) {
+            return -1;
+        }
+        int code = cmd(line);
+        if (code != 150) {
+            return code;
+        }
+        uint8_t header[3];
+        do {
+            std::string block;
+            if (!recv_all(block_fd, header, sizeof(header)) ||
+                !recv_all(block_fd, &block, (header[1] << 8) | header[2])) {
+                return -1;
+            }
+            *data += block;
+        } while (!(header[0] & 0x40));  // EOF descriptor
+        return reply();
+    }
+
+    // MODE B upload on the data connection kept from the last transfer,
+    // or on a new one, in blocks of at most 64 KiB
+    int block_upload(const std::string& line, const std::string& data) {
+        if (block_fd < 0 && (block_fd = open_data()) < 0) {
+            return -1;
+        }
+        int code = cmd(line);
+        if (code != 150) {
+            return code;
+        }
+        size_t pos = 0;
+        do {
+            size_t len = std::min(data.size() - pos, (size_t)0xFFFF);
+            bool last = pos + len == data.size();
+            uint8_t header[3] = {(uint8_t)(last ? 0x40 : 0), (uint8_t)(len >> 8), (uint8_t)len};
+            if (send(block_fd, header, sizeof(header), MSG_NOSIGNAL) != sizeof(header) ||
+                (len && send(block_fd, data.data() + pos, len, MSG_NOSIGNAL) != (ssize_t)len)) {
+                return -1;
+            }
+            pos += len;
+        } while (pos < data.size());
+        return reply();
+    }
+
+    void close_block() {
+        if (block_fd >= 0) close(block_fd);
+        block_fd = -1;
+    }
+
+    std::string last;
+    bool use_epsv = false;
+    useconds_t pace_us = 0;  // Pause in download() after each 32 KiB
+
+private:
+    int fd;
+    int block_fd = -1;
+    std::string pending;
+
+    static int connect_port(unsigned port) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(s, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(s);
+            return -1;
+        }
+        timeval tv = {10, 0};
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        return s;
+    }
+
+    // Closes a data connection, with a reset instead of a FIN when drop
+    // is set
+    static void close_data(int s, bool drop) {
+        if (drop) {
+            linger lg = {1, 0};
+            setsockopt(s, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        }
+        close(s);
+    }
+
+    static bool recv_all(int s, void* buf, size_t len) {
+        for (size_t got = 0; got < len;) {
+            ssize_t n = recv(s, (char*)buf + got, len - got, 0);
+            if (n <= 0) return false;
+            got += n;
+        }
+        return true;
+    }
+
+    static bool recv_all(int s, std::string* out, size_t len) {
+        out->resize(len);
+        return recv_all(s, &(*out)[0], len);
+    }
+
+    bool read_line(std::string* line) {
+        size_t eol;
+        while ((eol = pending.find("\r\n")) == std::string::npos) {
+            char buf[512];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) return false;
+            pending.append(buf, n);
+        }
+        *line = pending.substr(0, eol);
+        pending.erase(0, eol + 2);
+        return true;
+    }
+};
+
+// Pseudo-random file contents, the same for the same seed
+static inline std::string pattern(size_t len, unsigned seed) {
+    std::string s(len, 0);
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245u + 12345u;
+        s[i] = (char)(seed >> 16);
+    }
+    return s;
+}
+
+#endif /* TEST_CLIENT_H */
@@ -0,0 +1,257 @@
+// filesystem.cpp over the in-memory FatFs of host_fatfs.cpp: drive path
+// translation, directory records, and the fast seek link maps kept across
+// opens, shared by readers and dropped when a file changes
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "ff.h"
+#include "filesystem.h"
+#include "sdkconfig.h"
+#include "test_check.h"
+
+int test_failures = 0;
+
+static std::string pattern(size_t len, int seed) {
+    std::string s(len, '\0');
+    for (size_t i = 0; i < len; i++) s[i] = (char)((i * 31 + seed) >> 3);
+    return s;
+}
+
+// Seeks to offset and reads len bytes, through storage_fseek() as REST and
+// RANG do
+static bool read_at(storage_file_t* file, uint64_t offset, const std::string& expect) {
+    std::string buf(expect.size(), '\0');
+    size_t done = 0;
+    return storage_fseek(file, offset) && storage_fread(file, &buf[0], buf.size(), &done) &&
+           done == expect.size() && buf == expect;
+}
+
+// Opens path, seeks into it and closes it again
+static bool seek_once(const char* path, const std::string& data) {
+    storage_file_t* file = storage_fopen(path, "rb");
+    if (file == nullptr) return false;
+    bool ok = read_at(file, data.size() / 2, data.substr(data.size() / 2, 100));
+    storage_fclose(file);
+    return ok;
+}
+
+static void test_paths() {
+    std::string data = pattern(1000, 1);
+    host_ff_put("0:/a.bin", data.data(), data.size(), 1);
+    host_ff_put("1:/dir/b.bin", data.data(), data.size(), 1);
+
+    // Mount points map onto their drive numbers; other paths do not open
+    storage_file_t* file = storage_fopen("/data/a.bin", "rb");
+    CHECK(file != nullptr && storage_fsize(file) == 1000);
+    storage_fclose(file);
+    file = storage_fopen("/sdcard/dir/b.bin", "rb");
+    CHECK(file != nullptr);
+    storage_fclose(file);
+    CHECK(storage_fopen("/datax/a.bin", "rb") == nullptr);
+    CHECK(storage_fopen("/data/missing.bin", "rb") == nullptr);
+    CHECK(storage_fopen("/data/a.bin", "w") == nullptr);
+    CHECK(storage_io_size("/sdcard/dir/b.bin") == CONFIG_FTP_SDCARD_IO_SIZE);
+    CHECK(storage_io_size("/data/a.bin") == CONFIG_FTP_DATA_IO_SIZE);
+
+    // The FAT date and time are decoded only when asked for
+    storage_dir_t* dir = storage_opendir("/sdcard/dir");
+    CHECK(dir != nullptr);
+    storage_dirent_t entry;
+    CHECK(storage_readdir(dir, &entry, false) && strcmp(entry.name, "b.bin") == 0 &&
+          entry.size == 0 && entry.mtime == 0);
+    CHECK(!storage_readdir(dir, &entry, true));
+    storage_closedir(dir);
+    dir = storage_opendir("/sdcard/dir");
+    struct tm tm = {};
+    tm.tm_year = 124;
+    tm.tm_mon = 4;
+    tm.tm_mday = 1;
+    tm.tm_hour = 12;
+    tm.tm_min = 34;
+    tm.tm_sec = 56;
+    tm.tm_isdst = -1;
+    CHECK(storage_readdir(dir, &entry, true) && entry.size == 1000 && entry.mtime == mktime(&tm));
+    storage_closedir(dir);
+
+    // Writes land in the file; a seek past the end fails
+    file = storage_fopen("/data/new.bin", "wb");
+    CHECK(file != nullptr && storage_fwrite(file, "hello", 5));
+    storage_fclose(file);
+    file = storage_fopen("/data/new.bin", "ab");
+    CHECK(file != nullptr && storage_fwrite(file, " world", 6));
+    storage_fclose(file);
+    file = storage_fopen("/data/new.bin", "rb");
+    CHECK(file != nullptr && read_at(file, 6, "world"));
+    CHECK(!storage_fseek(file, 12));
+    storage_fclose(file);
+}
+
+static void test_link_map_reuse() {
+    std::string data = pattern(100000, 2);
+    host_ff_put("1:/movie.bin", data.data(), data.size(), 10);
+    int built = host_ff_link_maps_built;
+    int seeks = host_ff_fast_seeks;
+
+    // Built on the first open, then kept for the next one
+    CHECK(seek_once("/sdcard/movie.bin", data));
+    CHECK(host_ff_link_maps_built == built + 1);
+    CHECK(seek_once("/sdcard/movie.bin", data));
+    CHECK(host_ff_link_maps_built == built + 1);
+    CHECK(host_ff_fast_seeks == seeks + 2);
+
+    // Two readers at once share one map
+    storage_file_t* a = storage_fopen("/sdcard/movie.bin", "rb");
+    storage_file_t* b = storage_fopen("/sdcard/movie.bin", "rb");
+    CHECK(a != nullptr && b != nullptr);
+    CHECK(read_at(a, 90000, data.substr(90000, 500)));
+    CHECK(read_at(b, 10, data.substr(10, 500)));
+    CHECK(read_at(a, 0, data.substr(0, 500)));
+    storage_fclose(a);
+    storage_fclose(b);
+    CHECK(host_ff_link_maps_built == built + 1);
+    CHECK(host_ff_fast_seeks == seeks + 5);
+
+    // An empty file needs no map
+    host_ff_put("1:/empty.bin", "", 0, 1);
+    storage_file_t* file = storage_fopen("/sdcard/empty.bin", "rb");
+    CHECK(file != nullptr && storage_fseek(file, 0));
+    storage_fclose(file);
+    CHECK(host_ff_link_maps_built == built + 1);
+}
+
+static void test_link_map_size() {
+    // More fragments than the first allocation holds: FatFs says how much
+    // it needs and the map is built again at that size
+    std::string data = pattern(50000, 3);
+    host_ff_put("1:/frag.bin", data.data(), data.size(), 200);
+    int built = host_ff_link_maps_built;
+    int seeks = host_ff_fast_seeks;
+    CHECK(seek_once("/sdcard/frag.bin", data));
+    CHECK(host_ff_link_maps_built == built + 1);
+    CHECK(host_ff_fast_seeks == seeks + 1);
+
+    // Too fragmented for the cap: seeks still work, without a map
+    host_ff_put("1:/shredded.bin", data.data(), data.size(), 5000);
+    CHECK(seek_once("/sdcard/shredded.bin", data));
+    CHECK(host_ff_link_maps_built == built + 1);
+    CHECK(host_ff_fast_seeks == seeks + 1);
+}
+
+static void test_link_map_invalidation() {
+    std::string data = pattern(60000, 4);
+    std::string other = pattern(60000, 5);
+    host_ff_put("1:/log.bin", data.data(), data.size(), 4);
+    CHECK(seek_once("/sdcard/log.bin", data));
+    int built = host_ff_link_maps_built;
+
+    // Opening for writing drops the map even when the size and start
+    // cluster stay the same. A reader holding it keeps using it until it
+    // closes.
+    storage_file_t* reader = storage_fopen("/sdcard/log.bin", "rb");
+    CHECK(reader != nullptr);
+    storage_file_t* writer = storage_fopen("/sdcard/log.bin", "r+b");
+    CHECK(writer != nullptr && storage_fwrite(writer, "HEAD", 4));
+    storage_fclose(writer);
+    CHECK(read_at(reader, 30000, data.substr(30000, 100)));
+    storage_fclose(reader);
+    data.replace(0, 4, "HEAD");
+    CHECK(seek_once("/sdcard/log.bin", data));
+    CHECK(host_ff_link_maps_built == built + 1);
+
+    // A file replaced behind the layer's back is on a new start cluster,
+    // so its old map is not used
+    host_ff_put("1:/log.bin", other.data(), other.size(), 4);
+    CHECK(seek_once("/sdcard/log.bin", other));
+    CHECK(host_ff_link_maps_built == built + 2);
+
+    // storage_file_changed() drops one path, or a whole tree
+    host_ff_put("1:/dir/a.bin", data.data(), data.size(), 2);
+    host_ff_put("1:/dirx/b.bin", data.data(), data.size(), 2);
+    CHECK(seek_once("/sdcard/dir/a.bin", data));
+    CHECK(seek_once("/sdcard/dirx/b.bin", data));
+    built = host_ff_link_maps_built;
+    storage_file_changed("/sdcard/dir/a", false);
+    CHECK(seek_once("/sdcard/dir/a.bin", data));
+    CHECK(host_ff_link_maps_built == built);
+    storage_file_changed("/sdcard/dir/a.bin", false);
+    CHECK(seek_once("/sdcard/dir/a.bin", data));
+    CHECK(host_ff_link_maps_built == built + 1);
+    storage_file_changed("/sdcard/dir", true);
+    CHECK(seek_once("/sdcard/dir/a.bin", data));
+    CHECK(seek_once("/sdcard/dirx/b.bin", data));
+    CHECK(host_ff_link_maps_built == built + 2);
+}
+
+static void test_link_map_eviction() {
+    const int FILES = CONFIG_FTP_FAST_SEEK_FILES;
+    std::string data = pattern(20000, 6);
+    char path[32], drive_path[32];
+    for (int i = 0; i <= FILES; i++) {
+        snprintf(drive_path, sizeof(drive_path), "1:/lru%d.bin", i);
+        host_ff_put(drive_path, data.data(), data.size(), 3);
+    }
+    storage_file_changed("/data", true);
+    storage_file_changed("/sdcard", true);
+
+    // One file more than there are maps pushes out the least recently used
+    int built = host_ff_link_maps_built;
+    for (int i = 0; i <= FILES; i++) {
+        snprintf(path, sizeof(path), "/sdcard/lru%d.bin", i);
+        CHECK(seek_once(path, data));
+    }
+    CHECK(host_ff_link_maps_built == built + FILES + 1);
+    CHECK(seek_once("/sdcard/lru1.bin", data));
+    CHECK(host_ff_link_maps_built == built + FILES + 1);
+    CHECK(seek_once("/sdcard/lru0.bin", data));
+    CHECK(host_ff_link_maps_built == built + FILES + 2);
+
+    // Maps in use are never taken; with all of them held a further file
+    // is read without one
+    storage_file_t* held[CONFIG_FTP_FAST_SEEK_FILES];
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/sdcard/lru%d.bin", i);
+        held[i] = storage_fopen(path, "rb");
+        CHECK(held[i] != nullptr);
+    }
+    built = host_ff_link_maps_built;
+    int seeks = host_ff_fast_seeks;
+    snprintf(path, sizeof(path), "/sdcard/lru%d.bin", FILES);
+    CHECK(seek_once(path, data));
+    CHECK(host_ff_link_maps_built == built && host_ff_fast_seeks == seeks);
+    for (int i = 0; i < FILES; i++) {
+        CHECK(read_at(held[i], 100, data.substr(100, 100)));
+        storage_fclose(held[i]);
+    }
+    CHECK(host_ff_fast_seeks == seeks + FILES);
+}
+
+static void test_unmount() {
+    // Unmounting the card drops its maps; the drive is found again on
+    // the next mount
+    std::string data = pattern(30000, 7);
+    host_ff_put("1:/card.bin", data.data(), data.size(), 2);
+    CHECK(seek_once("/sdcard/card.bin", data));
+    sdmmc_card_t* card = nullptr;
+    CHECK(mountSDCARD("/sdcard", &card) == ESP_OK);
+    int built = host_ff_link_maps_built;
+    unmountSDCARD("/sdcard", card);
+    CHECK(storage_fopen("/sdcard/card.bin", "rb") == nullptr);
+    CHECK(mountSDCARD("/sdcard", &card) == ESP_OK);
+    CHECK(seek_once("/sdcard/card.bin", data));
+    CHECK(host_ff_link_maps_built == built + 1);
+}
+
+int main() {
+    sdmmc_card_t* card = nullptr;
+    CHECK(mountFATFS("storage", "/data") == 0);
+    CHECK(mountSDCARD("/sdcard", &card) == ESP_OK);
+    test_paths();
+    test_link_map_reuse();
+    test_link_map_size();
+    test_link_map_invalidation();
+    test_link_map_eviction();
+    test_unmount();
+    TEST_MAIN_END();
+}
@@ -0,0 +1,215 @@
+// fsCache: ListCache, StatCache, HashCache and DirIndex lookups,
+// replacement and invalidation
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "fsCache.h"
+#include "test_check.h"
+
+using namespace FtpServer;
+
+int test_failures = 0;
+
+static storage_dirent_t dirent(const char* name, uint64_t size, time_t mtime, bool is_dir = false) {
+    storage_dirent_t e;
+    e.name = name;
+    e.size = size;
+    e.mtime = mtime;
+    e.is_dir = is_dir;
+    return e;
+}
+
+static void test_list_cache() {
+    ListCache cache;
+    CHECK(cache.init(4096, 4));
+    ListCache::cursor_t cur;
+    CHECK(!cache.open("/sdcard/a", &cur));
+
+    CHECK(cache.begin_fill("/sdcard/a", &cur));
+    storage_dirent_t one = dirent("one.bin", 100, 1000);
+    storage_dirent_t sub = dirent("sub", 0, 2000, true);
+    CHECK(cache.fill(&cur, &one));
+    CHECK(cache.fill(&cur, &sub));
+    cache.end_fill(&cur, true);
+
+    // A trailing slash names the same directory
+    CHECK(cache.open("/sdcard/a/", &cur));
+    storage_dirent_t e;
+    CHECK(cache.next(&cur, &e) && strcmp(e.name, "one.bin") == 0 && e.size == 100);
+    CHECK(cache.next(&cur, &e) && strcmp(e.name, "sub") == 0 && e.is_dir);
+    CHECK(!cache.next(&cur, &e));
+    cache.close(&cur);
+
+    fs_stat_t st;
+    CHECK(cache.find("/sdcard/a/one.bin", &st) && st.size == 100 && st.mtime == 1000);
+    CHECK(!cache.find("/sdcard/a/two.bin", &st));
+
+    // Invalidating a listing while a reader holds it takes effect on close
+    CHECK(cache.open("/sdcard/a", &cur));
+    cache.invalidate_parent("/sdcard/a/one.bin");
+    CHECK(cache.next(&cur, &e));
+    cache.close(&cur);
+    CHECK(!cache.open("/sdcard/a", &cur));
+
+    // An aborted or overflowing recording is not served
+    CHECK(cache.begin_fill("/sdcard/b", &cur));
+    cache.end_fill(&cur, false);
+    CHECK(!cache.open("/sdcard/b", &cur));
+    CHECK(cache.begin_fill("/sdcard/c", &cur));
+    std::string longname(200, 'x');
+    storage_dirent_t big = dirent(longname.c_str(), 1, 1);
+    bool fits = true;
+    for (int i = 0; i < 20 && fits; i++) fits = cache.fill(&cur, &big);
+    CHECK(!fits);
+    CHECK(!cache.open("/sdcard/c", &cur));
+
+    // Least recently used replacement, and tree invalidation
+    const char* dirs[] = {"/sdcard/d0", "/sdcard/d1", "/sdcard/d2", "/sdcard/d3", "/sdcard/d4"};
+    for (const char* dir : dirs) {
+        CHECK(cache.begin_fill(dir, &cur));
+        CHECK(cache.fill(&cur, &one));
+        cache.end_fill(&cur, true);
+    }
+    CHECK(!cache.open("/sdcard/d0", &cur));
+    CHECK(cache.open("/sdcard/d4", &cur));
+    cache.close(&cur);
+    cache.invalidate_tree("/sdcard");
+    CHECK(!cache.open("/sdcard/d4", &cur));
+    CHECK(cache.hits() > 0 && cache.misses() > 0);
+}
+
+static void test_stat_cache() {
+    StatCache cache;
+    CHECK(cache.init(4));
+    fs_stat_t st = {42, 1234, false};
+    fs_stat_t out;
+    CHECK(!cache.lookup("/sdcard/f", &out));
+    cache.insert("/sdcard/f", &st);
+    CHECK(cache.lookup("/sdcard/f", &out) && out.size == 42 && out.mtime == 1234);
+    st.size = 43;
+    cache.insert("/sdcard/f", &st);
+    CHECK(cache.lookup("/sdcard/f", &out) && out.size == 43);
+    cache.invalidate("/sdcard/f");
+    CHECK(!cache.lookup("/sdcard/f", &out));
+
+    char path[32];
+    for (int i = 0; i < 5; i++) {
+        snprintf(path, sizeof(path), "/sdcard/dir/f%d", i);
+        cache.insert(path, &st);
+    }
+    CHECK(!cache.lookup("/sdcard/dir/f0", &out));
+    CHECK(cache.lookup("/sdcard/dir/f4", &out));
+    cache.insert("/sdcard/dirx", &st);
+    cache.invalidate_tree("/sdcard/dir");
+    CHECK(!cache.lookup("/sdcard/dir/f4", &out));
+    CHECK(cache.lookup("/sdcard/dirx", &out));
+}
+
+static void test_hash_cache() {
+    HashCache cache;
+    CHECK(cache.init(4));
+    fs_stat_t st = {10, 500, false};
+    const uint8_t digest[4] = {1, 2, 3, 4};
+    uint8_t out[64];
+    cache.insert("/sdcard/h", &st, 4, digest, sizeof(digest));
+    CHECK(cache.lookup("/sdcard/h", &st, 4, out) == 4 && memcmp(out, digest, 4) == 0);
+    CHECK(cache.lookup("/sdcard/h", &st, 1, out) == 0);
+    // A changed file misses
+    fs_stat_t changed = {10, 502, false};
+    CHECK(cache.lookup("/sdcard/h", &changed, 4, out) == 0);
+    cache.invalidate("/sdcard/h");
+    CHECK(cache.lookup("/sdcard/h", &st, 4, out) == 0);
+}
+
+static void build_index(DirIndex* index, const char* dir, int count) {
+    int8_t slot;
+    CHECK(index->begin_build(dir, &slot));
+    char name[32];
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "file%03d.dat", i);
+        storage_dirent_t e = dirent(name, i, 1000 + i);
+        index->add(slot, &e);
+    }
+    storage_dirent_t dot = dirent(".", 0, 0, true);
+    index->add(slot, &dot);
+    index->end_build(slot, true);
+}
+
+static void test_dir_index() {
+    DirIndex index;
+    CHECK(index.init(64 * 1024, 2, 8));
+    fs_stat_t st;
+
+    // Directories below the threshold are not indexed
+    build_index(&index, "/sdcard/small", 4);
+    CHECK(index.find("/sdcard/small/file000.dat", &st) == DirIndex::E_INDEX_NONE);
+
+    build_index(&index, "/sdcard/big", 100);
+    CHECK(index.find("/sdcard/big/file042.dat", &st) == DirIndex::E_INDEX_FOUND);
+    CHECK(st.size == 42 && st.mtime == 1042 && !st.is_dir);
+    // FAT names match case-insensitively
+    CHECK(index.find("/sdcard/big/FILE042.DAT", &st) == DirIndex::E_INDEX_FOUND);
+    CHECK(index.find("/sdcard/big/nothere", &st) == DirIndex::E_INDEX_MISSING);
+    CHECK(index.find("/sdcard/big/.", &st) == DirIndex::E_INDEX_MISSING);
+    // Possible 8.3 aliases are never reported missing
+    CHECK(index.find("/sdcard/big/FILE04~1.DAT", &st) == DirIndex::E_INDEX_NONE);
+    CHECK(index.find("/sdcard/other/file042.dat", &st) == DirIndex::E_INDEX_NONE);
+
+    // Tombstones: removed names read as missing, later probes still pass them
+    for (int i = 0; i < 100; i += 2) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sdcard/big/file%03d.dat", i);
+        index.remove(path);
+    }
+    for (int i = 0; i < 100; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sdcard/big/file%03d.dat", i);
+        CHECK(index.find(path, &st) == (i % 2 ? DirIndex::E_INDEX_FOUND : DirIndex::E_INDEX_MISSING));
+    }
+    // Updating a removed name brings it back; new names are appended
+    fs_stat_t fresh = {7, 9000, false};
+    index.update("/sdcard/big/file000.dat", &fresh);
+    CHECK(index.find("/sdcard/big/file000.dat", &st) == DirIndex::E_INDEX_FOUND && st.size == 7);
+    index.update("/sdcard/big/new.dat", &fresh);
+    CHECK(index.find("/sdcard/big/new.dat", &st) == DirIndex::E_INDEX_FOUND && st.mtime == 9000);
+
+    // Renames carry the metadata
+    index.rename("/sdcard/big/new.dat", "/sdcard/big/renamed.dat");
+    CHECK(index.find("/sdcard/big/new.dat", &st) == DirIndex::E_INDEX_MISSING);
+    CHECK(index.find("/sdcard/big/renamed.dat", &st) == DirIndex::E_INDEX_FOUND && st.size == 7);
+
+    // Forgetting an entry drops the whole index of its directory
+    CHECK(index.covers("/sdcard/big/anything"));
+    CHECK(!index.covers("/sdcard/other/anything"));
+    index.forget("/sdcard/big/renamed.dat");
+    CHECK(!index.covers("/sdcard/big/anything"));
+    CHECK(index.find("/sdcard/big/file001.dat", &st) == DirIndex::E_INDEX_NONE);
+    build_index(&index, "/sdcard/big", 100);
+
+    // Changes while a listing is being indexed discard it
+    int8_t slot;
+    CHECK(index.begin_build("/sdcard/busy", &slot));
+    for (int i = 0; i < 10; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%d", i);
+        storage_dirent_t e = dirent(name, 1, 1);
+        index.add(slot, &e);
+    }
+    index.remove("/sdcard/busy/f3");
+    index.end_build(slot, true);
+    CHECK(index.find("/sdcard/busy/f1", &st) == DirIndex::E_INDEX_NONE);
+
+    index.invalidate_tree("/sdcard");
+    CHECK(index.find("/sdcard/big/file001.dat", &st) == DirIndex::E_INDEX_NONE);
+}
+
+int main() {
+    test_list_cache();
+    test_stat_cache();
+    test_hash_cache();
+    test_dir_index();
+    TEST_MAIN_END();
+}
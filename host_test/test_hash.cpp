@@ -0,0 +1,69 @@
+// ftpHash: CRC32 slicing against the bitwise definition, and the Hasher
+// digests against known vectors
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "ftpHash.h"
+#include "test_check.h"
+
+using namespace FtpServer;
+
+int test_failures = 0;
+
+static uint32_t crc32_bitwise(uint32_t crc, const uint8_t* data, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static std::string hex_digest(Hasher::algo_t algo, const char* text) {
+    Hasher h;
+    uint8_t digest[FTP_HASH_MAX_SIZE];
+    char hex[2 * FTP_HASH_MAX_SIZE + 1];
+    h.begin(algo);
+    h.update((const uint8_t*)text, strlen(text));
+    Hasher::to_hex(hex, digest, h.finish(digest));
+    return hex;
+}
+
+int main() {
+    const uint8_t* check = (const uint8_t*)"123456789";
+    CHECK(crc32_update(0, check, 9) == 0xCBF43926u);
+    CHECK(crc32_update(0, nullptr, 0) == 0);
+
+    // Every alignment and tail length, and split updates
+    std::vector<uint8_t> buf(4096 + 16);
+    srand(2);
+    for (uint8_t& b : buf) b = rand();
+    for (size_t align = 0; align < 8; align++) {
+        for (size_t len = 0; len < 80; len++) {
+            CHECK(crc32_update(0, buf.data() + align, len) == crc32_bitwise(0, buf.data() + align, len));
+        }
+        uint32_t whole = crc32_bitwise(0, buf.data() + align, 4096);
+        CHECK(crc32_update(0, buf.data() + align, 4096) == whole);
+        uint32_t split = crc32_update(0, buf.data() + align, 1001);
+        CHECK(crc32_update(split, buf.data() + align + 1001, 4096 - 1001) == whole);
+    }
+
+    CHECK(hex_digest(Hasher::E_HASH_CRC32, "123456789") == "cbf43926");
+    CHECK(hex_digest(Hasher::E_HASH_MD5, "abc") == "900150983cd24fb0d6963f7d28e17f72");
+    CHECK(hex_digest(Hasher::E_HASH_SHA1, "abc") == "a9993e364706816aba3e25717850c26c9cd0d89d");
+    CHECK(hex_digest(Hasher::E_HASH_SHA256, "abc") ==
+          "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    CHECK(hex_digest(Hasher::E_HASH_SHA512, "") ==
+          "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
+          "47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e");
+
+    Hasher::algo_t algo;
+    CHECK(Hasher::parse("SHA-256", &algo) && algo == Hasher::E_HASH_SHA256);
+    CHECK(Hasher::parse("crc32", &algo) && algo == Hasher::E_HASH_CRC32);
+    CHECK(!Hasher::parse("SHA-3", &algo));
+    CHECK(strcmp(Hasher::name(Hasher::E_HASH_MD5), "MD5") == 0);
+    TEST_MAIN_END();
+}
@@ -0,0 +1,698 @@
+// The server end to end over loopback: command lookup, REST and RANG
+// offsets, transfer types and modes, and several clients transferring at
+// once
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+#include "ftpServer.h"
+#include "test_check.h"
+#include "test_client.h"
+
+int test_failures = 0;
+
+// Every verb in the registry is found, in any case, and nothing else is
+static void test_registry() {
+    Client c;
+    CHECK(c.login());
+    static const char* const KNOWN[] = {
+        "SYST", "PWD", "XPWD", "CWD /sdcard", "CDUP", "TYPE I", "MODE S", "NOOP",
+        "SIZE nosuch", "MDTM nosuch", "DELE nosuch", "RMD nosuch", "MKD /sdcard/regdir",
+        "RMD /sdcard/regdir", "RNFR nosuch", "RNTO nosuch", "REST 0", "RANG 1 0",
+        "STAT", "MLST /sdcard", "HASH nosuch", "XCRC nosuch", "XMD5 nosuch",
+        "XSHA1 nosuch", "XSHA256 nosuch", "XSHA512 nosuch", "OPTS UTF8 ON", "AUTH TLS",
+        "FEAT", "syst", "Noop",
+    };
+    for (const char* line : KNOWN) {
+        int code = c.cmd(line);
+        if (code < 200 || code == 500 || code == 502) {
+            fprintf(stderr, "%s: %d\n", line, code);
+        }
+        CHECK(code >= 200 && code != 500 && code != 502);
+    }
+    CHECK(c.cmd("XYZZ") == 502);
+    CHECK(c.cmd("RETRX nosuch") == 502);
+    CHECK(c.cmd("XSHA2560") == 502);
+    CHECK(c.cmd("NOOP") == 200);
+}
+
+static void test_rest() {
+    Client c;
+    CHECK(c.login());
+    std::string file = pattern(100000, 1);
+    CHECK(c.upload("STOR /sdcard/rest.bin", file) == 226);
+
+    std::string data;
+    CHECK(c.cmd("REST 1000") == 350);
+    CHECK(c.download("RETR /sdcard/rest.bin", &data) == 226);
+    CHECK(data == file.substr(1000));
+    // The offset only applies to one transfer
+    CHECK(c.download("RETR /sdcard/rest.bin", &data) == 226);
+    CHECK(data == file);
+
+    CHECK(c.cmd("REST abc") == 501);
+    CHECK(c.cmd("REST -1") == 501);
+    CHECK(c.cmd("REST 12x") == 501);
+    CHECK(c.cmd("REST 18446744073709551616") == 501);
+    CHECK(c.cmd("REST 99999") == 350);
+    CHECK(c.download("RETR /sdcard/rest.bin", &data) == 226);
+    CHECK(data == file.substr(99999));
+
+    // A resumed upload overwrites the file from the offset on
+    CHECK(c.cmd("REST 50000") == 350);
+    CHECK(c.upload("STOR /sdcard/rest.bin", std::string(10, 'z')) == 226);
+    CHECK(c.download("RETR /sdcard/rest.bin", &data) == 226);
+    CHECK(data == file.replace(50000, 10, 10, 'z'));
+    CHECK(c.cmd("DELE /sdcard/rest.bin") == 250);
+}
+
+// A transfer cut off part way is resumed with REST from what made it
+// through, and the pieces join up to the whole file
+static void test_rest_after_drop() {
+    Client c;
+    CHECK(c.login());
+    std::string file = pattern(16 << 20, 6);
+    CHECK(c.upload("STOR /sdcard/resume.bin", file) == 226);
+
+    std::string head, rest;
+    CHECK(c.download("RETR /sdcard/resume.bin", &head, 1 << 20) == 426);
+    CHECK(head.size() >= (1 << 20) && head.size() < file.size());
+    CHECK(c.cmd("REST " + std::to_string(head.size())) == 350);
+    CHECK(c.download("RETR /sdcard/resume.bin", &rest) == 226);
+    CHECK(head + rest == file);
+
+    // The server keeps whatever reached it before the reset; SIZE says
+    // how much, and the upload goes on from there
+    std::string upload = pattern(4 << 20, 7);
+    int code = c.upload("STOR /sdcard/resume.bin", upload, 1 << 20);
+    CHECK(code == 226 || code == 426);
+    CHECK(c.cmd("SIZE /sdcard/resume.bin") == 213);
+    size_t stored = strtoul(c.last.c_str() + 4, nullptr, 10);
+    CHECK(stored <= (1 << 20));
+    CHECK(c.cmd("REST " + std::to_string(stored)) == 350);
+    CHECK(c.upload("STOR /sdcard/resume.bin", upload.substr(stored)) == 226);
+    CHECK(c.download("RETR /sdcard/resume.bin", &rest) == 226);
+    CHECK(rest == upload);
+    CHECK(c.cmd("DELE /sdcard/resume.bin") == 250);
+}
+
+static void test_rang() {
+    Client c;
+    CHECK(c.login());
+    std::string file = pattern(70000, 2);
+    CHECK(c.upload("STOR /sdcard/rang.bin", file) == 226);
+
+    std::string data;
+    CHECK(c.cmd("RANG 10 19") == 350);
+    CHECK(c.download("RETR /sdcard/rang.bin", &data) == 226);
+    CHECK(data == file.substr(10, 10));
+    // Ranges over several read-ahead buffers and past the end of the file
+    CHECK(c.cmd("RANG 5000 69998") == 350);
+    CHECK(c.download("RETR /sdcard/rang.bin", &data) == 226);
+    CHECK(data == file.substr(5000, 64999));
+    CHECK(c.cmd("RANG 69990 18446744073709551615") == 350);
+    CHECK(c.download("RETR /sdcard/rang.bin", &data) == 226);
+    CHECK(data == file.substr(69990));
+    CHECK(c.cmd("RANG 0 0") == 350);
+    CHECK(c.download("RETR /sdcard/rang.bin", &data) == 226);
+    CHECK(data == file.substr(0, 1));
+
+    CHECK(c.cmd("RANG 5 4") == 501);
+    CHECK(c.cmd("RANG 5") == 501);
+    CHECK(c.cmd("RANG a 4") == 501);
+    CHECK(c.download("RETR /sdcard/rang.bin", &data) == 226);
+    CHECK(data == file);
+
+    // RANG 1 0 clears a range; REST replaces one
+    CHECK(c.cmd("RANG 100 199") == 350);
+    CHECK(c.cmd("RANG 1 0") == 350);
+    CHECK(c.download("RETR /sdcard/rang.bin", &data) == 226);
+    CHECK(data == file);
+    CHECK(c.cmd("RANG 100 199") == 350);
+    CHECK(c.cmd("REST 7") == 350);
+    CHECK(c.download("RETR /sdcard/rang.bin", &data) == 226);
+    CHECK(data == file.substr(7));
+
+    // Ranged uploads are refused
+    CHECK(c.cmd("RANG 0 9") == 350);
+    CHECK(c.cmd("STOR /sdcard/rang.bin") == 504);
+    CHECK(c.cmd("DELE /sdcard/rang.bin") == 250);
+}
+
+// A file fetched in RANG segments over several sessions at once comes
+// back byte for byte, and faster with more segments when each connection
+// is slow on its own. The client paces its reads to stand in for a slow
+// link. Three segments at most, the sessions in sdkconfig.defaults.
+static void test_rang_segments() {
+    const size_t SIZE = 4 << 20;
+    std::string file = pattern(SIZE, 8);
+    {
+        Client c;
+        CHECK(c.login());
+        CHECK(c.upload("STOR /sdcard/segments.bin", file) == 226);
+    }
+    double rate[4] = {};
+    for (int n = 1; n <= 3; n++) {
+        std::vector<Client> clients(n);
+        std::vector<std::string> parts(n);
+        std::vector<int> codes(n, 0);
+        for (Client& c : clients) {
+            CHECK(c.login());
+            c.pace_us = 10000;
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < n; i++) {
+            threads.emplace_back([i, n, &clients, &parts, &codes, SIZE]() {
+                size_t first = SIZE * i / n;
+                size_t last = SIZE * (i + 1) / n - 1;
+                if (clients[i].cmd("RANG " + std::to_string(first) + " " +
+                                   std::to_string(last)) == 350) {
+                    codes[i] = clients[i].download("RETR /sdcard/segments.bin", &parts[i]);
+                }
+            });
+        }
+        for (std::thread& t : threads) t.join();
+        std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        rate[n] = SIZE / secs.count();
+        std::string joined;
+        for (int i = 0; i < n; i++) {
+            CHECK(codes[i] == 226);
+            joined += parts[i];
+        }
+        CHECK(joined == file);
+    }
+    CHECK(rate[2] > 1.5 * rate[1]);
+    CHECK(rate[3] > 2 * rate[1]);
+
+    Client c;
+    CHECK(c.login());
+    CHECK(c.cmd("DELE /sdcard/segments.bin") == 250);
+}
+
+// A RANG left pending by a client that went away does not apply to the
+// next client on the same session slot, whether it quit or dropped
+static void test_rang_not_inherited() {
+    std::string file = pattern(70000, 5);
+    std::string digest;
+    {
+        Client c;
+        CHECK(c.login());
+        CHECK(c.upload("STOR /sdcard/inherit.bin", file) == 226);
+        CHECK(c.cmd("HASH /sdcard/inherit.bin") == 213);
+        digest = c.last;
+        CHECK(c.cmd("QUIT") == 221);
+    }
+    for (bool quit : {true, false}) {
+        {
+            Client a;
+            CHECK(a.login());
+            CHECK(a.cmd("RANG 0 9") == 350);
+            if (quit) {
+                CHECK(a.cmd("QUIT") == 221);
+            }
+        }
+        usleep(100000);  // Lets the server see the connection close
+        Client b;
+        CHECK(b.login());
+        std::string data;
+        CHECK(b.download("RETR /sdcard/inherit.bin", &data) == 226);
+        CHECK(data == file);
+        CHECK(b.cmd("QUIT") == 221);
+    }
+    {
+        Client a;
+        CHECK(a.login());
+        CHECK(a.cmd("RANG 0 9") == 350);
+        CHECK(a.cmd("QUIT") == 221);
+    }
+    Client b;
+    CHECK(b.login());
+    CHECK(b.cmd("HASH /sdcard/inherit.bin") == 213);
+    CHECK(b.last == digest);
+    CHECK(b.cmd("DELE /sdcard/inherit.bin") == 250);
+}
+
+// A STAT listing goes out on the control connection; the transfers after
+// it are back on the data connection, with their encoding
+static void test_stat_then_retr() {
+    Client c;
+    CHECK(c.login());
+    CHECK(c.upload("STOR /sdcard/stat.txt", "one\ntwo\n") == 226);
+    std::string data;
+    CHECK(c.cmd("STAT /sdcard") == 213);
+    CHECK(c.last.find("stat.txt") != std::string::npos);
+    CHECK(c.cmd("TYPE A") == 200);
+    CHECK(c.download("RETR /sdcard/stat.txt", &data) == 226);
+    CHECK(data == "one\r\ntwo\r\n");
+    CHECK(c.cmd("TYPE I") == 200);
+
+    CHECK(c.cmd("MODE B") == 200);
+    CHECK(c.block_download("RETR /sdcard/stat.txt", &data) == 226);
+    CHECK(data == "one\ntwo\n");
+    CHECK(c.cmd("STAT /sdcard") == 213);
+    CHECK(c.block_download("RETR /sdcard/stat.txt", &data) == 226);
+    CHECK(data == "one\ntwo\n");
+    CHECK(c.cmd("MODE S") == 200);
+    c.close_block();
+    CHECK(c.cmd("DELE /sdcard/stat.txt") == 250);
+}
+
+// What a TYPE A upload of s should store: CRLF becomes LF, and any other
+// CR or LF is kept
+static std::string crlf_to_lf(const std::string& s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (!(s[i] == '\r' && i + 1 < s.size() && s[i + 1] == '\n')) {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+// TYPE A uploads turn CRLF into LF, also where a CRLF is split between
+// network reads or spool writes, in stream and block mode and for APPE
+static void test_type_a_stor() {
+    Client c;
+    CHECK(c.login());
+    // Dense line ends with bare CRs, lone LFs and CR CR LF runs
+    static const char ALPHABET[] = "ab\r\n\r\n";
+    std::string sent = pattern(300000, 11);
+    for (char& ch : sent) {
+        ch = ALPHABET[(uint8_t)ch % (sizeof(ALPHABET) - 1)];
+    }
+    // The spool is written out in whole I/O blocks; split a CRLF across
+    // every block boundary they can have
+    for (size_t pos = 4096; pos < sent.size(); pos += 4096) {
+        sent.replace(pos - 1, 2, "\r\n");
+    }
+    std::string tail = "\n" + sent.substr(0, 5000);
+    std::string data;
+
+    CHECK(c.cmd("TYPE A") == 200);
+    CHECK(c.upload("STOR /sdcard/typea.txt", sent) == 226);
+    CHECK(c.upload("APPE /sdcard/typea.txt", tail) == 226);
+    CHECK(c.cmd("TYPE I") == 200);
+    CHECK(c.download("RETR /sdcard/typea.txt", &data) == 226);
+    CHECK(data == crlf_to_lf(sent) + crlf_to_lf(tail));
+
+    CHECK(c.cmd("MODE B") == 200);
+    CHECK(c.cmd("TYPE A") == 200);
+    CHECK(c.block_upload("STOR /sdcard/typea.txt", sent) == 226);
+    CHECK(c.cmd("TYPE I") == 200);
+    CHECK(c.block_download("RETR /sdcard/typea.txt", &data) == 226);
+    CHECK(data == crlf_to_lf(sent));
+    CHECK(c.cmd("MODE S") == 200);
+    c.close_block();
+    CHECK(c.cmd("DELE /sdcard/typea.txt") == 250);
+}
+
+// A TYPE A upload ending in a lone CR keeps it, in the file and in the
+// checksum of the 226 reply, whichever way the last spool flush and the
+// end of the data race
+static void test_ascii_trailing_cr() {
+    Client c;
+    CHECK(c.login());
+    CHECK(c.cmd("TYPE A") == 200);
+    for (int round = 0; round < 40; round++) {
+        size_t len = 4096 << (round % 5);
+        std::string sent, stored;
+        while (sent.size() + 6 < len) {
+            sent += "line\r\n";
+            stored += "line\n";
+        }
+        std::string tail = std::string(len - 1 - sent.size(), 'x') + "\r";
+        sent += tail;
+        stored += tail;
+        CHECK(c.upload("STOR /sdcard/cr.txt", sent) == 226);
+        char expect[32];
+        snprintf(expect, sizeof(expect), "226 CRC32 %08lx",
+                 crc32(0, (const Bytef*)stored.data(), stored.size()));
+        CHECK(c.last == expect);
+        std::string data;
+        CHECK(c.cmd("TYPE I") == 200);
+        CHECK(c.download("RETR /sdcard/cr.txt", &data) == 226);
+        CHECK(data == stored);
+        CHECK(c.cmd("TYPE A") == 200);
+    }
+    CHECK(c.cmd("TYPE I") == 200);
+    CHECK(c.cmd("DELE /sdcard/cr.txt") == 250);
+}
+
+static std::string zlib_compress(const std::string& data) {
+    uLongf len = compressBound(data.size());
+    std::string z(len, 0);
+    compress2((Bytef*)&z[0], &len, (const Bytef*)data.data(), data.size(), 9);
+    z.resize(len);
+    return z;
+}
+
+// Inflates a zlib stream expected to hold size bytes; anything else,
+// including a longer stream, comes back as an empty string
+static std::string zlib_inflate(const std::string& z, size_t size) {
+    uLongf len = size + 1;
+    std::string data(len, 0);
+    if (uncompress((Bytef*)&data[0], &len, (const Bytef*)z.data(), z.size()) != Z_OK ||
+        len != size) {
+        return "";
+    }
+    data.resize(len);
+    return data;
+}
+
+// MODE Z uploads are inflated before they are stored, and downloads are a
+// zlib stream of the file. The repetitive file inflates to far more than
+// the inflater's 32 KB window per received chunk, so the window wraps
+// with compressed input still left over.
+static void test_mode_z() {
+    Client c;
+    CHECK(c.login());
+    std::string random = pattern(300000, 9);
+    std::string repetitive;
+    for (int i = 0; repetitive.size() < (2 << 20); i++) {
+        repetitive += "MODE Z line " + std::to_string(i % 10) + "\n";
+    }
+    std::string data;
+    for (const std::string* file : {&random, &repetitive}) {
+        CHECK(c.cmd("MODE Z") == 200);
+        CHECK(c.upload("STOR /sdcard/z.bin", zlib_compress(*file)) == 226);
+        CHECK(c.download("RETR /sdcard/z.bin", &data) == 226);
+        CHECK(zlib_inflate(data, file->size()) == *file);
+        CHECK(c.cmd("MODE S") == 200);
+        CHECK(c.download("RETR /sdcard/z.bin", &data) == 226);
+        CHECK(data == *file);
+    }
+
+    // A compressed stream that stops short is not a complete upload
+    std::string z = zlib_compress(random);
+    CHECK(c.cmd("MODE Z") == 200);
+    CHECK(c.upload("STOR /sdcard/z.bin", z.substr(0, z.size() / 2)) == 426);
+    CHECK(c.cmd("MODE S") == 200);
+    CHECK(c.cmd("DELE /sdcard/z.bin") == 250);
+}
+
+static std::string crc_reply(const std::string& data) {
+    char reply[32];
+    snprintf(reply, sizeof(reply), "226 CRC32 %08lx", crc32(0, (const Bytef*)data.data(), data.size()));
+    return reply;
+}
+
+// Checksum cache hits as STAT reports them
+static int checksum_hits(Client* c) {
+    int hits = -1;
+    size_t at;
+    if (c->cmd("STAT") == 211 && (at = c->last.find("Checksum cache: ")) != std::string::npos) {
+        sscanf(c->last.c_str() + at, "Checksum cache: %d", &hits);
+    }
+    return hits;
+}
+
+// The 226 reply of RETR, STOR and APPE carries the CRC32 of the file bytes
+// moved, whatever the type and mode. A whole-file one is kept in the
+// checksum cache for HASH.
+static void test_transfer_checksum() {
+    Client c;
+    CHECK(c.login());
+    std::string file = pattern(200000, 12);
+    std::string data;
+    CHECK(c.upload("STOR /sdcard/sum.bin", file) == 226);
+    CHECK(c.last == crc_reply(file));
+    CHECK(c.download("RETR /sdcard/sum.bin", &data) == 226 && data == file);
+    CHECK(c.last == crc_reply(file));
+
+    // Only the bytes a restarted, ranged or appending transfer moves
+    CHECK(c.cmd("REST 1000") == 350);
+    CHECK(c.download("RETR /sdcard/sum.bin", &data) == 226);
+    CHECK(c.last == crc_reply(file.substr(1000)));
+    CHECK(c.cmd("RANG 10 99") == 350);
+    CHECK(c.download("RETR /sdcard/sum.bin", &data) == 226);
+    CHECK(c.last == crc_reply(file.substr(10, 90)));
+    CHECK(c.upload("APPE /sdcard/sum.bin", "appended") == 226);
+    CHECK(c.last == crc_reply("appended"));
+    file += "appended";
+
+    // File bytes, not the bytes on the wire
+    CHECK(c.cmd("TYPE A") == 200);
+    CHECK(c.download("RETR /sdcard/sum.bin", &data) == 226);
+    CHECK(c.last == crc_reply(file));
+    CHECK(c.cmd("TYPE I") == 200);
+    CHECK(c.cmd("MODE Z") == 200);
+    CHECK(c.download("RETR /sdcard/sum.bin", &data) == 226);
+    CHECK(c.last == crc_reply(file));
+    CHECK(c.cmd("MODE S") == 200);
+
+    // HASH finds the digest of the last whole transfer in the cache
+    int hits = checksum_hits(&c);
+    CHECK(c.cmd("OPTS HASH CRC32") == 200);
+    CHECK(c.cmd("HASH /sdcard/sum.bin") == 213);
+    CHECK(c.last.find(crc_reply(file).substr(10) + " ") != std::string::npos);
+    CHECK(checksum_hits(&c) == hits + 1);
+
+    // A failed transfer has no checksum to report
+    CHECK(c.download("RETR /sdcard/sum.bin", &data, 1000) == 426);
+    CHECK(c.last.find("CRC32") == std::string::npos);
+    CHECK(c.cmd("DELE /sdcard/sum.bin") == 250);
+}
+
+// Failed commands leave a MODE B data connection open for the next
+// transfer
+static void test_block_keeps_data() {
+    Client c;
+    CHECK(c.login());
+    std::string file = pattern(40000, 3);
+    CHECK(c.upload("STOR /sdcard/block.bin", file) == 226);
+    std::string data;
+    CHECK(c.cmd("MODE B") == 200);
+    CHECK(c.block_download("RETR /sdcard/block.bin", &data) == 226);
+    CHECK(data == file);
+    CHECK(c.cmd("SIZE /sdcard/nosuch") == 550);
+    CHECK(c.cmd("MDTM /sdcard/nosuch") == 550);
+    CHECK(c.cmd("DELE /sdcard/nosuch") == 550);
+    CHECK(c.cmd("CWD /sdcard/nosuch") == 550);
+    CHECK(c.cmd("HASH /sdcard/nosuch") == 550);
+    CHECK(c.block_download("RETR /sdcard/nosuch", &data) == 550);
+    CHECK(c.block_download("RETR /sdcard/block.bin", &data) == 226);
+    CHECK(data == file);
+    CHECK(c.cmd("MODE S") == 200);
+    c.close_block();
+    CHECK(c.cmd("DELE /sdcard/block.bin") == 250);
+}
+
+// Transfers without a data connection are refused and leave nothing open
+static void test_no_data_connection() {
+    Client c;
+    CHECK(c.login());
+    std::string file = pattern(200000, 4);
+    CHECK(c.upload("STOR /sdcard/nodata.bin", file) == 226);
+    for (const char* line : {"RETR /sdcard/nodata.bin", "STOR /sdcard/nodata2.bin", "LIST /sdcard"}) {
+        int code = c.cmd(line);
+        if (code == 150) {
+            code = c.reply();
+        }
+        CHECK(code == 425);
+    }
+    CHECK(c.cmd("NOOP") == 200);
+    std::string data;
+    CHECK(c.download("RETR /sdcard/nodata.bin", &data) == 226);
+    CHECK(data == file);
+    CHECK(c.cmd("DELE /sdcard/nodata.bin") == 250);
+    c.cmd("DELE /sdcard/nodata2.bin");
+}
+
+// Waits for the first part of an odd second, so a time rounded down to
+// the 2 s FAT resolution would differ from what the file system records
+static void wait_odd_second() {
+    timespec now;
+    do {
+        usleep(20000);
+        clock_gettime(CLOCK_REALTIME, &now);
+    } while (!(now.tv_sec & 1) || now.tv_nsec > 300000000);
+}
+
+static std::string local_mdtm(const char* native) {
+    struct stat st;
+    if (stat(native, &st) != 0) {
+        return "";
+    }
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", localtime(&st.st_mtime));
+    return buf;
+}
+
+// Uploads and new directories in an indexed directory are recorded with
+// the size and time the file system has for them
+static void test_index_mtime() {
+    std::string dir = VFS_NATIVE_EXTERNAL_MP "/idx";
+    mkdir(dir.c_str(), 0755);
+    for (int i = 0; i < CONFIG_FTP_DIR_INDEX_MIN_ENTRIES + 8; i++) {
+        FILE* f = fopen((dir + "/f" + std::to_string(i)).c_str(), "w");
+        if (f) fclose(f);
+    }
+    Client c;
+    CHECK(c.login());
+    std::string list;
+    CHECK(c.download("NLST /sdcard/idx", &list) == 226);
+
+    wait_odd_second();
+    CHECK(c.upload("STOR /sdcard/idx/new.bin", std::string(1234, 'n')) == 226);
+    CHECK(c.cmd("SIZE /sdcard/idx/new.bin") == 213 && c.last == "213 1234");
+    CHECK(c.cmd("MDTM /sdcard/idx/new.bin") == 213);
+    CHECK(c.last == "213 " + local_mdtm((dir + "/new.bin").c_str()));
+
+    wait_odd_second();
+    CHECK(c.cmd("MKD /sdcard/idx/sub") == 250);
+    CHECK(c.cmd("MDTM /sdcard/idx/sub") == 213);
+    CHECK(c.last == "213 " + local_mdtm((dir + "/sub").c_str()));
+
+    CHECK(c.cmd("RMD /sdcard/idx/sub") == 250);
+    CHECK(c.cmd("DELE /sdcard/idx/new.bin") == 250);
+    for (int i = 0; i < CONFIG_FTP_DIR_INDEX_MIN_ENTRIES + 8; i++) {
+        unlink((dir + "/f" + std::to_string(i)).c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+// The MLST modify fact of a native file: UTC, unlike MDTM
+static std::string utc_modify(const std::string& native) {
+    struct stat st;
+    if (stat(native.c_str(), &st) != 0) {
+        return "";
+    }
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", gmtime(&st.st_mtime));
+    return buf;
+}
+
+// MLST and MLSD give the facts OPTS MLST selects, in a fixed order, with
+// size left out for directories and unknown fact names ignored
+static void test_mlst() {
+    std::string dir = VFS_NATIVE_EXTERNAL_MP "/mlst";
+    Client c;
+    CHECK(c.login());
+    CHECK(c.cmd("MKD /sdcard/mlst") == 250);
+    CHECK(c.upload("STOR /sdcard/mlst/a.txt", std::string(1234, 'm')) == 226);
+    CHECK(c.cmd("MKD /sdcard/mlst/sub") == 250);
+    std::string file_facts = "type=file;size=1234;modify=" + utc_modify(dir + "/a.txt") +
+                             ";perm=adfrw;";
+    std::string dir_facts = "type=dir;modify=" + utc_modify(dir + "/sub") + ";perm=cdeflmp;";
+
+    CHECK(c.cmd("FEAT") == 211);
+    CHECK(c.last.find("\n MLST type*;size*;modify*;perm*;\n") != std::string::npos);
+    CHECK(c.cmd("MLST /sdcard/mlst/a.txt") == 250);
+    CHECK(c.last == "250-Listing\n " + file_facts + " /sdcard/mlst/a.txt\n250 End");
+    CHECK(c.cmd("MLST /sdcard/mlst/sub") == 250);
+    CHECK(c.last == "250-Listing\n " + dir_facts + " /sdcard/mlst/sub\n250 End");
+    CHECK(c.cmd("MLST /sdcard/mlst/nosuch") == 550);
+
+    std::string list;
+    CHECK(c.download("MLSD /sdcard/mlst", &list) == 226);
+    CHECK(list.size() == file_facts.size() + dir_facts.size() + 14);  // Nothing else listed
+    CHECK(list.find(file_facts + " a.txt\r\n") != std::string::npos);
+    CHECK(list.find(dir_facts + " sub\r\n") != std::string::npos);
+
+    CHECK(c.cmd("OPTS MLST SIZE;bogus;type") == 200);
+    CHECK(c.last == "200 MLST OPTS type;size;");
+    CHECK(c.cmd("FEAT") == 211);
+    CHECK(c.last.find("\n MLST type*;size*;modify;perm;\n") != std::string::npos);
+    CHECK(c.cmd("MLST /sdcard/mlst/a.txt") == 250);
+    CHECK(c.last == "250-Listing\n type=file;size=1234; /sdcard/mlst/a.txt\n250 End");
+    CHECK(c.download("MLSD /sdcard/mlst", &list) == 226);
+    CHECK(list.find("type=file;size=1234; a.txt\r\n") != std::string::npos);
+    CHECK(list.find("type=dir; sub\r\n") != std::string::npos);
+
+    // No facts at all still leaves the space before the name
+    CHECK(c.cmd("OPTS MLST") == 200);
+    CHECK(c.last == "200 MLST OPTS ");
+    CHECK(c.cmd("MLST /sdcard/mlst/a.txt") == 250);
+    CHECK(c.last == "250-Listing\n  /sdcard/mlst/a.txt\n250 End");
+
+    CHECK(c.cmd("RMD /sdcard/mlst/sub") == 250);
+    CHECK(c.cmd("DELE /sdcard/mlst/a.txt") == 250);
+    CHECK(c.cmd("RMD /sdcard/mlst") == 250);
+}
+
+// After EPSV ALL only EPSV sets up data connections, until the session
+// ends
+static void test_epsv_all() {
+    Client c;
+    CHECK(c.login());
+    std::string list;
+    CHECK(c.download("LIST /sdcard", &list) == 226);
+    CHECK(c.cmd("EPSV ALL") == 200);
+    CHECK(c.cmd("PASV") == 503);
+    c.use_epsv = true;
+    CHECK(c.download("LIST /sdcard", &list) == 226);
+    CHECK(c.cmd("PASV") == 503);
+    CHECK(c.cmd("QUIT") == 221);
+
+    Client next;
+    CHECK(next.login());
+    CHECK(next.download("LIST /sdcard", &list) == 226);
+}
+
+// Several sessions storing, reading back and listing at the same time
+static void test_multi_client() {
+    const int CLIENTS = CONFIG_FTP_MAX_SESSIONS;
+    std::vector<std::thread> threads;
+    std::vector<int> ok(CLIENTS, 0);
+    for (int i = 0; i < CLIENTS; i++) {
+        threads.emplace_back([i, &ok]() {
+            Client c;
+            if (!c.login()) return;
+            std::string name = "/sdcard/multi" + std::to_string(i) + ".bin";
+            std::string file = pattern(300000 + i * 1000, 10 + i);
+            std::string data, list;
+            bool good = true;
+            for (int round = 0; round < 3 && good; round++) {
+                good = c.upload("STOR " + name, file) == 226 &&
+                       c.download("RETR " + name, &data) == 226 && data == file &&
+                       c.download("LIST /sdcard", &list) == 226 &&
+                       list.find(name.substr(8)) != std::string::npos;
+            }
+            good = good && c.cmd("DELE " + name) == 250 && c.cmd("QUIT") == 221;
+            ok[i] = good;
+        });
+    }
+    for (std::thread& t : threads) t.join();
+    for (int i = 0; i < CLIENTS; i++) {
+        CHECK(ok[i]);
+    }
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    FtpServer::Server* server = new FtpServer::Server();
+    server->start();
+    test_registry();
+    test_rest();
+    test_rest_after_drop();
+    test_rang();
+    test_rang_not_inherited();
+    test_rang_segments();
+    test_stat_then_retr();
+    test_type_a_stor();
+    test_ascii_trailing_cr();
+    test_block_keeps_data();
+    test_mode_z();
+    test_transfer_checksum();
+    test_no_data_connection();
+    test_index_mtime();
+    test_mlst();
+    test_epsv_all();
+    test_multi_client();
+    server->stop();
+    delete server;
+    TEST_MAIN_END();
+}
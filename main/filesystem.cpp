@@ -1,10 +1,18 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 #include "esp_vfs_fat.h"
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
 #include "sdmmc_cmd.h"
+#include "ff.h"
+#include "diskio_sdmmc.h"
+#include "diskio_wl.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "filesystem.h"
 #include "ftpServer.h"  // For VFS_NATIVE_INTERNAL_MP and VFS_NATIVE_EXTERNAL_MP
 
@@ -15,6 +23,105 @@ static const char *TAG = "FILESYSTEM";
 #define SD_ALLOCATION_UNIT (16 * 1024)
 #define SD_MAX_FREQ_KHZ 20000
 #define SPI_MAX_TRANSFER_SZ 4000
+#define FAT_MOUNTS_MAX 2
+#define FAT_MOUNT_POINT_LEN 16
+#define FAT_PDRV_NONE 0xFF
+#define FAT_PATH_MAX 128
+#define FAT_LINK_MAP_FILES CONFIG_FTP_FAST_SEEK_FILES
+#define FAT_LINK_MAP_MIN 32      // DWORDs, enough for 15 fragments
+#define FAT_LINK_MAP_MAX 8192    // DWORDs; more fragmented files seek by walking the FAT
+
+// FatFs drive number behind each VFS mount point, so listings can call
+// f_readdir() directly and keep the metadata the VFS layer drops
+typedef struct {
+    char mount_point[FAT_MOUNT_POINT_LEN];
+    BYTE pdrv;
+} fat_mount_t;
+
+static fat_mount_t s_fat_mounts[FAT_MOUNTS_MAX] = {
+    {"", FAT_PDRV_NONE},
+    {"", FAT_PDRV_NONE},
+};
+
+struct storage_dir {
+    FF_DIR dir;
+    FILINFO info;
+};
+
+// Cluster link map of a recently read file. Building one walks the whole
+// FAT chain, so maps outlive the open file and are shared by everyone
+// reading it; a map is only reused while the start cluster and size still
+// match.
+typedef struct {
+    char path[FAT_PATH_MAX];
+    DWORD sclust;
+    FSIZE_t size;
+    DWORD* map;
+    uint32_t last_used;
+    uint8_t users;
+    bool stale;
+} fat_link_map_t;
+
+static fat_link_map_t s_link_maps[(FAT_LINK_MAP_FILES > 0) ? FAT_LINK_MAP_FILES : 1];
+static uint32_t s_link_map_tick = 0;
+
+struct storage_file {
+    FIL fil;
+    fat_link_map_t* link_map;
+};
+
+static SemaphoreHandle_t link_map_lock() {
+    static SemaphoreHandle_t lock = xSemaphoreCreateMutex();
+    return lock;
+}
+
+static bool path_matches(const char* path, const char* prefix, bool tree) {
+    size_t len = strlen(prefix);
+    if (strncmp(path, prefix, len) != 0) {
+        return false;
+    }
+    return path[len] == '\0' || (tree && (path[len] == '/' || (len > 0 && prefix[len - 1] == '/')));
+}
+
+static void drop_link_maps(const char* path, bool tree) {
+    if (FAT_LINK_MAP_FILES == 0) {
+        return;
+    }
+    xSemaphoreTake(link_map_lock(), portMAX_DELAY);
+    for (fat_link_map_t& entry : s_link_maps) {
+        if (entry.map == nullptr || !path_matches(entry.path, path, tree)) {
+            continue;
+        }
+        if (entry.users > 0) {
+            entry.stale = true;  // Freed by the last reader
+        } else {
+            heap_caps_free(entry.map);
+            entry.map = nullptr;
+        }
+    }
+    xSemaphoreGive(link_map_lock());
+}
+
+static void remember_drive(const char* mount_point, BYTE pdrv) {
+    for (fat_mount_t& mount : s_fat_mounts) {
+        if (mount.pdrv == FAT_PDRV_NONE || strcmp(mount.mount_point, mount_point) == 0) {
+            strlcpy(mount.mount_point, mount_point, sizeof(mount.mount_point));
+            mount.pdrv = pdrv;
+            return;
+        }
+    }
+    ESP_LOGW(TAG, "No slot to remember drive for %s", mount_point);
+}
+
+static void forget_drive(const char* mount_point) {
+    drop_link_maps(mount_point, true);
+    for (fat_mount_t& mount : s_fat_mounts) {
+        if (strcmp(mount.mount_point, mount_point) == 0) {
+            mount.mount_point[0] = '\0';
+            mount.pdrv = FAT_PDRV_NONE;
+        }
+    }
+}
 
 wl_handle_t mountFATFS(const char* partition_label, const char* mount_point) {
     ESP_LOGI(TAG, "Initializing FATFS on Builtin SPI Flash Memory");
@@ -37,8 +144,9 @@ wl_handle_t mountFATFS(const char* partition_label, const char* mount_point) {
     if (ret != ESP_OK) {
         ESP_LOGW(TAG, "Failed to get FATFS partition information (%s)", esp_err_to_name(ret));
     } else {
-        ESP_LOGI(TAG, "Partition size: total: %llu, free: %llu", total, free);
+        ESP_LOGI(TAG, "Partition size: total: %" PRIu64 ", free: %" PRIu64, total, free);
     }
+    remember_drive(mount_point, ff_diskio_get_pdrv_wl(s_wl_handle));
     ESP_LOGI(TAG, "Mount FATFS on %s", mount_point);
     ESP_LOGI(TAG, "s_wl_handle=%" PRIi32, s_wl_handle);
     return s_wl_handle;
@@ -97,6 +205,7 @@ esp_err_t mountSDCARD(const char* mount_point, sdmmc_card_t** out_card) {
         return ret;
     }
 
+    remember_drive(mount_point, ff_diskio_get_pdrv_card(*out_card));
     sdmmc_card_print_info(stdout, *out_card);
     ESP_LOGI(TAG, "Mounted SD card on %s", mount_point);
     return ret;
@@ -107,6 +216,7 @@ void unmountFATFS(const char* mount_point, wl_handle_t wl_handle) {
         ESP_LOGW(TAG, "Invalid FATFS unmount parameters");
         return;
     }
+    forget_drive(mount_point);
     esp_err_t ret = esp_vfs_fat_spiflash_unmount_rw_wl(mount_point, wl_handle);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to unmount FATFS (%s)", esp_err_to_name(ret));
@@ -120,6 +230,7 @@ void unmountSDCARD(const char* mount_point, sdmmc_card_t* card) {
         ESP_LOGW(TAG, "Invalid SD card unmount parameters");
         return;
     }
+    forget_drive(mount_point);
     esp_err_t ret = esp_vfs_fat_sdcard_unmount(mount_point, card);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to unmount SD card (%s)", esp_err_to_name(ret));
@@ -144,3 +255,237 @@ void log_storage_info() {
         ESP_LOGW(TAG, "Failed to get SD card storage info");
     }
 }
+
+// Block size used for file transfers on the mount holding `path`. It is a
+// multiple of that mount's allocation unit so FatFs moves whole clusters
+// with multi-block SD/flash commands.
+size_t storage_io_size(const char* path) {
+    if (strncmp(path, VFS_NATIVE_EXTERNAL_MP, strlen(VFS_NATIVE_EXTERNAL_MP)) == 0) {
+        return CONFIG_FTP_SDCARD_IO_SIZE;
+    }
+    return CONFIG_FTP_DATA_IO_SIZE;
+}
+
+// Translates a VFS path into the FatFs "<pdrv>:/path" form
+static bool get_drive_path(const char* path, char* drive_path, size_t size) {
+    for (const fat_mount_t& mount : s_fat_mounts) {
+        size_t len = strlen(mount.mount_point);
+        if (mount.pdrv == FAT_PDRV_NONE || strncmp(path, mount.mount_point, len) != 0 ||
+            (path[len] != '/' && path[len] != '\0')) {
+            continue;
+        }
+        snprintf(drive_path, size, "%u:%s", mount.pdrv, path[len] ? path + len : "/");
+        return true;
+    }
+    return false;
+}
+
+storage_dir_t* storage_opendir(const char* path) {
+    char drive_path[FF_MAX_LFN + 8];
+    if (!get_drive_path(path, drive_path, sizeof(drive_path))) {
+        return nullptr;
+    }
+    storage_dir_t* dir = (storage_dir_t*)malloc(sizeof(storage_dir_t));
+    if (dir == nullptr) {
+        return nullptr;
+    }
+    if (f_opendir(&dir->dir, drive_path) != FR_OK) {
+        free(dir);
+        return nullptr;
+    }
+    return dir;
+}
+
+bool storage_readdir(storage_dir_t* dir, storage_dirent_t* entry, bool with_meta) {
+    if (f_readdir(&dir->dir, &dir->info) != FR_OK || dir->info.fname[0] == '\0') {
+        return false;
+    }
+    entry->name = dir->info.fname;
+    entry->is_dir = (dir->info.fattrib & AM_DIR) != 0;
+    entry->size = 0;
+    entry->mtime = 0;
+    if (with_meta) {
+        // Same conversion the VFS layer applies in stat()
+        struct tm tm = {};
+        tm.tm_year = ((dir->info.fdate >> 9) & 0x7F) + 80;
+        tm.tm_mon = ((dir->info.fdate >> 5) & 0x0F) - 1;
+        tm.tm_mday = dir->info.fdate & 0x1F;
+        tm.tm_hour = (dir->info.ftime >> 11) & 0x1F;
+        tm.tm_min = (dir->info.ftime >> 5) & 0x3F;
+        tm.tm_sec = (dir->info.ftime & 0x1F) * 2;
+        tm.tm_isdst = -1;
+        entry->size = dir->info.fsize;
+        entry->mtime = mktime(&tm);
+    }
+    return true;
+}
+
+void storage_closedir(storage_dir_t* dir) {
+    if (dir) {
+        f_closedir(&dir->dir);
+        free(dir);
+    }
+}
+
+#if FF_USE_FASTSEEK
+// The map needs two entries per fragment. The first try covers a lightly
+// fragmented file; otherwise FatFs reports the size it needs.
+static DWORD* build_link_map(FIL* fil) {
+    DWORD len = FAT_LINK_MAP_MIN;
+    while (len <= FAT_LINK_MAP_MAX) {
+        DWORD* map = (DWORD*)heap_caps_malloc_prefer(len * sizeof(DWORD), 2,
+                                                     MALLOC_CAP_SPIRAM, MALLOC_CAP_DEFAULT);
+        if (map == nullptr) {
+            return nullptr;
+        }
+        map[0] = len;
+        fil->cltbl = map;
+        FRESULT res = f_lseek(fil, CREATE_LINKMAP);
+        fil->cltbl = nullptr;
+        if (res == FR_OK) {
+            return map;
+        }
+        DWORD needed = map[0];
+        heap_caps_free(map);
+        if (res != FR_NOT_ENOUGH_CORE || needed <= len) {
+            return nullptr;
+        }
+        len = needed;
+    }
+    ESP_LOGD(TAG, "File too fragmented for a link map");
+    return nullptr;
+}
+#endif
+
+static void attach_link_map(storage_file_t* file, const char* path) {
+#if FF_USE_FASTSEEK
+    if (FAT_LINK_MAP_FILES == 0 || f_size(&file->fil) == 0 ||
+        strlen(path) >= FAT_PATH_MAX) {
+        return;
+    }
+    xSemaphoreTake(link_map_lock(), portMAX_DELAY);
+    fat_link_map_t* found = nullptr;
+    fat_link_map_t* victim = nullptr;
+    for (fat_link_map_t& entry : s_link_maps) {
+        if (entry.map != nullptr && !entry.stale && strcmp(entry.path, path) == 0 &&
+            entry.sclust == file->fil.obj.sclust && entry.size == f_size(&file->fil)) {
+            found = &entry;
+            break;
+        }
+        if (entry.users > 0) {
+            continue;
+        }
+        // An empty slot first, then the least recently used map
+        if (victim == nullptr || (victim->map != nullptr &&
+                                  (entry.map == nullptr || entry.last_used < victim->last_used))) {
+            victim = &entry;
+        }
+    }
+    if (found == nullptr && victim != nullptr) {
+        if (victim->map != nullptr) {
+            heap_caps_free(victim->map);
+        }
+        victim->map = build_link_map(&file->fil);
+        if (victim->map != nullptr) {
+            strlcpy(victim->path, path, sizeof(victim->path));
+            victim->sclust = file->fil.obj.sclust;
+            victim->size = f_size(&file->fil);
+            victim->stale = false;
+            found = victim;
+        }
+    }
+    if (found != nullptr) {
+        found->users++;
+        found->last_used = ++s_link_map_tick;
+        file->fil.cltbl = found->map;
+        file->link_map = found;
+    }
+    xSemaphoreGive(link_map_lock());
+#endif
+}
+
+static void release_link_map(storage_file_t* file) {
+    fat_link_map_t* entry = file->link_map;
+    if (entry == nullptr) {
+        return;
+    }
+    xSemaphoreTake(link_map_lock(), portMAX_DELAY);
+    entry->users--;
+    if (entry->stale && entry->users == 0) {
+        heap_caps_free(entry->map);
+        entry->map = nullptr;
+    }
+    xSemaphoreGive(link_map_lock());
+    file->link_map = nullptr;
+}
+
+storage_file_t* storage_fopen(const char* path, const char* mode) {
+    BYTE flags;
+    if (strcmp(mode, "rb") == 0) {
+        flags = FA_READ | FA_OPEN_EXISTING;
+    } else if (strcmp(mode, "wb") == 0) {
+        flags = FA_WRITE | FA_CREATE_ALWAYS;
+    } else if (strcmp(mode, "ab") == 0) {
+        flags = FA_WRITE | FA_OPEN_APPEND;
+    } else if (strcmp(mode, "r+b") == 0) {
+        flags = FA_READ | FA_WRITE | FA_OPEN_EXISTING;
+    } else {
+        return nullptr;
+    }
+    char drive_path[FF_MAX_LFN + 8];
+    if (!get_drive_path(path, drive_path, sizeof(drive_path))) {
+        return nullptr;
+    }
+    if (flags & FA_WRITE) {
+        // The cluster chain is about to change
+        drop_link_maps(path, false);
+    }
+    storage_file_t* file = (storage_file_t*)malloc(sizeof(storage_file_t));
+    if (file == nullptr) {
+        return nullptr;
+    }
+    file->link_map = nullptr;
+    if (f_open(&file->fil, drive_path, flags) != FR_OK) {
+        free(file);
+        return nullptr;
+    }
+    if (!(flags & FA_WRITE)) {
+        attach_link_map(file, path);
+    }
+    return file;
+}
+
+bool storage_fread(storage_file_t* file, void* buf, size_t len, size_t* done) {
+    UINT read = 0;
+    FRESULT res = f_read(&file->fil, buf, len, &read);
+    *done = read;
+    return res == FR_OK;
+}
+
+bool storage_fwrite(storage_file_t* file, const void* buf, size_t len) {
+    UINT written = 0;
+    return f_write(&file->fil, buf, len, &written) == FR_OK && written == len;
+}
+
+bool storage_fseek(storage_file_t* file, uint64_t offset) {
+    if (offset > (uint64_t)f_size(&file->fil)) {
+        return false;
+    }
+    return f_lseek(&file->fil, (FSIZE_t)offset) == FR_OK;
+}
+
+uint64_t storage_fsize(storage_file_t* file) {
+    return f_size(&file->fil);
+}
+
+void storage_fclose(storage_file_t* file) {
+    if (file) {
+        f_close(&file->fil);
+        release_link_map(file);
+        free(file);
+    }
+}
+
+void storage_file_changed(const char* path, bool tree) {
+    drop_link_maps(path, tree);
+}
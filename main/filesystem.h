@@ -1,6 +1,8 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include <stdint.h>
+#include <time.h>
 #include "esp_err.h"
 #include "sdmmc_cmd.h"
 #include "esp_vfs_fat.h"
@@ -10,5 +12,41 @@ void unmountFATFS(const char* mount_point, wl_handle_t wl_handle);
 esp_err_t mountSDCARD(const char* mount_point, sdmmc_card_t** card);
 void unmountSDCARD(const char* mount_point, sdmmc_card_t* card);
 void log_storage_info();
+size_t storage_io_size(const char* path);
+
+// Directory entry as stored in the FAT directory record. Listing through
+// these avoids a stat() per entry, which would re-scan the directory.
+typedef struct {
+    const char* name;
+    uint64_t size;
+    time_t mtime;
+    bool is_dir;
+} storage_dirent_t;
+
+typedef struct storage_dir storage_dir_t;
+
+storage_dir_t* storage_opendir(const char* path);
+// Returns false at the end of the directory. Size and mtime are only
+// decoded when with_meta is set.
+bool storage_readdir(storage_dir_t* dir, storage_dirent_t* entry, bool with_meta);
+void storage_closedir(storage_dir_t* dir);
+
+// File opened straight through FatFs. A file opened for reading gets a
+// cluster link map (FatFs fast seek), so seeking into a multi-GB file
+// costs the same at any offset. Modes are "rb", "wb", "ab" and "r+b".
+typedef struct storage_file storage_file_t;
+
+storage_file_t* storage_fopen(const char* path, const char* mode);
+// Returns false on an I/O error; *done < len without an error is the end
+// of the file
+bool storage_fread(storage_file_t* file, void* buf, size_t len, size_t* done);
+bool storage_fwrite(storage_file_t* file, const void* buf, size_t len);
+// Seeking past the end of the file fails rather than growing it
+bool storage_fseek(storage_file_t* file, uint64_t offset);
+uint64_t storage_fsize(storage_file_t* file);
+void storage_fclose(storage_file_t* file);
+// Drops the link maps kept for path, or for everything under it with tree.
+// Call after a file is changed other than through storage_fopen().
+void storage_file_changed(const char* path, bool tree);
 
 #endif /* FILESYSTEM_H */
\ No newline at end of file
@@ -0,0 +1,793 @@
+#include "fsCache.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+namespace FtpServer {
+
+static const char* TAG = "[FsCache]";
+
+// Packed listing record, followed by the NUL-terminated name
+typedef struct __attribute__((packed)) {
+    uint64_t size;
+    int64_t mtime;
+    uint16_t name_len;
+    uint8_t is_dir;
+} list_record_t;
+
+ListCache::ListCache()
+    : slots(nullptr),
+      slot_count(0),
+      slot_size(0),
+      arena(nullptr),
+      use_tick(0),
+      cache_hits(0),
+      cache_misses(0) {}
+
+ListCache::~ListCache() {
+    deinit();
+}
+
+bool ListCache::init(size_t size, uint8_t count) {
+    deinit();
+    if (size == 0 || count == 0) {
+        return false;
+    }
+    arena = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (arena == nullptr) {
+        ESP_LOGW(TAG, "No PSRAM for listing cache, disabled");
+        return false;
+    }
+    slots = (slot_t*)calloc(count, sizeof(slot_t));
+    if (slots == nullptr) {
+        heap_caps_free(arena);
+        arena = nullptr;
+        return false;
+    }
+    slot_count = count;
+    slot_size = size / count;
+    for (uint8_t i = 0; i < slot_count; i++) {
+        slots[i].data = arena + i * slot_size;
+    }
+    ESP_LOGI(TAG, "Listing cache: %u dirs x %" PRIu32 " bytes", slot_count, slot_size);
+    return true;
+}
+
+void ListCache::deinit() {
+    if (arena) heap_caps_free(arena);
+    if (slots) free(slots);
+    arena = nullptr;
+    slots = nullptr;
+    slot_count = 0;
+    slot_size = 0;
+}
+
+// Length of the path without trailing slashes, so "/sdcard/a/" and
+// "/sdcard/a" share an entry
+size_t ListCache::key_length(const char* path) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    return len;
+}
+
+void ListCache::drop(slot_t* slot) {
+    if (slot->readers > 0 || slot->state == E_SLOT_FILLING) {
+        // Still being read or recorded; released by close()/end_fill()
+        slot->state = E_SLOT_STALE;
+    } else {
+        slot->state = E_SLOT_FREE;
+    }
+}
+
+bool ListCache::open(const char* path, cursor_t* cursor) {
+    if (slot_count == 0) {
+        return false;
+    }
+    size_t len = key_length(path);
+    for (uint8_t i = 0; i < slot_count; i++) {
+        slot_t& slot = slots[i];
+        if (slot.state == E_SLOT_READY && slot.path_len == len &&
+            memcmp(slot.path, path, len) == 0) {
+            slot.readers++;
+            slot.last_used = ++use_tick;
+            cursor->slot = i;
+            cursor->offset = 0;
+            cache_hits++;
+            return true;
+        }
+    }
+    cache_misses++;
+    return false;
+}
+
+bool ListCache::next(cursor_t* cursor, storage_dirent_t* entry) {
+    slot_t& slot = slots[cursor->slot];
+    if (cursor->offset >= slot.len) {
+        return false;
+    }
+    list_record_t rec;
+    memcpy(&rec, slot.data + cursor->offset, sizeof(rec));
+    entry->name = (const char*)slot.data + cursor->offset + sizeof(rec);
+    entry->size = rec.size;
+    entry->mtime = (time_t)rec.mtime;
+    entry->is_dir = rec.is_dir != 0;
+    cursor->offset += sizeof(rec) + rec.name_len;
+    return true;
+}
+
+void ListCache::close(cursor_t* cursor) {
+    slot_t& slot = slots[cursor->slot];
+    if (slot.readers > 0 && --slot.readers == 0 && slot.state == E_SLOT_STALE) {
+        slot.state = E_SLOT_FREE;
+    }
+    cursor->slot = -1;
+}
+
+bool ListCache::begin_fill(const char* path, cursor_t* cursor) {
+    size_t len = key_length(path);
+    if (slot_count == 0 || len >= FS_CACHE_PATH_MAX) {
+        return false;
+    }
+    // Free slot first, otherwise the least recently used unpinned one
+    int8_t victim = -1;
+    for (uint8_t i = 0; i < slot_count; i++) {
+        slot_t& slot = slots[i];
+        if (slot.state == E_SLOT_FREE) {
+            victim = i;
+            break;
+        }
+        if (slot.state == E_SLOT_READY && slot.readers == 0 &&
+            (victim < 0 || slot.last_used < slots[victim].last_used)) {
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        return false;
+    }
+    slot_t& slot = slots[victim];
+    memcpy(slot.path, path, len);
+    slot.path[len] = '\0';
+    slot.path_len = len;
+    slot.len = 0;
+    slot.readers = 0;
+    slot.state = E_SLOT_FILLING;
+    cursor->slot = victim;
+    cursor->offset = 0;
+    return true;
+}
+
+bool ListCache::fill(cursor_t* cursor, const storage_dirent_t* entry) {
+    slot_t& slot = slots[cursor->slot];
+    list_record_t rec;
+    rec.size = entry->size;
+    rec.mtime = (int64_t)entry->mtime;
+    rec.name_len = strlen(entry->name) + 1;
+    rec.is_dir = entry->is_dir ? 1 : 0;
+    if (slot.state != E_SLOT_FILLING || slot.len + sizeof(rec) + rec.name_len > slot_size) {
+        end_fill(cursor, false);
+        return false;
+    }
+    memcpy(slot.data + slot.len, &rec, sizeof(rec));
+    memcpy(slot.data + slot.len + sizeof(rec), entry->name, rec.name_len);
+    slot.len += sizeof(rec) + rec.name_len;
+    return true;
+}
+
+void ListCache::end_fill(cursor_t* cursor, bool complete) {
+    slot_t& slot = slots[cursor->slot];
+    if (complete && slot.state == E_SLOT_FILLING) {
+        // A concurrent recording of the same directory may have finished
+        // first; the newer one wins
+        invalidate_matching(slot.path, slot.path_len, false, &slot);
+        slot.state = E_SLOT_READY;
+        slot.last_used = ++use_tick;
+    } else {
+        // Aborted, overflowed or invalidated while recording
+        slot.state = E_SLOT_FREE;
+    }
+    cursor->slot = -1;
+}
+
+bool ListCache::find(const char* path, fs_stat_t* st) {
+    const char* slash = strrchr(path, '/');
+    if (slot_count == 0 || slash == nullptr) {
+        return false;
+    }
+    size_t len = (slash == path) ? 1 : slash - path;
+    const char* name = slash + 1;
+    for (uint8_t i = 0; i < slot_count; i++) {
+        slot_t& slot = slots[i];
+        if (slot.state != E_SLOT_READY || slot.path_len != len ||
+            memcmp(slot.path, path, len) != 0) {
+            continue;
+        }
+        cursor_t cursor = {(int8_t)i, 0};
+        storage_dirent_t entry;
+        while (next(&cursor, &entry)) {
+            if (strcmp(entry.name, name) == 0) {
+                st->size = entry.size;
+                st->mtime = entry.mtime;
+                st->is_dir = entry.is_dir;
+                return true;
+            }
+        }
+        return false;
+    }
+    return false;
+}
+
+void ListCache::invalidate_matching(const char* path, size_t len, bool prefix,
+                                    const slot_t* keep) {
+    for (uint8_t i = 0; i < slot_count; i++) {
+        slot_t& slot = slots[i];
+        if (&slot == keep || slot.state == E_SLOT_FREE || slot.state == E_SLOT_STALE) {
+            continue;
+        }
+        bool match = prefix ? (slot.path_len >= len && memcmp(slot.path, path, len) == 0 &&
+                               (slot.path[len] == '/' || slot.path[len] == '\0'))
+                            : (slot.path_len == len && memcmp(slot.path, path, len) == 0);
+        if (match) {
+            drop(&slot);
+        }
+    }
+}
+
+void ListCache::invalidate(const char* dir) {
+    invalidate_matching(dir, key_length(dir), false, nullptr);
+}
+
+void ListCache::invalidate_parent(const char* path) {
+    const char* slash = strrchr(path, '/');
+    if (slash == nullptr) {
+        return;
+    }
+    size_t len = slash - path;
+    invalidate_matching(path, len > 0 ? len : 1, false, nullptr);
+}
+
+void ListCache::invalidate_tree(const char* path) {
+    invalidate_matching(path, key_length(path), true, nullptr);
+}
+
+StatCache::StatCache()
+    : entries(nullptr),
+      entry_count(0),
+      use_tick(0),
+      cache_hits(0),
+      cache_misses(0) {}
+
+StatCache::~StatCache() {
+    deinit();
+}
+
+bool StatCache::init(uint16_t count) {
+    deinit();
+    if (count == 0) {
+        return false;
+    }
+    entries = (entry_t*)heap_caps_calloc(count, sizeof(entry_t), MALLOC_CAP_SPIRAM);
+    if (entries == nullptr) {
+        entries = (entry_t*)heap_caps_calloc(count, sizeof(entry_t), MALLOC_CAP_DEFAULT);
+    }
+    if (entries == nullptr) {
+        ESP_LOGW(TAG, "No memory for stat cache, disabled");
+        return false;
+    }
+    entry_count = count;
+    return true;
+}
+
+void StatCache::deinit() {
+    if (entries) heap_caps_free(entries);
+    entries = nullptr;
+    entry_count = 0;
+}
+
+// FNV-1a, compared before the path so most probes skip the strcmp
+uint32_t StatCache::hash_path(const char* path) {
+    uint32_t hash = 2166136261u;
+    while (*path) {
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    }
+    return hash;
+}
+
+StatCache::entry_t* StatCache::find_entry(const char* path, uint32_t hash) {
+    for (uint16_t i = 0; i < entry_count; i++) {
+        entry_t& entry = entries[i];
+        if (entry.path[0] != '\0' && entry.hash == hash && strcmp(entry.path, path) == 0) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+bool StatCache::lookup(const char* path, fs_stat_t* st) {
+    entry_t* entry = find_entry(path, hash_path(path));
+    if (entry == nullptr) {
+        cache_misses++;
+        return false;
+    }
+    entry->last_used = ++use_tick;
+    *st = entry->st;
+    cache_hits++;
+    return true;
+}
+
+void StatCache::insert(const char* path, const fs_stat_t* st) {
+    if (entry_count == 0 || strlen(path) >= FS_CACHE_PATH_MAX) {
+        return;
+    }
+    uint32_t hash = hash_path(path);
+    entry_t* entry = find_entry(path, hash);
+    if (entry == nullptr) {
+        // Empty entry first, otherwise evict the least recently used
+        entry = &entries[0];
+        for (uint16_t i = 0; i < entry_count && entry->path[0] != '\0'; i++) {
+            if (entries[i].path[0] == '\0' || entries[i].last_used < entry->last_used) {
+                entry = &entries[i];
+            }
+        }
+        strcpy(entry->path, path);
+        entry->hash = hash;
+    }
+    entry->st = *st;
+    entry->last_used = ++use_tick;
+}
+
+void StatCache::invalidate(const char* path) {
+    entry_t* entry = find_entry(path, hash_path(path));
+    if (entry) {
+        entry->path[0] = '\0';
+    }
+}
+
+void StatCache::invalidate_tree(const char* path) {
+    size_t len = strlen(path);
+    for (uint16_t i = 0; i < entry_count; i++) {
+        entry_t& entry = entries[i];
+        if (strncmp(entry.path, path, len) == 0 &&
+            (entry.path[len] == '/' || entry.path[len] == '\0')) {
+            entry.path[0] = '\0';
+        }
+    }
+}
+
+HashCache::HashCache()
+    : entries(nullptr),
+      entry_count(0),
+      use_tick(0),
+      cache_hits(0),
+      cache_misses(0) {}
+
+HashCache::~HashCache() {
+    deinit();
+}
+
+bool HashCache::init(uint16_t count) {
+    deinit();
+    if (count == 0) {
+        return false;
+    }
+    entries = (entry_t*)heap_caps_calloc(count, sizeof(entry_t), MALLOC_CAP_SPIRAM);
+    if (entries == nullptr) {
+        entries = (entry_t*)heap_caps_calloc(count, sizeof(entry_t), MALLOC_CAP_DEFAULT);
+    }
+    if (entries == nullptr) {
+        ESP_LOGW(TAG, "No memory for checksum cache, disabled");
+        return false;
+    }
+    entry_count = count;
+    return true;
+}
+
+void HashCache::deinit() {
+    if (entries) heap_caps_free(entries);
+    entries = nullptr;
+    entry_count = 0;
+}
+
+HashCache::entry_t* HashCache::find_entry(const char* path, uint32_t hash, uint8_t algo) {
+    for (uint16_t i = 0; i < entry_count; i++) {
+        entry_t& entry = entries[i];
+        if (entry.path[0] != '\0' && entry.hash == hash && entry.algo == algo &&
+            strcmp(entry.path, path) == 0) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+uint8_t HashCache::lookup(const char* path, const fs_stat_t* st, uint8_t algo, uint8_t* digest) {
+    entry_t* entry = find_entry(path, StatCache::hash_path(path), algo);
+    if (entry == nullptr || entry->size != st->size || entry->mtime != st->mtime) {
+        cache_misses++;
+        return 0;
+    }
+    entry->last_used = ++use_tick;
+    memcpy(digest, entry->digest, entry->len);
+    cache_hits++;
+    return entry->len;
+}
+
+void HashCache::insert(const char* path, const fs_stat_t* st, uint8_t algo,
+                       const uint8_t* digest, uint8_t len) {
+    if (entry_count == 0 || strlen(path) >= FS_CACHE_PATH_MAX || len > sizeof(entries[0].digest)) {
+        return;
+    }
+    uint32_t hash = StatCache::hash_path(path);
+    entry_t* entry = find_entry(path, hash, algo);
+    if (entry == nullptr) {
+        // Empty entry first, otherwise evict the least recently used
+        entry = &entries[0];
+        for (uint16_t i = 0; i < entry_count && entry->path[0] != '\0'; i++) {
+            if (entries[i].path[0] == '\0' || entries[i].last_used < entry->last_used) {
+                entry = &entries[i];
+            }
+        }
+        strcpy(entry->path, path);
+        entry->hash = hash;
+        entry->algo = algo;
+    }
+    entry->size = st->size;
+    entry->mtime = st->mtime;
+    memcpy(entry->digest, digest, len);
+    entry->len = len;
+    entry->last_used = ++use_tick;
+}
+
+// Drops every algorithm's entry for path
+void HashCache::invalidate(const char* path) {
+    uint32_t hash = StatCache::hash_path(path);
+    for (uint16_t i = 0; i < entry_count; i++) {
+        entry_t& entry = entries[i];
+        if (entry.hash == hash && strcmp(entry.path, path) == 0) {
+            entry.path[0] = '\0';
+        }
+    }
+}
+
+void HashCache::invalidate_tree(const char* path) {
+    size_t len = strlen(path);
+    for (uint16_t i = 0; i < entry_count; i++) {
+        entry_t& entry = entries[i];
+        if (strncmp(entry.path, path, len) == 0 &&
+            (entry.path[len] == '/' || entry.path[len] == '\0')) {
+            entry.path[0] = '\0';
+        }
+    }
+}
+
+// Index record, followed by the NUL-terminated name
+typedef struct __attribute__((packed)) {
+    uint64_t size;
+    int64_t mtime;
+    uint16_t name_len;
+    uint8_t flags;
+} index_record_t;
+
+#define INDEX_FLAG_DIR 0x01
+#define INDEX_FLAG_DELETED 0x02
+#define INDEX_TABLE_MIN 64
+
+// FAT matches names case-insensitively. A name that is not plain ASCII, or
+// that could be an 8.3 alias, might still exist under another spelling, so
+// the index only answers "found" for those.
+static bool index_can_prove_missing(const char* name) {
+    for (; *name; name++) {
+        if ((uint8_t)*name >= 0x80 || *name == '~') {
+            return false;
+        }
+    }
+    return true;
+}
+
+DirIndex::DirIndex()
+    : slots(nullptr),
+      slot_count(0),
+      slot_size(0),
+      min_entries(0),
+      arena(nullptr),
+      use_tick(0) {}
+
+DirIndex::~DirIndex() {
+    deinit();
+}
+
+bool DirIndex::init(size_t size, uint8_t count, uint32_t min) {
+    deinit();
+    if (size == 0 || count == 0) {
+        return false;
+    }
+    arena = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (arena == nullptr) {
+        ESP_LOGW(TAG, "No PSRAM for directory index, disabled");
+        return false;
+    }
+    slots = (slot_t*)calloc(count, sizeof(slot_t));
+    if (slots == nullptr) {
+        heap_caps_free(arena);
+        arena = nullptr;
+        return false;
+    }
+    slot_count = count;
+    slot_size = (size / count) & ~3u;
+    min_entries = min;
+    for (uint8_t i = 0; i < slot_count; i++) {
+        slots[i].data = arena + i * slot_size;
+    }
+    return true;
+}
+
+void DirIndex::deinit() {
+    if (arena) heap_caps_free(arena);
+    if (slots) free(slots);
+    arena = nullptr;
+    slots = nullptr;
+    slot_count = 0;
+    slot_size = 0;
+}
+
+uint32_t DirIndex::hash_name(const char* name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (uint8_t)tolower((uint8_t)*name++)) * 16777619u;
+    }
+    return hash;
+}
+
+bool DirIndex::begin_build(const char* dir, int8_t* slot) {
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') {
+        len--;
+    }
+    if (slot_count == 0 || len >= FS_CACHE_PATH_MAX) {
+        return false;
+    }
+    int8_t victim = -1;
+    for (uint8_t i = 0; i < slot_count; i++) {
+        slot_t& s = slots[i];
+        if (s.state != E_SLOT_FREE && s.path_len == len && memcmp(s.path, dir, len) == 0) {
+            return false;  // Already indexed or being built
+        }
+        if (s.state == E_SLOT_FREE && (victim < 0 || slots[victim].state != E_SLOT_FREE)) {
+            victim = i;
+        } else if (s.state == E_SLOT_READY && (victim < 0 || (slots[victim].state == E_SLOT_READY &&
+                                                               s.last_used < slots[victim].last_used))) {
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        return false;
+    }
+    slot_t& s = slots[victim];
+    memcpy(s.path, dir, len);
+    s.path[len] = '\0';
+    s.path_len = len;
+    s.records_len = 0;
+    s.table = nullptr;
+    s.table_mask = 0;
+    s.count = 0;
+    s.state = E_SLOT_BUILDING;
+    *slot = victim;
+    return true;
+}
+
+bool DirIndex::append(slot_t* s, const char* name, const fs_stat_t* st) {
+    index_record_t rec;
+    rec.size = st->size;
+    rec.mtime = (int64_t)st->mtime;
+    rec.name_len = strlen(name) + 1;
+    rec.flags = st->is_dir ? INDEX_FLAG_DIR : 0;
+    uint32_t limit = s->table ? (uint8_t*)s->table - s->data : slot_size;
+    if (s->records_len + sizeof(rec) + rec.name_len > limit) {
+        return false;
+    }
+    memcpy(s->data + s->records_len, &rec, sizeof(rec));
+    memcpy(s->data + s->records_len + sizeof(rec), name, rec.name_len);
+    s->records_len += sizeof(rec) + rec.name_len;
+    s->count++;
+    return true;
+}
+
+void DirIndex::add(int8_t slot, const storage_dirent_t* entry) {
+    slot_t& s = slots[slot];
+    if (s.state != E_SLOT_BUILDING) {
+        return;  // Overflowed or invalidated while building
+    }
+    if (entry->name[0] == '.' && (entry->name[1] == '\0' ||
+                                  (entry->name[1] == '.' && entry->name[2] == '\0'))) {
+        return;
+    }
+    fs_stat_t st = {entry->size, entry->mtime, entry->is_dir};
+    if (!append(&s, entry->name, &st)) {
+        ESP_LOGW(TAG, "Directory too large to index: %s", s.path);
+        s.state = E_SLOT_STALE;
+    }
+}
+
+void DirIndex::insert_table(slot_t* s, uint32_t offset) {
+    index_record_t rec;
+    memcpy(&rec, s->data + offset, sizeof(rec));
+    uint32_t i = hash_name((const char*)s->data + offset + sizeof(rec)) & s->table_mask;
+    while (s->table[i] != 0) {
+        i = (i + 1) & s->table_mask;
+    }
+    s->table[i] = offset + 1;
+}
+
+void DirIndex::end_build(int8_t slot, bool complete) {
+    slot_t& s = slots[slot];
+    if (!complete || s.state != E_SLOT_BUILDING || s.count < min_entries) {
+        s.state = E_SLOT_FREE;
+        return;
+    }
+    // Keep the load factor at or below 2/3, leaving room to grow
+    uint32_t capacity = INDEX_TABLE_MIN;
+    while (capacity < s.count + s.count / 2 + 1) {
+        capacity <<= 1;
+    }
+    uint32_t table_bytes = capacity * sizeof(uint32_t);
+    if (s.records_len + table_bytes > slot_size) {
+        ESP_LOGW(TAG, "No room for index table: %s", s.path);
+        s.state = E_SLOT_FREE;
+        return;
+    }
+    s.table = (uint32_t*)(s.data + slot_size - table_bytes);
+    s.table_mask = capacity - 1;
+    memset(s.table, 0, table_bytes);
+    for (uint32_t offset = 0; offset < s.records_len;) {
+        index_record_t rec;
+        memcpy(&rec, s.data + offset, sizeof(rec));
+        insert_table(&s, offset);
+        offset += sizeof(rec) + rec.name_len;
+    }
+    s.state = E_SLOT_READY;
+    s.last_used = ++use_tick;
+    ESP_LOGI(TAG, "Indexed %s: %" PRIu32 " entries", s.path, s.count);
+}
+
+// Ready slot holding the parent directory of path, with name pointing at
+// the last path component
+DirIndex::slot_t* DirIndex::find_slot(const char* path, const char** name) {
+    const char* slash = strrchr(path, '/');
+    if (slash == nullptr) {
+        return nullptr;
+    }
+    size_t len = (slash == path) ? 1 : slash - path;
+    for (uint8_t i = 0; i < slot_count; i++) {
+        slot_t& s = slots[i];
+        if (s.state != E_SLOT_FREE && s.path_len == len && memcmp(s.path, path, len) == 0) {
+            *name = slash + 1;
+            return &s;
+        }
+    }
+    return nullptr;
+}
+
+uint32_t DirIndex::lookup_offset(slot_t* s, const char* name) {
+    uint32_t i = hash_name(name) & s->table_mask;
+    while (s->table[i] != 0) {
+        uint32_t offset = s->table[i] - 1;
+        if (strcasecmp((const char*)s->data + offset + sizeof(index_record_t), name) == 0) {
+            return offset + 1;
+        }
+        i = (i + 1) & s->table_mask;
+    }
+    return 0;
+}
+
+bool DirIndex::covers(const char* path) {
+    const char* name;
+    return find_slot(path, &name) != nullptr;
+}
+
+DirIndex::lookup_t DirIndex::find(const char* path, fs_stat_t* st) {
+    const char* name;
+    slot_t* s = find_slot(path, &name);
+    if (s == nullptr || s->state != E_SLOT_READY || name[0] == '\0') {
+        return E_INDEX_NONE;
+    }
+    s->last_used = ++use_tick;
+    uint32_t found = lookup_offset(s, name);
+    index_record_t rec;
+    if (found != 0) {
+        memcpy(&rec, s->data + found - 1, sizeof(rec));
+    }
+    if (found == 0 || (rec.flags & INDEX_FLAG_DELETED)) {
+        return index_can_prove_missing(name) ? E_INDEX_MISSING : E_INDEX_NONE;
+    }
+    st->size = rec.size;
+    st->mtime = (time_t)rec.mtime;
+    st->is_dir = (rec.flags & INDEX_FLAG_DIR) != 0;
+    return E_INDEX_FOUND;
+}
+
+void DirIndex::update(const char* path, const fs_stat_t* st) {
+    const char* name;
+    slot_t* s = find_slot(path, &name);
+    if (s == nullptr) {
+        return;
+    }
+    if (s->state != E_SLOT_READY) {
+        s->state = (s->state == E_SLOT_BUILDING) ? (uint8_t)E_SLOT_STALE : s->state;
+        return;  // The listing being indexed may or may not include it
+    }
+    uint32_t found = lookup_offset(s, name);
+    if (found != 0) {
+        index_record_t rec;
+        memcpy(&rec, s->data + found - 1, sizeof(rec));
+        rec.size = st->size;
+        rec.mtime = (int64_t)st->mtime;
+        rec.flags = st->is_dir ? INDEX_FLAG_DIR : 0;
+        memcpy(s->data + found - 1, &rec, sizeof(rec));
+        return;
+    }
+    uint32_t offset = s->records_len;
+    if ((s->count + 1) * 4 > s->table_mask * 3 || !append(s, name, st)) {
+        s->state = E_SLOT_FREE;  // Full; rebuilt by the next listing
+        return;
+    }
+    insert_table(s, offset);
+}
+
+void DirIndex::remove(const char* path) {
+    const char* name;
+    slot_t* s = find_slot(path, &name);
+    if (s == nullptr) {
+        return;
+    }
+    if (s->state != E_SLOT_READY) {
+        s->state = (s->state == E_SLOT_BUILDING) ? (uint8_t)E_SLOT_STALE : s->state;
+        return;
+    }
+    uint32_t found = lookup_offset(s, name);
+    if (found != 0) {
+        // Tombstone: the table slot stays so later probes still pass it
+        index_record_t rec;
+        memcpy(&rec, s->data + found - 1, sizeof(rec));
+        rec.flags |= INDEX_FLAG_DELETED;
+        memcpy(s->data + found - 1, &rec, sizeof(rec));
+    }
+}
+
+void DirIndex::rename(const char* from, const char* to) {
+    fs_stat_t st;
+    bool known = (find(from, &st) == E_INDEX_FOUND);
+    remove(from);
+    if (known) {
+        update(to, &st);
+    } else {
+        forget(to);
+    }
+    invalidate_tree(from);
+}
+
+void DirIndex::forget(const char* path) {
+    const char* name;
+    slot_t* s = find_slot(path, &name);
+    if (s) {
+        s->state = (s->state == E_SLOT_BUILDING) ? E_SLOT_STALE : E_SLOT_FREE;
+    }
+}
+
+void DirIndex::invalidate_tree(const char* path) {
+    size_t len = strlen(path);
+    for (uint8_t i = 0; i < slot_count; i++) {
+        slot_t& s = slots[i];
+        if (s.state != E_SLOT_FREE && s.path_len >= len && memcmp(s.path, path, len) == 0 &&
+            (s.path[len] == '/' || s.path[len] == '\0')) {
+            s.state = (s.state == E_SLOT_BUILDING) ? E_SLOT_STALE : E_SLOT_FREE;
+        }
+    }
+}
+
+}  // namespace FtpServer
@@ -0,0 +1,249 @@
+#ifndef FS_CACHE_H
+#define FS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "filesystem.h"
+
+namespace FtpServer {
+
+#define FS_CACHE_PATH_MAX 128
+
+typedef struct {
+    uint64_t size;
+    time_t mtime;
+    bool is_dir;
+} fs_stat_t;
+
+// Bounded cache of parsed directory listings keyed by native directory
+// path. Entries are kept as packed records in one PSRAM arena split into
+// equal slots, so LIST and NLST can both be rendered from a hit without
+// touching the FAT. Not thread safe: the server only calls it with
+// ftp_mutex held.
+class ListCache {
+public:
+    typedef struct {
+        int8_t slot;
+        uint32_t offset;
+    } cursor_t;
+
+    ListCache();
+    ~ListCache();
+
+    bool init(size_t size, uint8_t slots);
+    void deinit();
+
+    // Serving a listing from the cache. open() returns false on a miss; on
+    // a hit the slot stays pinned until close().
+    bool open(const char* path, cursor_t* cursor);
+    bool next(cursor_t* cursor, storage_dirent_t* entry);
+    void close(cursor_t* cursor);
+
+    // Recording a listing while it is read from disk. fill() returns false
+    // once the directory outgrows a slot and the recording is dropped.
+    bool begin_fill(const char* path, cursor_t* cursor);
+    bool fill(cursor_t* cursor, const storage_dirent_t* entry);
+    void end_fill(cursor_t* cursor, bool complete);
+
+    // Looks up a single entry of a cached directory, so SIZE/MDTM after a
+    // LIST need no FAT access either
+    bool find(const char* path, fs_stat_t* st);
+
+    // Drops the listing of dir, or of the directory holding path, or of
+    // everything under a directory or mount point.
+    void invalidate(const char* dir);
+    void invalidate_parent(const char* path);
+    void invalidate_tree(const char* path);
+
+    uint32_t hits() const { return cache_hits; }
+    uint32_t misses() const { return cache_misses; }
+
+private:
+    typedef enum {
+        E_SLOT_FREE = 0,
+        E_SLOT_FILLING,
+        E_SLOT_READY,
+        E_SLOT_STALE
+    } slot_state_t;
+
+    typedef struct {
+        char path[FS_CACHE_PATH_MAX];
+        uint16_t path_len;
+        uint8_t* data;
+        uint32_t len;
+        uint32_t last_used;
+        uint8_t readers;
+        uint8_t state;
+    } slot_t;
+
+    slot_t* slots;
+    uint8_t slot_count;
+    uint32_t slot_size;
+    uint8_t* arena;
+    uint32_t use_tick;
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+
+    static size_t key_length(const char* path);
+    void drop(slot_t* slot);
+    void invalidate_matching(const char* path, size_t len, bool prefix, const slot_t* keep);
+};
+
+// LRU cache of stat() results keyed by native path, for SIZE, MDTM and
+// RNFR. On FAT each stat() walks every parent directory from the root.
+// Only existing paths are cached. Not thread safe, like ListCache.
+class StatCache {
+public:
+    StatCache();
+    ~StatCache();
+
+    bool init(uint16_t count);
+    void deinit();
+
+    bool lookup(const char* path, fs_stat_t* st);
+    void insert(const char* path, const fs_stat_t* st);
+    void invalidate(const char* path);
+    void invalidate_tree(const char* path);
+
+    uint32_t hits() const { return cache_hits; }
+    uint32_t misses() const { return cache_misses; }
+
+    static uint32_t hash_path(const char* path);
+
+private:
+    typedef struct {
+        char path[FS_CACHE_PATH_MAX];
+        uint32_t hash;
+        uint32_t last_used;
+        fs_stat_t st;
+    } entry_t;
+
+    entry_t* entries;
+    uint16_t entry_count;
+    uint32_t use_tick;
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+
+    entry_t* find_entry(const char* path, uint32_t hash);
+};
+
+// LRU cache of whole-file checksums keyed by native path and algorithm,
+// for HASH and the X* commands. An entry only matches while the file has
+// the size and modification time it was hashed at. Not thread safe, like
+// ListCache.
+class HashCache {
+public:
+    HashCache();
+    ~HashCache();
+
+    bool init(uint16_t count);
+    void deinit();
+
+    // Returns the digest size, or 0 on a miss
+    uint8_t lookup(const char* path, const fs_stat_t* st, uint8_t algo, uint8_t* digest);
+    void insert(const char* path, const fs_stat_t* st, uint8_t algo,
+                const uint8_t* digest, uint8_t len);
+    void invalidate(const char* path);
+    void invalidate_tree(const char* path);
+
+    uint32_t hits() const { return cache_hits; }
+    uint32_t misses() const { return cache_misses; }
+
+private:
+    typedef struct {
+        char path[FS_CACHE_PATH_MAX];
+        uint32_t hash;
+        uint32_t last_used;
+        uint64_t size;
+        time_t mtime;
+        uint8_t algo;
+        uint8_t len;
+        uint8_t digest[64];  // FTP_HASH_MAX_SIZE
+    } entry_t;
+
+    entry_t* entries;
+    uint16_t entry_count;
+    uint32_t use_tick;
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+
+    entry_t* find_entry(const char* path, uint32_t hash, uint8_t algo);
+};
+
+// In-memory hash index of very large directories (data logger folders
+// with thousands of files), where each stat() is a linear scan of the FAT
+// directory. An index is built for free while such a directory is listed
+// from disk, kept current by the server's own changes and dropped on
+// mount events. Lookups are O(1) and can also prove that a name does not
+// exist. Not thread safe, like ListCache.
+class DirIndex {
+public:
+    typedef enum {
+        E_INDEX_NONE = 0,  // Directory not indexed, ask the filesystem
+        E_INDEX_FOUND,
+        E_INDEX_MISSING    // Directory indexed and the name is not in it
+    } lookup_t;
+
+    DirIndex();
+    ~DirIndex();
+
+    bool init(size_t size, uint8_t slots, uint32_t min_entries);
+    void deinit();
+
+    // Building while a listing is read from disk. Entries are only kept if
+    // the directory turns out to have at least min_entries.
+    bool begin_build(const char* dir, int8_t* slot);
+    void add(int8_t slot, const storage_dirent_t* entry);
+    void end_build(int8_t slot, bool complete);
+
+    lookup_t find(const char* path, fs_stat_t* st);
+
+    // Whether the directory holding path is indexed or being indexed, so
+    // a change to path has to be recorded
+    bool covers(const char* path);
+
+    // Local changes, applied in place when the parent is indexed
+    void update(const char* path, const fs_stat_t* st);
+    void remove(const char* path);
+    void rename(const char* from, const char* to);
+    // Drops the index holding path, for a change whose metadata is unknown
+    void forget(const char* path);
+    void invalidate_tree(const char* path);
+
+private:
+    typedef enum {
+        E_SLOT_FREE = 0,
+        E_SLOT_BUILDING,
+        E_SLOT_READY,
+        E_SLOT_STALE
+    } slot_state_t;
+
+    typedef struct {
+        char path[FS_CACHE_PATH_MAX];
+        uint16_t path_len;
+        uint8_t* data;
+        uint32_t records_len;  // Records grow up from data
+        uint32_t* table;       // Open-addressing table at the end of the slot
+        uint32_t table_mask;
+        uint32_t count;
+        uint32_t last_used;
+        uint8_t state;
+    } slot_t;
+
+    slot_t* slots;
+    uint8_t slot_count;
+    uint32_t slot_size;
+    uint32_t min_entries;
+    uint8_t* arena;
+    uint32_t use_tick;
+
+    static uint32_t hash_name(const char* name);
+    slot_t* find_slot(const char* path, const char** name);
+    bool append(slot_t* slot, const char* name, const fs_stat_t* st);
+    void insert_table(slot_t* slot, uint32_t offset);
+    uint32_t lookup_offset(slot_t* slot, const char* name);
+};
+
+}  // namespace FtpServer
+
+#endif /* FS_CACHE_H */
@@ -0,0 +1,95 @@
+#include "ftpAscii.h"
+
+#include <string.h>
+
+namespace FtpServer {
+
+// Native word for the byte search: four bytes on the ESP32-S3, eight on
+// 64-bit hosts. Loads through it are aligned.
+typedef size_t __attribute__((may_alias)) ascii_word_t;
+
+static constexpr size_t ASCII_WORD = sizeof(ascii_word_t);
+static constexpr ascii_word_t ASCII_ONES = (ascii_word_t)-1 / 0xFF;  // 0x0101...
+static constexpr ascii_word_t ASCII_HIGHS = ASCII_ONES * 0x80;       // 0x8080...
+
+// Returns the first byte equal to c in [p, end), or end. Each word is
+// tested for a zero byte after XOR with c in every lane; the lowest flag
+// is exact, so on the little-endian targets it gives the match position.
+static const uint8_t* find_byte(const uint8_t* p, const uint8_t* end, uint8_t c) {
+    while (p < end && ((uintptr_t)p & (ASCII_WORD - 1)) != 0) {
+        if (*p == c) return p;
+        p++;
+    }
+    const ascii_word_t pattern = ASCII_ONES * c;
+    while ((size_t)(end - p) >= ASCII_WORD) {
+        ascii_word_t x = *(const ascii_word_t*)p ^ pattern;
+        ascii_word_t found = (x - ASCII_ONES) & ~x & ASCII_HIGHS;
+        if (found) {
+            return p + (__builtin_ctzll((unsigned long long)found) >> 3);
+        }
+        p += ASCII_WORD;
+    }
+    while (p < end) {
+        if (*p == c) return p;
+        p++;
+    }
+    return end;
+}
+
+size_t ascii_encode(uint8_t* out, const uint8_t* in, size_t len, bool* cr) {
+    const uint8_t* p = in;
+    const uint8_t* end = in + len;
+    uint8_t* o = out;
+    bool prev_cr = *cr;
+    while (p < end) {
+        const uint8_t* lf = find_byte(p, end, '\n');
+        size_t run = lf - p;
+        memcpy(o, p, run);
+        o += run;
+        if (lf == end) {
+            break;
+        }
+        if (!(run > 0 ? lf[-1] == '\r' : prev_cr)) {
+            *o++ = '\r';
+        }
+        *o++ = '\n';
+        p = lf + 1;
+        prev_cr = false;
+    }
+    if (len > 0) {
+        *cr = (in[len - 1] == '\r');
+    }
+    return o - out;
+}
+
+size_t ascii_decode(uint8_t* data, size_t len, bool* cr) {
+    uint8_t* p = data;
+    uint8_t* end = data + len;
+    uint8_t* o = data;
+    *cr = false;  // A held CR is either dropped before an LF or written by the caller
+    while (p < end) {
+        uint8_t* c = (uint8_t*)find_byte(p, end, '\r');
+        size_t run = c - p;
+        if (o != p) {
+            memmove(o, p, run);
+        }
+        o += run;
+        if (c == end) {
+            break;
+        }
+        if (c + 1 == end) {
+            *cr = true;  // Decided by the next chunk
+            break;
+        }
+        if (c[1] == '\n') {
+            *o++ = '\n';
+            p = c + 2;
+        } else {
+            *o++ = '\r';
+            p = c + 1;
+        }
+    }
+    return o - data;
+}
+
+}  // namespace FtpServer
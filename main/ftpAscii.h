@@ -0,0 +1,31 @@
+#ifndef FTP_ASCII_H
+#define FTP_ASCII_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace FtpServer {
+
+// TYPE A line ending conversion between the local LF and the network
+// CRLF. Both directions work chunk by chunk, with the CR state carried
+// across chunks in *cr, and search for line ends a machine word at a time.
+
+// Writes len bytes from in to out with every LF that does not already
+// follow a CR expanded to CRLF, and returns the output length (at most
+// 2 * len). *cr tells whether the byte before in was a CR.
+size_t ascii_encode(uint8_t* out, const uint8_t* in, size_t len, bool* cr);
+
+// Converts CRLF to LF in place and returns the new length. A CR at the
+// end is dropped and held in *cr until the next chunk shows whether an LF
+// follows; see ascii_cr_alone().
+size_t ascii_decode(uint8_t* data, size_t len, bool* cr);
+
+// Whether the CR held back by ascii_decode() is not part of a CRLF and has
+// to be written before the next chunk. len is 0 at the end of the data.
+static inline bool ascii_cr_alone(bool cr, const uint8_t* data, size_t len) {
+    return cr && (len == 0 || data[0] != '\n');
+}
+
+}  // namespace FtpServer
+
+#endif /* FTP_ASCII_H */
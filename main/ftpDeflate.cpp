@@ -0,0 +1,164 @@
+#include "ftpDeflate.h"
+
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "miniz.h"
+
+namespace FtpServer {
+
+static const char* TAG = "[Deflate]";
+
+// Dictionary probes per zlib level, as picked by miniz's
+// tdefl_create_comp_flags_from_zip_params(), which the ROM does not export
+static const uint16_t DEFLATE_PROBES[10] = {0, 1, 6, 32, 16, 32, 128, 256, 512, 768};
+
+Deflater::Deflater()
+    : state(nullptr),
+      out(nullptr),
+      done(false) {}
+
+Deflater::~Deflater() {
+    release();
+}
+
+bool Deflater::begin(int level) {
+    if (state == nullptr) {
+        state = heap_caps_malloc(sizeof(tdefl_compressor), MALLOC_CAP_SPIRAM);
+        out = (uint8_t*)heap_caps_malloc(FTP_DEFLATE_OUT_SIZE, MALLOC_CAP_SPIRAM);
+        if (state == nullptr || out == nullptr) {
+            ESP_LOGE(TAG, "No PSRAM for the compressor");
+            release();
+            return false;
+        }
+    }
+    if (level < 1) level = 1;
+    if (level > 9) level = 9;
+    int flags = TDEFL_WRITE_ZLIB_HEADER | DEFLATE_PROBES[level];
+    if (level <= 3) {
+        flags |= TDEFL_GREEDY_PARSING_FLAG;
+    }
+    done = false;
+    return tdefl_init((tdefl_compressor*)state, nullptr, nullptr, flags) == TDEFL_STATUS_OKAY;
+}
+
+void Deflater::release() {
+    if (state) heap_caps_free(state);
+    if (out) heap_caps_free(out);
+    state = nullptr;
+    out = nullptr;
+}
+
+const uint8_t* Deflater::compress(const uint8_t* in, size_t* in_len, bool finish, size_t* out_len) {
+    *out_len = FTP_DEFLATE_OUT_SIZE;
+    tdefl_status status = tdefl_compress((tdefl_compressor*)state, in, in_len, out, out_len,
+                                         finish ? TDEFL_FINISH : TDEFL_NO_FLUSH);
+    if (status == TDEFL_STATUS_DONE) {
+        done = true;
+    } else if (status != TDEFL_STATUS_OKAY) {
+        ESP_LOGW(TAG, "Compression failed (%d)", (int)status);
+        return nullptr;
+    }
+    return out;
+}
+
+Inflater::Inflater()
+    : state(nullptr),
+      window(nullptr),
+      in(nullptr),
+      in_pos(0),
+      in_len(0),
+      out_pos(0),
+      out_len(0),
+      window_pos(0),
+      more_output(false),
+      done(false),
+      failed(false) {}
+
+Inflater::~Inflater() {
+    release();
+}
+
+bool Inflater::begin() {
+    if (state == nullptr) {
+        state = heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_SPIRAM);
+        window = (uint8_t*)heap_caps_malloc(TINFL_LZ_DICT_SIZE, MALLOC_CAP_SPIRAM);
+        in = (uint8_t*)heap_caps_malloc(FTP_INFLATE_IN_SIZE, MALLOC_CAP_SPIRAM);
+        if (state == nullptr || window == nullptr || in == nullptr) {
+            ESP_LOGE(TAG, "No PSRAM for the decompressor");
+            release();
+            return false;
+        }
+    }
+    tinfl_init((tinfl_decompressor*)state);
+    in_pos = 0;
+    in_len = 0;
+    out_pos = 0;
+    out_len = 0;
+    window_pos = 0;
+    more_output = false;
+    done = false;
+    failed = false;
+    return true;
+}
+
+void Inflater::release() {
+    if (state) heap_caps_free(state);
+    if (window) heap_caps_free(window);
+    if (in) heap_caps_free(in);
+    state = nullptr;
+    window = nullptr;
+    in = nullptr;
+}
+
+uint8_t* Inflater::input(size_t* space) {
+    if (in_pos > 0) {
+        memmove(in, in + in_pos, in_len - in_pos);
+        in_len -= in_pos;
+        in_pos = 0;
+    }
+    *space = FTP_INFLATE_IN_SIZE - in_len;
+    return in + in_len;
+}
+
+void Inflater::received(size_t len) {
+    in_len += len;
+}
+
+Inflater::status_t Inflater::read(uint8_t* buff, size_t maxlen, size_t* len) {
+    *len = 0;
+    if (failed) {
+        return E_INFLATE_ERROR;
+    }
+    while (out_len == 0 && !done && (in_pos < in_len || more_output)) {
+        // The window is only written again once everything decompressed
+        // into it has been read
+        size_t avail_in = in_len - in_pos;
+        size_t avail_out = TINFL_LZ_DICT_SIZE - window_pos;
+        tinfl_status status = tinfl_decompress((tinfl_decompressor*)state, in + in_pos, &avail_in,
+                                               window, window + window_pos, &avail_out,
+                                               TINFL_FLAG_PARSE_ZLIB_HEADER |
+                                                   TINFL_FLAG_HAS_MORE_INPUT);
+        in_pos += avail_in;
+        out_pos = window_pos;
+        out_len = avail_out;
+        window_pos = (window_pos + avail_out) & (TINFL_LZ_DICT_SIZE - 1);
+        more_output = (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+        if (status == TINFL_STATUS_DONE) {
+            done = true;
+        } else if (status < 0) {
+            ESP_LOGW(TAG, "Corrupt compressed data (%d)", (int)status);
+            failed = true;
+            return E_INFLATE_ERROR;
+        }
+    }
+    size_t n = (out_len < maxlen) ? out_len : maxlen;
+    memcpy(buff, window + out_pos, n);
+    out_pos += n;
+    out_len -= n;
+    *len = n;
+    return E_INFLATE_OK;
+}
+
+}  // namespace FtpServer
@@ -0,0 +1,80 @@
+#ifndef FTP_DEFLATE_H
+#define FTP_DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace FtpServer {
+
+#define FTP_DEFLATE_OUT_SIZE 4096  // Compressed bytes handed out per call
+#define FTP_INFLATE_IN_SIZE 2048   // Compressed bytes buffered per recv()
+
+// Streaming zlib (RFC 1950) compressor for MODE Z, on top of the miniz
+// deflate in the ESP32 ROM. The compressor state is large and fixed in
+// size, so it is only allocated, in PSRAM, when the first compressed
+// transfer of a session starts.
+class Deflater {
+public:
+    Deflater();
+    ~Deflater();
+
+    // Starts a new stream at a zlib level of 1 (fastest) to 9
+    bool begin(int level);
+    void release();
+
+    // Feeds up to *in_len bytes and returns the compressed output, valid
+    // until the next call, or nullptr on error. *in_len is set to the bytes
+    // consumed. finish ends the stream once all input is in.
+    const uint8_t* compress(const uint8_t* in, size_t* in_len, bool finish, size_t* out_len);
+    bool finished() const { return done; }
+
+private:
+    void* state;    // tdefl_compressor
+    uint8_t* out;
+    bool done;
+};
+
+// Streaming zlib decompressor for MODE Z uploads, on top of the miniz
+// inflate in ROM. Compressed data is received straight into input() and
+// read back decompressed, so nothing past the end of the stream is used.
+class Inflater {
+public:
+    typedef enum {
+        E_INFLATE_OK = 0,
+        E_INFLATE_ERROR
+    } status_t;
+
+    Inflater();
+    ~Inflater();
+
+    bool begin();
+    void release();
+
+    // Free space to recv() compressed data into, and how much arrived
+    uint8_t* input(size_t* space);
+    void received(size_t len);
+
+    // Copies up to maxlen decompressed bytes into buff; *len is 0 when more
+    // input is needed or the stream has ended
+    status_t read(uint8_t* buff, size_t maxlen, size_t* len);
+    // Decompressed data or compressed input is still waiting to be read
+    bool pending() const { return out_len > 0 || more_output || (in_len > in_pos && !done); }
+    bool finished() const { return done; }
+
+private:
+    void* state;     // tinfl_decompressor
+    uint8_t* window; // Wrapping 32 KB dictionary the output is written into
+    uint8_t* in;
+    size_t in_pos;
+    size_t in_len;
+    size_t out_pos;  // Decompressed data not yet read, in window
+    size_t out_len;
+    size_t window_pos;
+    bool more_output;  // The window filled up before the input was used
+    bool done;
+    bool failed;
+};
+
+}  // namespace FtpServer
+
+#endif /* FTP_DEFLATE_H */
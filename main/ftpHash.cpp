@@ -0,0 +1,193 @@
+#include "ftpHash.h"
+
+#include <strings.h>
+
+namespace FtpServer {
+
+static const char* const HASH_NAMES[Hasher::E_HASH_COUNT] = {
+    "SHA-1", "SHA-256", "SHA-512", "MD5", "CRC32"};
+
+// Slicing-by-8 CRC32 (reflected 0xEDB88320, as zlib): eight bytes per step
+// through eight 256-entry tables, about three times the speed of a
+// byte-at-a-time table walk, so a checksum can run inline with transfers.
+// The 8 KB of tables are built at compile time and stay in flash.
+struct Crc32Tables {
+    uint32_t t[8][256];
+
+    constexpr Crc32Tables() : t() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : c >> 1;
+            }
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int s = 1; s < 8; s++) {
+                t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+static constexpr Crc32Tables CRC32_TABLES;
+
+typedef uint32_t __attribute__((may_alias)) crc_word_t;
+
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len) {
+    const uint32_t(*t)[256] = CRC32_TABLES.t;
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t)data & 3) != 0) {
+        crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    // Words are read little-endian, as on the ESP32-S3
+    while (len >= 8) {
+        uint32_t lo = ((const crc_word_t*)data)[0] ^ crc;
+        uint32_t hi = ((const crc_word_t*)data)[1];
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    return ~crc;
+}
+
+Hasher::Hasher()
+    : algo(E_HASH_SHA256),
+      active(false) {}
+
+Hasher::~Hasher() {
+    abort();
+}
+
+const char* Hasher::name(algo_t algo) {
+    return HASH_NAMES[algo];
+}
+
+bool Hasher::parse(const char* name, algo_t* algo) {
+    for (uint8_t i = 0; i < E_HASH_COUNT; i++) {
+        if (strcasecmp(name, HASH_NAMES[i]) == 0) {
+            *algo = (algo_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Hasher::begin(algo_t hash_algo) {
+    abort();
+    algo = hash_algo;
+    active = true;
+    switch (algo) {
+        case E_HASH_SHA1:
+            mbedtls_sha1_init(&ctx.sha1);
+            mbedtls_sha1_starts(&ctx.sha1);
+            break;
+        case E_HASH_SHA256:
+            mbedtls_sha256_init(&ctx.sha256);
+            mbedtls_sha256_starts(&ctx.sha256, 0);
+            break;
+        case E_HASH_SHA512:
+            mbedtls_sha512_init(&ctx.sha512);
+            mbedtls_sha512_starts(&ctx.sha512, 0);
+            break;
+        case E_HASH_MD5:
+            mbedtls_md5_init(&ctx.md5);
+            mbedtls_md5_starts(&ctx.md5);
+            break;
+        default:
+            ctx.crc = 0;
+            break;
+    }
+}
+
+void Hasher::update(const uint8_t* data, size_t len) {
+    switch (algo) {
+        case E_HASH_SHA1:
+            mbedtls_sha1_update(&ctx.sha1, data, len);
+            break;
+        case E_HASH_SHA256:
+            mbedtls_sha256_update(&ctx.sha256, data, len);
+            break;
+        case E_HASH_SHA512:
+            mbedtls_sha512_update(&ctx.sha512, data, len);
+            break;
+        case E_HASH_MD5:
+            mbedtls_md5_update(&ctx.md5, data, len);
+            break;
+        default:
+            ctx.crc = crc32_update(ctx.crc, data, len);
+            break;
+    }
+}
+
+size_t Hasher::finish(uint8_t* digest) {
+    size_t len;
+    switch (algo) {
+        case E_HASH_SHA1:
+            mbedtls_sha1_finish(&ctx.sha1, digest);
+            len = 20;
+            break;
+        case E_HASH_SHA256:
+            mbedtls_sha256_finish(&ctx.sha256, digest);
+            len = 32;
+            break;
+        case E_HASH_SHA512:
+            mbedtls_sha512_finish(&ctx.sha512, digest);
+            len = 64;
+            break;
+        case E_HASH_MD5:
+            mbedtls_md5_finish(&ctx.md5, digest);
+            len = 16;
+            break;
+        default:
+            // Big-endian, so the hex reads like the usual CRC32 notation
+            digest[0] = (uint8_t)(ctx.crc >> 24);
+            digest[1] = (uint8_t)(ctx.crc >> 16);
+            digest[2] = (uint8_t)(ctx.crc >> 8);
+            digest[3] = (uint8_t)ctx.crc;
+            len = 4;
+            break;
+    }
+    abort();
+    return len;
+}
+
+void Hasher::abort() {
+    if (!active) {
+        return;
+    }
+    switch (algo) {
+        case E_HASH_SHA1:
+            mbedtls_sha1_free(&ctx.sha1);
+            break;
+        case E_HASH_SHA256:
+            mbedtls_sha256_free(&ctx.sha256);
+            break;
+        case E_HASH_SHA512:
+            mbedtls_sha512_free(&ctx.sha512);
+            break;
+        case E_HASH_MD5:
+            mbedtls_md5_free(&ctx.md5);
+            break;
+        default:
+            break;
+    }
+    active = false;
+}
+
+void Hasher::to_hex(char* dest, const uint8_t* digest, size_t len) {
+    static const char HEX[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        *dest++ = HEX[digest[i] >> 4];
+        *dest++ = HEX[digest[i] & 0x0F];
+    }
+    *dest = '\0';
+}
+
+}  // namespace FtpServer
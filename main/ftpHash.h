@@ -0,0 +1,63 @@
+#ifndef FTP_HASH_H
+#define FTP_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mbedtls/md5.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/sha512.h"
+
+namespace FtpServer {
+
+#define FTP_HASH_MAX_SIZE 64  // SHA-512 digest
+
+// CRC32 as computed by zlib's crc32(), continuing from crc (0 to start)
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len);
+
+// Incremental file checksum for HASH and the X* commands. The SHA family
+// goes through mbedTLS, which uses the SHA accelerator of the ESP32-S3;
+// CRC32 uses crc32_update().
+class Hasher {
+public:
+    typedef enum {
+        E_HASH_SHA1 = 0,
+        E_HASH_SHA256,
+        E_HASH_SHA512,
+        E_HASH_MD5,
+        E_HASH_CRC32,
+        E_HASH_COUNT
+    } algo_t;
+
+    Hasher();
+    ~Hasher();
+
+    // Names as used by HASH and FEAT (draft-bryan-ftpext-hash)
+    static const char* name(algo_t algo);
+    static bool parse(const char* name, algo_t* algo);
+
+    void begin(algo_t algo);
+    void update(const uint8_t* data, size_t len);
+    // Writes the digest and returns its size; the hasher is idle afterwards
+    size_t finish(uint8_t* digest);
+    void abort();
+
+    // Lower-case hex of a digest, NUL-terminated; dest needs 2 * len + 1
+    static void to_hex(char* dest, const uint8_t* digest, size_t len);
+
+private:
+    algo_t algo;
+    bool active;
+    union {
+        mbedtls_sha1_context sha1;
+        mbedtls_sha256_context sha256;
+        mbedtls_sha512_context sha512;
+        mbedtls_md5_context md5;
+        uint32_t crc;
+    } ctx;
+};
+
+}  // namespace FtpServer
+
+#endif /* FTP_HASH_H */
@@ -7,12 +7,15 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/select.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <atomic>
 
 #include "dirent.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "filesystem.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/semphr.h"
@@ -27,37 +30,152 @@ static constexpr uint32_t FTP_LOG_THROTTLE_MS = 200;
 static constexpr uint32_t FTP_LOG_THROTTLE_MAX = 5;
 static constexpr uint32_t FTP_SEND_TIMEOUT_MS = 200;
 static constexpr uint32_t FTP_PROGRESS_INTERVAL = 100 * 1024;  // 100KB
-static constexpr uint32_t FTP_DIR_ENTRY_MIN_SPACE = 64;
 static constexpr uint32_t FTP_TASK_STACK_SIZE = 1024 * 6;  // 6KB
+static constexpr uint32_t FTP_IDLE_WAIT_MS = 100;  // Upper bound so stop() is noticed
+static constexpr uint32_t FTP_IO_TASK_STACK_SIZE = 1024 * 4;  // 4KB
+static constexpr UBaseType_t FTP_IO_TASK_PRIORITY = 2;
+// Keep storage reads off the core that runs the WiFi stack when we can
+static constexpr BaseType_t FTP_IO_TASK_CORE = (portNUM_PROCESSORS > 1) ? 1 : 0;
+#ifdef CONFIG_FTP_RETR_READAHEAD
+static constexpr bool FTP_RETR_READAHEAD = true;
+#else
+static constexpr bool FTP_RETR_READAHEAD = false;
+#endif
+// Checksum taken inline with RETR/STOR/APPE: CRC32, or the algorithm the
+// session picked with OPTS HASH
+#if defined(CONFIG_FTP_TRANSFER_HASH_CRC32) || defined(CONFIG_FTP_TRANSFER_HASH_SELECTED)
+static constexpr bool FTP_TRANSFER_HASH = true;
+#else
+static constexpr bool FTP_TRANSFER_HASH = false;
+#endif
+#ifdef CONFIG_FTP_TRANSFER_HASH_SELECTED
+static constexpr bool FTP_TRANSFER_HASH_SELECTED = true;
+#else
+static constexpr bool FTP_TRANSFER_HASH_SELECTED = false;
+#endif
+
+// RFC 959 block mode: descriptor bits and the largest block
+static constexpr uint8_t FTP_BLOCK_EOF = 0x40;
+static constexpr uint8_t FTP_BLOCK_RESTART = 0x10;
+static constexpr uint8_t FTP_BLOCK_HEADER_SIZE = 3;
+static constexpr uint32_t FTP_BLOCK_SIZE_MAX = 0xFFFF;
+
+// Transfer modes as STAT reports them, indexed by ftp_mode_t
+static const char* const FTP_MODE_NAMES[] = {"STREAM", "BLOCK", "DEFLATE"};
+
+// MLSD/MLST facts, in the order they are printed. Bit i of a session's
+// fact selection stands for FTP_FACT_NAMES[i].
+static constexpr uint8_t FTP_FACT_TYPE = 0;
+static constexpr uint8_t FTP_FACT_SIZE = 1;
+static constexpr uint8_t FTP_FACT_MODIFY = 2;
+static constexpr uint8_t FTP_FACT_PERM = 3;
+static constexpr uint8_t FTP_FACT_COUNT = 4;
+static constexpr uint8_t FTP_FACTS_ALL = (1 << FTP_FACT_COUNT) - 1;
+static const char* const FTP_FACT_NAMES[FTP_FACT_COUNT] = {"type", "size", "modify", "perm"};
+
+// UTF-8 names only reach FatFs unchanged when it is built for UTF-8
+#ifdef CONFIG_FATFS_API_ENCODING_UTF_8
+#define FTP_FEAT_UTF8 "UTF8"
+#else
+#define FTP_FEAT_UTF8 nullptr
+#endif
+
+// Command registry: verb key, handler, prerequisites and name for logging.
+// FTP_CMD_FEAT also gives the line FEAT advertises for the command.
+#define FTP_CMD_FEAT(verb, handler, flags, feat) \
+    { Server::Session::ftp_cmd_key(verb), &Server::Session::handler, (flags), verb, feat }
+#define FTP_CMD(verb, handler, flags) FTP_CMD_FEAT(verb, handler, flags, nullptr)
+
+constexpr Server::Session::ftp_cmd_t Server::Session::ftp_cmd_table[] = {
+    FTP_CMD("USER", cmd_user, 0),
+    FTP_CMD("PASS", cmd_pass, 0),
+    FTP_CMD("QUIT", cmd_quit, 0),
+    FTP_CMD("FEAT", cmd_feat, 0),
+    FTP_CMD_FEAT("OPTS", cmd_opts, 0, FTP_FEAT_UTF8),
+    FTP_CMD("AUTH", cmd_auth, 0),
+    FTP_CMD("SYST", cmd_syst, FTP_CMD_NEEDS_LOGIN),
+    FTP_CMD("CDUP", cmd_cdup, FTP_CMD_NEEDS_LOGIN),
+    FTP_CMD("CWD", cmd_cwd, FTP_CMD_NEEDS_LOGIN),
+    FTP_CMD("PWD", cmd_pwd, FTP_CMD_NEEDS_LOGIN),
+    FTP_CMD("XPWD", cmd_pwd, FTP_CMD_NEEDS_LOGIN),
+    FTP_CMD_FEAT("SIZE", cmd_size, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG, "SIZE"),
+    FTP_CMD_FEAT("MDTM", cmd_mdtm, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG, "MDTM"),
+    FTP_CMD("TYPE", cmd_type, FTP_CMD_NEEDS_LOGIN),
+    FTP_CMD_FEAT("MODE", cmd_mode, FTP_CMD_NEEDS_LOGIN, "MODE Z"),
+    FTP_CMD("PASV", cmd_pasv, FTP_CMD_NEEDS_LOGIN),
+    FTP_CMD_FEAT("EPSV", cmd_epsv, FTP_CMD_NEEDS_LOGIN, "EPSV"),
+    FTP_CMD("LIST", cmd_list, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("NLST", cmd_nlst, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("MLSD", cmd_mlsd, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD_FEAT("MLST", cmd_mlst, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG, "MLST"),
+    FTP_CMD("RETR", cmd_retr, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("STOR", cmd_stor, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("APPE", cmd_appe, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("DELE", cmd_dele, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("RMD", cmd_rmd, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("MKD", cmd_mkd, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("RNFR", cmd_rnfr, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("RNTO", cmd_rnto, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD_FEAT("REST", cmd_rest, FTP_CMD_NEEDS_LOGIN, "REST STREAM"),
+    FTP_CMD("NOOP", cmd_noop, FTP_CMD_NEEDS_LOGIN),
+    FTP_CMD("STAT", cmd_stat, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD_FEAT("HASH", cmd_hash, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG, "HASH"),
+    FTP_CMD_FEAT("RANG", cmd_rang, FTP_CMD_NEEDS_LOGIN, "RANG STREAM"),
+    FTP_CMD("XCRC", cmd_xcrc, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("XMD5", cmd_xmd5, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("XSHA1", cmd_xsha1, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("XSHA256", cmd_xsha256, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+    FTP_CMD("XSHA512", cmd_xsha512, FTP_CMD_NEEDS_LOGIN | FTP_CMD_PATH_ARG),
+};
+
+// Open-addressing table from key hash to registry index, filled at compile
+// time. Collisions probe linearly, so the table must never be full.
+constexpr Server::Session::ftp_cmd_lookup_t Server::Session::build_cmd_lookup() {
+    constexpr uint32_t count = sizeof(ftp_cmd_table) / sizeof(ftp_cmd_table[0]);
+    static_assert(count <= FTP_CMD_LOOKUP_SIZE / 2, "FTP_CMD_LOOKUP_BITS too small");
+
+    ftp_cmd_lookup_t lookup = {};
+    for (uint32_t i = 0; i < FTP_CMD_LOOKUP_SIZE; i++) {
+        lookup.slot[i] = FTP_CMD_LOOKUP_EMPTY;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t slot = ftp_cmd_hash(ftp_cmd_table[i].key);
+        while (lookup.slot[slot] != FTP_CMD_LOOKUP_EMPTY) {
+            slot = (slot + 1) & (FTP_CMD_LOOKUP_SIZE - 1);
+        }
+        lookup.slot[slot] = (uint8_t)i;
+    }
+    return lookup;
+}
 
-// Static member initialization
-const Server::ftp_cmd_t Server::ftp_cmd_table[] = {
-    {"FEAT"}, {"SYST"}, {"CDUP"}, {"CWD"},  {"PWD"},  {"XPWD"}, {"SIZE"},
-    {"MDTM"}, {"TYPE"}, {"USER"}, {"PASS"}, {"PASV"}, {"LIST"}, {"RETR"},
-    {"STOR"}, {"DELE"}, {"RMD"},  {"MKD"},  {"RNFR"}, {"RNTO"}, {"NOOP"},
-    {"QUIT"}, {"APPE"}, {"NLST"}, {"AUTH"}};
+constexpr Server::Session::ftp_cmd_lookup_t Server::Session::ftp_cmd_lookup =
+    Server::Session::build_cmd_lookup();
 
 // Constructor
 Server::Server()
     : xEventTask(nullptr),
       ftp_task_handle(nullptr),
+      ftp_io_task_handle(nullptr),
+      ftp_io_queue(nullptr),
       ftp_mutex(nullptr),
-      ftp_buff_size(FTPSERVER_BUFFER_SIZE),
       ftp_timeout(FTP_CMD_TIMEOUT_MS),
       FTP_TAG("[Server]"),
       MOUNT_POINT(""),
-      ftp_path(nullptr),
-      ftp_scratch_buffer(nullptr),
-      ftp_cmd_buffer(nullptr),
-      ftp_stop(0),
-      ftp_nlist(0) {
+      lc_sd(-1),
+      ftp_pasv_next(0),
+      ftp_state(E_FTP_STE_DISABLED),
+      ftp_enabled(false),
+      ftp_stop(0) {
     ftp_mutex = xSemaphoreCreateMutex();
     if (!ftp_mutex) {
         ESP_LOGE(FTP_TAG, "Failed to create FTP mutex!");
     }
-    memset(&ftp_data, 0, sizeof(ftp_data_t));
     memset(ftp_user, 0, sizeof(ftp_user));
     memset(ftp_pass, 0, sizeof(ftp_pass));
+    for (uint8_t i = 0; i < FTP_PASSIVE_PORTS; i++) {
+        ftp_pasv_sd[i] = -1;
+        ftp_pasv_busy[i] = false;
+    }
 }
 
 // Destructor
@@ -70,6 +188,52 @@ Server::~Server() {
     }
 }
 
+Server::Session::Session()
+    : server(nullptr),
+      index(0),
+      FTP_TAG("[Session]"),
+      MOUNT_POINT(""),
+      ftp_buff_size(FTPSERVER_BUFFER_SIZE),
+      ftp_path(nullptr),
+      ftp_saved_path(nullptr),
+      ftp_scratch_buffer(nullptr),
+      ftp_cmd_buffer(nullptr),
+      ftp_cmd_len(0),
+      ftp_cmd_discard(false),
+      ftp_list_format(E_FTP_LIST_UNIX),
+      ftp_mlst_facts(FTP_FACTS_ALL),
+      ftp_hash_algo(Hasher::E_HASH_SHA256),
+      ftp_reply_queue(nullptr),
+      ftp_reply_head(0),
+      ftp_reply_len(0),
+      ftp_io_head(0),
+      ftp_spool(nullptr),
+      ftp_spool_head(0),
+      ftp_spool_tail(0),
+      ftp_spool_used(0),
+      ftp_spool_busy(false),
+      ftp_spool_eof(false),
+      ftp_spool_done(false),
+      ftp_spool_error(false),
+      ftp_ascii_buffer(nullptr) {
+    memset(&ftp_data, 0, sizeof(ftp_data_t));
+    for (ftp_io_buf_t& io : ftp_io_bufs) {
+        io.data = nullptr;
+        io.len = 0;
+        io.result = E_FTP_RESULT_OK;
+        io.state.store(E_FTP_IO_IDLE);
+    }
+    ftp_data.c_sd = -1;
+    ftp_data.d_sd = -1;
+    ftp_data.ld_sd = -1;
+    ftp_data.pasv_slot = -1;
+    ftp_write_path[0] = '\0';
+}
+
+Server::Session::~Session() {
+    deinit();
+}
+
 static uint32_t last_screen_log_ms = 0;
 static uint32_t screen_log_count = 0;
 
@@ -105,7 +269,7 @@ void Server::log_to_screen(const char* format, ...) {
 }
 
 // Helper functions
-void Server::translate_path(char* actual, size_t actual_size, const char* display) {
+void Server::Session::translate_path(char* actual, size_t actual_size, const char* display) {
     if (actual_size == 0) return;
 
     // Check for /data prefix
@@ -134,13 +298,79 @@ void Server::translate_path(char* actual, size_t actual_size, const char* displa
     snprintf(actual, actual_size, "%s", display);
 }
 
-void Server::get_full_path(char* fullname, size_t size, const char* display_path) {
+void Server::Session::get_full_path(char* fullname, size_t size, const char* display_path) {
     char actual[128];
     translate_path(actual, sizeof(actual), display_path);
     snprintf(fullname, size, "%s%s", MOUNT_POINT, actual);
 }
 
-bool Server::secure_compare(const char* a, const char* b, size_t len) {
+// stat() through the metadata caches: the stat LRU first, then the index
+// or a cached listing of the parent directory, and only then the FAT
+bool Server::Session::stat_cached(const char* fullname, fs_stat_t* st) {
+    if (server->ftp_stat_cache.lookup(fullname, st)) {
+        return true;
+    }
+    DirIndex::lookup_t indexed = server->ftp_dir_index.find(fullname, st);
+    if (indexed == DirIndex::E_INDEX_MISSING) {
+        return false;
+    }
+    if (indexed == DirIndex::E_INDEX_NONE && !server->ftp_list_cache.find(fullname, st) &&
+        !stat_disk(fullname, st)) {
+        return false;
+    }
+    server->ftp_stat_cache.insert(fullname, st);
+    return true;
+}
+
+bool Server::Session::stat_disk(const char* fullname, fs_stat_t* st) {
+    struct stat buf;
+    if (stat(fullname, &buf) != 0) {
+        return false;
+    }
+    st->size = buf.st_size;
+    st->mtime = buf.st_mtime;
+    st->is_dir = S_ISDIR(buf.st_mode);
+    return true;
+}
+
+// True when the index of the parent directory proves fullname does not
+// exist, which spares RETR and DELE a linear directory scan
+bool Server::Session::known_missing(const char* fullname) {
+    fs_stat_t st;
+    return server->ftp_dir_index.find(fullname, &st) == DirIndex::E_INDEX_MISSING;
+}
+
+// Records a file or directory that was just created or written in its
+// parent's index. The metadata is read back, since FatFs stamps the time
+// when the file is closed; if that fails the index is dropped instead.
+void Server::Session::index_changed(const char* fullname) {
+    if (!server->ftp_dir_index.covers(fullname)) {
+        return;
+    }
+    fs_stat_t st;
+    if (stat_disk(fullname, &st)) {
+        server->ftp_dir_index.update(fullname, &st);
+    } else {
+        server->ftp_dir_index.forget(fullname);
+    }
+}
+
+// Drops everything cached about fullname after it was created, written,
+// renamed or removed. tree also drops whatever is cached below it.
+void Server::Session::invalidate_cached(const char* fullname, bool tree) {
+    storage_file_changed(fullname, tree);
+    server->ftp_list_cache.invalidate_parent(fullname);
+    if (tree) {
+        server->ftp_list_cache.invalidate_tree(fullname);
+        server->ftp_stat_cache.invalidate_tree(fullname);
+        server->ftp_hash_cache.invalidate_tree(fullname);
+    } else {
+        server->ftp_stat_cache.invalidate(fullname);
+        server->ftp_hash_cache.invalidate(fullname);
+    }
+}
+
+bool Server::Session::secure_compare(const char* a, const char* b, size_t len) {
     volatile uint8_t result = 0;
     for (size_t i = 0; i < len; i++) {
         result |= (uint8_t)a[i] ^ (uint8_t)b[i];
@@ -153,7 +383,7 @@ uint64_t Server::mp_hal_ticks_ms() {
     return time_ms;
 }
 
-bool Server::add_virtual_dir_if_mounted(const char* mount_point, const char* name,
+bool Server::Session::add_virtual_dir_if_mounted(const char* mount_point, const char* name,
                                          char* list, uint32_t maxlistsize, uint32_t* next) {
     DIR* test_dir = opendir(mount_point);
     if (test_dir == nullptr) return false;
@@ -161,28 +391,19 @@ bool Server::add_virtual_dir_if_mounted(const char* mount_point, const char* nam
 
     if (*next >= maxlistsize) return false;
 
-    struct dirent de = {};
-    de.d_type = DT_DIR;
-    strncpy(de.d_name, name, sizeof(de.d_name) - 1);
+    storage_dirent_t de = {};
+    de.name = name;
+    de.is_dir = true;
+    de.mtime = 946684800;
 
-    char* list_ptr = list + *next;
-    uint32_t remaining = maxlistsize - *next;
-    // Note: get_eplf_item may reallocate, but since we're using a fixed buffer
-    // for virtual dirs and names are short, this should not trigger reallocation
-    if (remaining < 128) return false; // Ensure adequate space
-    *next += get_eplf_item(&list_ptr, &remaining, &de);
+    int len = get_eplf_item(list + *next, maxlistsize - *next, &de);
+    if (len < 0) return false;
+    *next += len;
     return true;
 }
 
-void Server::stoupper(char* str) {
-    while (str && *str != '\0') {
-        *str = (char)toupper((int)(*str));
-        str++;
-    }
-}
-
 // File operations
-bool Server::open_file(const char* path, const char* mode) {
+bool Server::Session::open_file(const char* path, const char* mode) {
     ESP_LOGD(FTP_TAG, "open_file: path=[%s]", path);
     char fullname[128];
     get_full_path(fullname, sizeof(fullname), path);
@@ -193,79 +414,558 @@ bool Server::open_file(const char* path, const char* mode) {
         struct stat st;
         if (stat(VFS_NATIVE_EXTERNAL_MP, &st) != 0) {
             ESP_LOGE(FTP_TAG, "SD Card not accessible!");
-            log_to_screen("[!!] SD Card unavailable");
+            server->log_to_screen("[!!] SD Card unavailable");
             return false;
         }
     }
 
+    if (mode[0] == 'r' && known_missing(fullname)) {
+        return false;
+    }
+
     ESP_LOGD(FTP_TAG, "open_file: fullname=[%s]", fullname);
-    ftp_data.fp = fopen(fullname, mode);
+    // Opened through FatFs directly: transfers already move cluster-sized
+    // blocks, and reads get a cluster link map so REST seeks are O(1)
+    ftp_data.fp = storage_fopen(fullname, mode);
     if (ftp_data.fp == nullptr) {
         ESP_LOGE(FTP_TAG, "open_file: open fail [%s]", fullname);
         return false;
     }
+    if (mode[0] == 'r' && ftp_data.restart > 0) {
+        ESP_LOGI(FTP_TAG, "open_file: restart at %" PRIu64, ftp_data.restart);
+        if (!storage_fseek(ftp_data.fp, ftp_data.restart)) {
+            storage_fclose(ftp_data.fp);
+            ftp_data.fp = nullptr;
+            return false;
+        }
+    }
+    ftp_data.io_size = MIN((uint32_t)storage_io_size(fullname), (uint32_t)FTP_IO_BUFFER_SIZE);
+    if (ftp_data.mode == E_FTP_MODE_BLOCK) {
+        // Each read-ahead buffer goes out as one block
+        while (ftp_data.io_size > FTP_BLOCK_SIZE_MAX) {
+            ftp_data.io_size /= 2;
+        }
+    }
+    ftp_data.rx_header_len = 0;
+    ftp_data.rx_desc = 0;
+    ftp_data.rx_left = 0;
+    ftp_data.ascii_cr = false;
+    ftp_data.read_left = UINT64_MAX;
     ftp_data.e_open = E_FTP_FILE_OPEN;
     return true;
 }
 
-void Server::close_files_dir() {
+// Opens the file of a RETR, STOR or APPE, with the MODE Z codec ready.
+// The file data is checksummed as it is read or written, for the 226
+// reply and, when the whole file goes through, the checksum cache.
+bool Server::Session::open_transfer(const char* path, const char* mode) {
+    ftp_data.hash_inline = false;
+    if (!open_file(path, mode)) {
+        return false;
+    }
+    if (ftp_data.mode == E_FTP_MODE_DEFLATE && !start_codec(strpbrk(mode, "wa+") != nullptr)) {
+        close_files_dir();
+        return false;
+    }
+    if (FTP_TRANSFER_HASH) {
+        ftp_data.hash_algo = FTP_TRANSFER_HASH_SELECTED ? ftp_hash_algo : (uint8_t)Hasher::E_HASH_CRC32;
+        ftp_data.hash_whole = (ftp_data.restart == 0 && mode[0] != 'a');
+        get_full_path(ftp_hash_path, sizeof(ftp_hash_path), path);
+        ftp_hasher.begin((Hasher::algo_t)ftp_data.hash_algo);
+        ftp_data.hash_inline = true;
+    }
+    return true;
+}
+
+// Sends the final reply of a file transfer, after the file is closed. A
+// completed transfer reports its checksum, e.g. "226 CRC32 1c291ca3". A
+// failed one leaves the data connection out of step, with a MODE B
+// stream missing its EOF block or upload data still unread, so the
+// connection is closed.
+void Server::Session::transfer_reply(uint32_t status, char* message) {
+    if (status != 226) {
+        closesocket(ftp_data.d_sd);
+        ftp_data.d_sd = -1;
+    }
+    if (!ftp_data.hash_inline) {
+        send_reply(status, message);
+        return;
+    }
+    ftp_data.hash_inline = false;
+    if (status != 226) {
+        ftp_hasher.abort();
+        send_reply(status, message);
+        return;
+    }
+    uint8_t digest[FTP_HASH_MAX_SIZE];
+    size_t len = ftp_hasher.finish(digest);
+    fs_stat_t st;
+    if (ftp_data.hash_whole && stat_cached(ftp_hash_path, &st)) {
+        server->ftp_hash_cache.insert(ftp_hash_path, &st, ftp_data.hash_algo, digest, len);
+    }
+    char hex[2 * FTP_HASH_MAX_SIZE + 1];
+    Hasher::to_hex(hex, digest, len);
+    snprintf((char*)ftp_data.dBuffer, ftp_buff_size, "%s %s",
+             Hasher::name((Hasher::algo_t)ftp_data.hash_algo), hex);
+    send_reply(226, (char*)ftp_data.dBuffer);
+}
+
+void Server::Session::close_files_dir() {
+    if (ftp_data.readahead) {
+        wait_for_io();
+        ftp_data.readahead = false;
+    }
+    if (ftp_data.spool) {
+        // Abandon whatever is still queued and let the writer finish its chunk
+        ftp_spool_error.store(true, std::memory_order_release);
+        while (ftp_spool_busy.load(std::memory_order_acquire)) {
+            vTaskDelay(1);
+        }
+        ftp_data.spool = false;
+    }
     if (ftp_data.e_open == E_FTP_FILE_OPEN) {
-        fclose(ftp_data.fp);
+        storage_fclose(ftp_data.fp);
         ftp_data.fp = nullptr;
+        if (ftp_write_path[0] != '\0') {
+            // Size and date changed with the upload
+            invalidate_cached(ftp_write_path, false);
+            index_changed(ftp_write_path);
+            ftp_write_path[0] = '\0';
+        }
     } else if (ftp_data.e_open == E_FTP_DIR_OPEN) {
-        if (!ftp_data.listroot) {
-            closedir(ftp_data.dp);
+        if (ftp_data.list_cached) {
+            server->ftp_list_cache.close(&ftp_data.list_cursor);
+            ftp_data.list_cached = false;
+        } else if (!ftp_data.listroot) {
+            storage_closedir(ftp_data.dp);
+        }
+        if (ftp_data.list_fill) {
+            // Listing aborted before the end, the recording is incomplete
+            server->ftp_list_cache.end_fill(&ftp_data.list_cursor, false);
+            ftp_data.list_fill = false;
+        }
+        if (ftp_data.index_build) {
+            server->ftp_dir_index.end_build(ftp_data.index_slot, false);
+            ftp_data.index_build = false;
         }
         ftp_data.dp = nullptr;
     }
     ftp_data.e_open = E_FTP_NOTHING_OPEN;
 }
 
-void Server::close_filesystem_on_error() {
+void Server::Session::close_filesystem_on_error() {
     close_files_dir();
     if (ftp_data.fp) {
-        fclose(ftp_data.fp);
+        storage_fclose(ftp_data.fp);
         ftp_data.fp = nullptr;
     }
     if (ftp_data.dp && !ftp_data.listroot) {
-        closedir(ftp_data.dp);
+        storage_closedir(ftp_data.dp);
         ftp_data.dp = nullptr;
     }
 }
 
-Server::ftp_result_t Server::read_file(char* filebuf, uint32_t desiredsize,
-                                       uint32_t* actualsize) {
-    ftp_result_t result = E_FTP_RESULT_CONTINUE;
-    *actualsize = fread(filebuf, 1, desiredsize, ftp_data.fp);
-    if (*actualsize == 0) {
-        if (feof(ftp_data.fp))
-            result = E_FTP_RESULT_OK;
-        else
-            result = E_FTP_RESULT_FAILED;
-        close_files_dir();
-    } else if (*actualsize < desiredsize) {
-        close_files_dir();
+Server::ftp_result_t Server::Session::write_file(char* filebuf, uint32_t size) {
+    ftp_result_t result = E_FTP_RESULT_FAILED;
+    if (write_data((uint8_t*)filebuf, size)) {
         result = E_FTP_RESULT_OK;
+    } else {
+        close_files_dir();
     }
     return result;
 }
 
-Server::ftp_result_t Server::write_file(char* filebuf, uint32_t size) {
-    ftp_result_t result = E_FTP_RESULT_FAILED;
-    uint32_t actualsize = fwrite(filebuf, 1, size, ftp_data.fp);
-    if (actualsize == size) {
-        result = E_FTP_RESULT_OK;
+// Writes received file data, with CRLF line ends converted in TYPE A. A
+// length of 0 ends the file. Runs on the storage task for spooled uploads.
+bool Server::Session::write_data(uint8_t* data, uint32_t len) {
+    if (ftp_data.ascii) {
+        if (ascii_cr_alone(ftp_data.ascii_cr, data, len)) {
+            static const uint8_t cr = '\r';
+            if (!storage_fwrite(ftp_data.fp, &cr, 1)) {
+                return false;
+            }
+            if (ftp_data.hash_inline) {
+                ftp_hasher.update(&cr, 1);
+            }
+        }
+        len = ascii_decode(data, len, &ftp_data.ascii_cr);
+    }
+    if (len == 0) {
+        return true;
+    }
+    if (ftp_data.hash_inline) {
+        ftp_hasher.update(data, len);
+    }
+    return storage_fwrite(ftp_data.fp, data, len);
+}
+
+void Server::Session::start_readahead() {
+    ftp_data.readahead = true;
+    ftp_io_head = 0;
+    for (uint8_t i = 0; i < FTP_IO_BUFFERS; i++) {
+        queue_io_read(i);
+    }
+}
+
+void Server::Session::queue_io_read(uint8_t buf) {
+    ftp_io_bufs[buf].state.store(E_FTP_IO_PENDING, std::memory_order_release);
+    if (!FTP_RETR_READAHEAD || !server->queue_io(this, E_FTP_IO_READ, buf)) {
+        // Read-ahead disabled or storage task unavailable: read synchronously
+        fill_io_buffer(buf);
+    }
+}
+
+// Runs on the storage I/O task. Only touches the file and the given buffer;
+// the FTP task does not use either while the buffer is pending.
+void Server::Session::fill_io_buffer(uint8_t buf) {
+    ftp_io_buf_t& io = ftp_io_bufs[buf];
+    size_t len = 0;
+    size_t want = (size_t)MIN((uint64_t)ftp_data.io_size, ftp_data.read_left);
+    bool ok = (want == 0) || storage_fread(ftp_data.fp, io.data, want, &len);
+    io.len = len;
+    ftp_data.read_left -= len;
+    if (ok && ftp_data.hash_inline) {
+        ftp_hasher.update(io.data, len);
+    }
+    if (!ok) {
+        io.result = E_FTP_RESULT_FAILED;
+    } else if (io.len == ftp_data.io_size && ftp_data.read_left > 0) {
+        io.result = E_FTP_RESULT_CONTINUE;
+    } else {
+        io.result = E_FTP_RESULT_OK;
+    }
+    io.state.store(E_FTP_IO_READY, std::memory_order_release);
+}
+
+// The file must not be closed while the storage task still owns a buffer
+void Server::Session::wait_for_io() {
+    for (ftp_io_buf_t& io : ftp_io_bufs) {
+        while (io.state.load(std::memory_order_acquire) == E_FTP_IO_PENDING) {
+            vTaskDelay(1);
+        }
+        io.state.store(E_FTP_IO_IDLE, std::memory_order_relaxed);
+    }
+}
+
+// Generates and sends listing windows until the socket stops taking
+// data, so a large directory streams at link speed through one fixed
+// buffer instead of a few entries per loop iteration. A STAT listing goes
+// out the same way on the control connection, after its first reply line.
+void Server::Session::continue_listing() {
+    if (ftp_data.list_control && flush_replies() != E_FTP_RESULT_OK) {
+        return;
+    }
+    for (;;) {
+        if (ftp_data.tx_len == 0) {
+            if (ftp_data.listdone) {
+                if (ftp_data.list_control) {
+                    send_reply(213, (char*)"End of status");
+                    ftp_data.list_control = false;
+                    ftp_data.state = E_FTP_STE_READY;
+                } else {
+                    send_reply(226, nullptr);
+                    ftp_data.state = E_FTP_STE_END_TRANSFER;
+                }
+                return;
+            }
+            uint32_t listsize = 0;
+            ftp_data.listdone = (list_dir((char*)ftp_data.dBuffer, ftp_buff_size,
+                                          &listsize) == E_FTP_RESULT_OK);
+            queue_data(ftp_data.dBuffer, listsize, ftp_data.listdone);
+        }
+        ftp_result_t result = send_pending_data();
+        if (result == E_FTP_RESULT_CONTINUE) {
+            return;  // Socket full, resume when writable
+        }
+        if (result == E_FTP_RESULT_FAILED) {
+            if (ftp_data.list_control) {
+                close_files_dir();
+                reset();  // The client stopped reading its control connection
+            } else {
+                abort_transfer();
+            }
+            return;
+        }
+    }
+}
+
+void Server::Session::continue_readahead() {
+    ftp_io_buf_t& io = ftp_io_bufs[ftp_io_head];
+    if (ftp_data.tx_len == 0) {
+        if (io.state.load(std::memory_order_acquire) != E_FTP_IO_READY) {
+            return;
+        }
+        if (io.result == E_FTP_RESULT_FAILED) {
+            close_files_dir();
+            transfer_reply(451);
+            ftp_data.state = E_FTP_STE_END_TRANSFER;
+            return;
+        }
+        queue_data(io.data, io.len, io.result == E_FTP_RESULT_OK);
+    }
+    // Sent even when empty: in MODE Z the last buffer also ends the stream
+    ftp_result_t result = send_pending_data();
+    if (result == E_FTP_RESULT_CONTINUE) {
+        return;  // Socket full, resume when writable
+    }
+    if (result == E_FTP_RESULT_FAILED) {
+        abort_transfer();
+        return;
+    }
+    ftp_data.total += io.len;
+    ESP_LOGI(FTP_TAG, "Sent %" PRIu32 ", total: %" PRIu32,
+             io.len, ftp_data.total);
+    if (ftp_data.total % 102400 == 0 && ftp_data.total > 0) {
+        server->log_to_screen("[^^] Progress: %" PRIu32 " KB", ftp_data.total / 1024);
+    }
+    if (io.result == E_FTP_RESULT_OK) {
+        close_files_dir();
+        transfer_reply(226);
+        ftp_data.state = E_FTP_STE_END_TRANSFER;
+        ESP_LOGI(FTP_TAG, "File sent (%" PRIu32 " bytes in %" PRIu32 " msec).",
+                 ftp_data.total, ftp_data.time);
     } else {
+        // The buffer is only refilled once it has been fully sent, so a slow
+        // client throttles the storage reader instead of failing the transfer
+        queue_io_read(ftp_io_head);
+        ftp_io_head = (ftp_io_head + 1) % FTP_IO_BUFFERS;
+    }
+}
+
+// Starts a HASH or X* checksum of the file in ftp_path, over the RANG
+// range if one is set. A whole file whose checksum is cached is answered
+// at once; otherwise the file is read through the read-ahead buffers and
+// hashed as they arrive, without blocking the other sessions.
+void Server::Session::start_hash(Hasher::algo_t algo, bool legacy) {
+    bool ranged = ftp_data.range_set;
+    uint64_t first = ftp_data.range_start;
+    uint64_t last = ftp_data.range_end;
+    ftp_data.range_set = false;
+
+    fs_stat_t st;
+    get_full_path(ftp_hash_path, sizeof(ftp_hash_path), ftp_path);
+    if (!stat_cached(ftp_hash_path, &st) || st.is_dir) {
+        send_reply(550, nullptr);
+        return;
+    }
+    if (!ranged) {
+        first = 0;
+        last = (st.size > 0) ? st.size - 1 : 0;
+    } else if (first >= st.size && st.size > 0) {
+        send_reply(501, (char*)"Range beyond the end of the file");
+        return;
+    } else if (last >= st.size) {
+        last = (st.size > 0) ? st.size - 1 : 0;
+    }
+    ftp_data.hash_algo = algo;
+    ftp_data.hash_legacy = legacy;
+    ftp_data.hash_start = first;
+    ftp_data.hash_end = last;
+    ftp_data.hash_left = (st.size > 0) ? last - first + 1 : 0;
+    ftp_data.hash_whole = (ftp_data.hash_left == st.size);
+    ftp_data.hash_st = st;
+    snprintf(ftp_hash_name, sizeof(ftp_hash_name), "%s", ftp_path);
+
+    uint8_t digest[FTP_HASH_MAX_SIZE];
+    uint8_t len = 0;
+    if (ftp_data.hash_whole) {
+        len = server->ftp_hash_cache.lookup(ftp_hash_path, &st, algo, digest);
+    }
+    if (len > 0) {
+        finish_hash(digest, len);
+        return;
+    }
+    uint64_t restart = ftp_data.restart;  // A REST still applies to the next transfer
+    ftp_data.restart = first;
+    bool opened = open_file(ftp_path, "rb");
+    ftp_data.restart = restart;
+    if (!opened) {
+        send_reply(550, nullptr);
+        return;
+    }
+    ftp_data.read_left = ftp_data.hash_left;
+    ftp_data.hash_inline = false;
+    ftp_hasher.begin(algo);
+    if (ftp_data.hash_left == 0) {
         close_files_dir();
+        len = ftp_hasher.finish(digest);
+        finish_hash(digest, len);
+        return;
+    }
+    start_readahead();
+    ftp_data.state = E_FTP_STE_CONTINUE_HASH;
+}
+
+void Server::Session::continue_hash() {
+    ftp_io_buf_t& io = ftp_io_bufs[ftp_io_head];
+    if (io.state.load(std::memory_order_acquire) != E_FTP_IO_READY) {
+        return;
+    }
+    if (io.result == E_FTP_RESULT_FAILED) {
+        close_files_dir();
+        ftp_hasher.abort();
+        send_reply(451, nullptr);
+        ftp_data.state = E_FTP_STE_READY;
+        return;
+    }
+    uint32_t len = (uint32_t)MIN((uint64_t)io.len, ftp_data.hash_left);
+    ftp_hasher.update(io.data, len);
+    ftp_data.hash_left -= len;
+    if (ftp_data.hash_left == 0 || io.result == E_FTP_RESULT_OK) {
+        close_files_dir();
+        uint8_t digest[FTP_HASH_MAX_SIZE];
+        size_t digest_len = ftp_hasher.finish(digest);
+        if (ftp_data.hash_whole) {
+            server->ftp_hash_cache.insert(ftp_hash_path, &ftp_data.hash_st, ftp_data.hash_algo,
+                                          digest, digest_len);
+        }
+        ftp_data.state = E_FTP_STE_READY;
+        finish_hash(digest, digest_len);
+    } else {
+        queue_io_read(ftp_io_head);
+        ftp_io_head = (ftp_io_head + 1) % FTP_IO_BUFFERS;
+    }
+}
+
+// HASH replies with the algorithm, range, digest and file name
+// (draft-bryan-ftpext-hash), the X* commands with just the digest
+void Server::Session::finish_hash(const uint8_t* digest, size_t len) {
+    char hex[2 * FTP_HASH_MAX_SIZE + 1];
+    Hasher::to_hex(hex, digest, len);
+    if (ftp_data.hash_legacy) {
+        send_reply(250, hex);
+        return;
+    }
+    snprintf((char*)ftp_data.dBuffer, ftp_buff_size, "%s %" PRIu64 "-%" PRIu64 " %s %s",
+             Hasher::name((Hasher::algo_t)ftp_data.hash_algo), ftp_data.hash_start,
+             ftp_data.hash_end, hex, ftp_hash_name);
+    send_reply(213, (char*)ftp_data.dBuffer);
+}
+
+void Server::Session::start_spool() {
+    ftp_spool_head = 0;
+    ftp_spool_tail = 0;
+    ftp_spool_used.store(0, std::memory_order_relaxed);
+    ftp_spool_eof.store(false, std::memory_order_relaxed);
+    ftp_spool_done.store(false, std::memory_order_relaxed);
+    ftp_spool_error.store(false, std::memory_order_relaxed);
+    ftp_spool_busy.store(false, std::memory_order_release);
+    ftp_data.spool = true;
+}
+
+void Server::Session::kick_spool() {
+    if (!ftp_spool_busy.exchange(true, std::memory_order_acq_rel)) {
+        if (!server->queue_io(this, E_FTP_IO_FLUSH, 0)) {
+            flush_spool();
+        }
+    }
+}
+
+// Runs on the storage I/O task. Writes the spool out in the largest
+// contiguous run of whole I/O blocks; the tail end smaller than a block is
+// left for later unless the upload has finished.
+void Server::Session::flush_spool() {
+    while (!ftp_spool_error.load(std::memory_order_acquire)) {
+        uint32_t used = ftp_spool_used.load(std::memory_order_acquire);
+        uint32_t contiguous = FTP_SPOOL_SIZE - ftp_spool_tail;
+        uint32_t chunk = MIN(used, contiguous);
+        if (chunk < contiguous && !ftp_spool_eof.load(std::memory_order_acquire)) {
+            chunk -= chunk % ftp_data.io_size;
+        }
+        if (chunk == 0) {
+            if (used == 0 && ftp_spool_eof.load(std::memory_order_acquire) &&
+                !ftp_spool_done.load(std::memory_order_relaxed)) {
+                if (write_data(nullptr, 0)) {
+                    ftp_spool_done.store(true, std::memory_order_release);
+                } else {
+                    ftp_spool_error.store(true, std::memory_order_release);
+                }
+            }
+            break;
+        }
+        if (!write_data(ftp_spool + ftp_spool_tail, chunk)) {
+            ftp_spool_error.store(true, std::memory_order_release);
+            break;
+        }
+        ftp_spool_tail = (ftp_spool_tail + chunk) % FTP_SPOOL_SIZE;
+        ftp_spool_used.fetch_sub(chunk, std::memory_order_release);
+    }
+    ftp_spool_busy.store(false, std::memory_order_release);
+}
+
+void Server::Session::continue_spool() {
+    if (ftp_spool_error.load(std::memory_order_acquire)) {
+        close_files_dir();
+        transfer_reply(451);
+        ftp_data.state = E_FTP_STE_END_TRANSFER;
+        ESP_LOGW(FTP_TAG, "Error writing to file");
+        return;
+    }
+
+    if (ftp_spool_eof.load(std::memory_order_relaxed)) {
+        // The transfer is only complete once the spool is on disk. An empty
+        // spool is not enough: a flush that found it empty before EOF was
+        // flagged skipped the final write, so wait until one has seen both.
+        if (ftp_spool_done.load(std::memory_order_acquire) &&
+            !ftp_spool_busy.load(std::memory_order_acquire)) {
+            ftp_data.spool = false;
+            close_files_dir();
+            transfer_reply(rx_complete() ? 226 : 426);
+            ftp_data.state = E_FTP_STE_END_TRANSFER;
+            ESP_LOGI(FTP_TAG,
+                     "File received (%" PRIu32 " bytes in %" PRIu32 " msec).",
+                     ftp_data.total, ftp_data.time);
+        } else {
+            kick_spool();
+        }
+        return;
+    }
+
+    uint32_t space = FTP_SPOOL_SIZE - ftp_spool_used.load(std::memory_order_acquire);
+    if (space == 0) {
+        // Spool full: stop reading so the TCP window closes until the writer catches up
+        kick_spool();
+        return;
+    }
+
+    int32_t len;
+    uint32_t contiguous = MIN(space, FTP_SPOOL_SIZE - ftp_spool_head);
+    ftp_result_t result = recv_data(ftp_spool + ftp_spool_head, contiguous, &len);
+    if (result == E_FTP_RESULT_OK) {
+        ftp_data.dtimeout = 0;
+        ftp_data.ctimeout = 0;
+        ftp_spool_head = (ftp_spool_head + len) % FTP_SPOOL_SIZE;
+        uint32_t used = ftp_spool_used.fetch_add(len, std::memory_order_release) + len;
+        ftp_data.total += len;
+        ESP_LOGI(FTP_TAG, "Received %" PRIu32 ", total: %" PRIu32,
+                 len, ftp_data.total);
+        if (ftp_data.total % 102400 == 0 && ftp_data.total > 0) {
+            server->log_to_screen("[^^] Progress: %" PRIu32 " KB", ftp_data.total / 1024);
+        }
+        if (used >= ftp_data.io_size) {
+            kick_spool();
+        }
+    } else if (result == E_FTP_RESULT_CONTINUE) {
+        if (ftp_data.dtimeout > FTP_DATA_TIMEOUT_MS) {
+            close_files_dir();
+            transfer_reply(426);
+            ftp_data.state = E_FTP_STE_END_TRANSFER;
+            ESP_LOGW(FTP_TAG, "Receiving to file timeout");
+        }
+    } else {
+        ftp_spool_eof.store(true, std::memory_order_release);
+        kick_spool();
     }
-    return result;
 }
 
-Server::ftp_result_t Server::open_dir_for_listing(const char* path) {
+Server::ftp_result_t Server::Session::open_dir_for_listing(const char* path) {
     if (ftp_data.dp) {
-        closedir(ftp_data.dp);
+        storage_closedir(ftp_data.dp);
         ftp_data.dp = nullptr;
     }
+    ftp_data.list_cached = false;
+    ftp_data.list_fill = false;
+    ftp_data.index_build = false;
     if (strcmp(path, "/") == 0) {
         ftp_data.listroot = true;
         ftp_data.e_open = E_FTP_DIR_OPEN;
@@ -276,84 +976,165 @@ Server::ftp_result_t Server::open_dir_for_listing(const char* path) {
         translate_path(actual_path, sizeof(actual_path), path);
         char fullname[128];
         snprintf(fullname, sizeof(fullname), "%s%s", MOUNT_POINT, actual_path);
-        ftp_data.dp = opendir(fullname);
+        ftp_data.list_cached = server->ftp_list_cache.open(fullname, &ftp_data.list_cursor);
+        if (ftp_data.list_cached) {
+            ESP_LOGD(FTP_TAG, "Listing cache hit: %s", fullname);
+            ftp_data.e_open = E_FTP_DIR_OPEN;
+            return E_FTP_RESULT_CONTINUE;
+        }
+        ftp_data.dp = storage_opendir(fullname);
         if (ftp_data.dp == nullptr) {
             return E_FTP_RESULT_FAILED;
         }
+        ftp_data.list_fill = server->ftp_list_cache.begin_fill(fullname, &ftp_data.list_cursor);
+        ftp_data.index_build = server->ftp_dir_index.begin_build(fullname, &ftp_data.index_slot);
         ftp_data.e_open = E_FTP_DIR_OPEN;
         return E_FTP_RESULT_CONTINUE;
     }
 }
 
-int Server::get_eplf_item(char** dest, uint32_t* destsize, struct dirent* de) {
-    const char* type = (de->d_type & DT_DIR) ? "d" : "-";
+// Formats one listing line into dest. Size and date come from the
+// directory record the entry was read from, so no per-entry stat() is
+// needed. Returns -1 if the line does not fit in destsize.
+int Server::Session::get_eplf_item(char* dest, uint32_t destsize, const storage_dirent_t* de) {
+    int len;
+    if (ftp_list_format == E_FTP_LIST_NAMES) {
+        len = snprintf(dest, destsize, "%s\r\n", de->name);
+    } else if (ftp_list_format == E_FTP_LIST_MLSD) {
+        len = get_mlst_facts(dest, destsize, de);
+        if (len >= 0) {
+            int name_len = snprintf(dest + len, destsize - len, " %s\r\n", de->name);
+            len = (name_len < 0) ? -1 : len + name_len;
+        }
+    } else {
+        char str_time[64];
+        struct tm tm_info;
+        time_t now;
+        if (time(&now) < 0) now = 946684800;
+
+        if (localtime_r(&de->mtime, &tm_info) != nullptr) {
+            if ((de->mtime + FTP_UNIX_SECONDS_180_DAYS) < now)
+                strftime(str_time, sizeof(str_time), "%b %d %Y", &tm_info);
+            else
+                strftime(str_time, sizeof(str_time), "%b %d %H:%M", &tm_info);
+        } else {
+            snprintf(str_time, sizeof(str_time), "Jan  1  1970");
+        }
+        len = snprintf(dest, destsize,
+                       "%srw-rw-rw-   1 root  root %9" PRIu64 " %s %s\r\n",
+                       de->is_dir ? "d" : "-", de->size, str_time, de->name);
+    }
+    if (len < 0 || (uint32_t)len >= destsize) {
+        return -1;
+    }
+    return len;
+}
 
-    char fullname[128];
-    int written = snprintf(fullname, sizeof(fullname), "%s%s%s%s",
-                           MOUNT_POINT,
-                           ftp_path,
-                           (ftp_path[strlen(ftp_path) - 1] != '/') ? "/" : "",
-                           de->d_name);
-    if (written >= (int)sizeof(fullname)) {
-        ESP_LOGW(FTP_TAG, "Path too long in get_eplf_item, truncated");
+// RFC 3659 facts of one entry as selected with OPTS MLST, each followed
+// by ';'. modify is in UTC, unlike the local times of LIST and MDTM.
+// Returns -1 if the facts do not fit in destsize.
+int Server::Session::get_mlst_facts(char* dest, uint32_t destsize, const storage_dirent_t* de) {
+    uint32_t len = 0;
+    if (destsize > 0) {
+        dest[0] = '\0';
+    }
+    for (uint8_t fact = 0; fact < FTP_FACT_COUNT; fact++) {
+        if (!(ftp_mlst_facts & (1 << fact))) {
+            continue;
+        }
+        int n = 0;
+        struct tm tm_info;
+        switch (fact) {
+            case FTP_FACT_TYPE:
+                n = snprintf(dest + len, destsize - len, "type=%s;", de->is_dir ? "dir" : "file");
+                break;
+            case FTP_FACT_SIZE:
+                if (de->is_dir) {
+                    continue;
+                }
+                n = snprintf(dest + len, destsize - len, "size=%" PRIu64 ";", de->size);
+                break;
+            case FTP_FACT_MODIFY:
+                if (gmtime_r(&de->mtime, &tm_info) == nullptr) {
+                    continue;
+                }
+                n = snprintf(dest + len, destsize - len, "modify=%04d%02d%02d%02d%02d%02d;",
+                             tm_info.tm_year + 1900, tm_info.tm_mon + 1, tm_info.tm_mday,
+                             tm_info.tm_hour, tm_info.tm_min, tm_info.tm_sec);
+                break;
+            case FTP_FACT_PERM:
+                // What this server lets the client do with the entry
+                n = snprintf(dest + len, destsize - len, "perm=%s;",
+                             de->is_dir ? "cdeflmp" : "adfrw");
+                break;
+        }
+        if (n < 0 || (uint32_t)n >= destsize - len) {
+            return -1;
+        }
+        len += n;
     }
+    return len;
+}
 
-    struct stat buf;
-    int res = stat(fullname, &buf);
-    if (res < 0) {
-        buf.st_size = 0;
-        buf.st_mtime = 946684800;
-    }
-
-    char str_time[64];
-    struct tm* tm_info;
-    time_t now;
-    if (time(&now) < 0) now = 946684800;
-    tm_info = localtime(&buf.st_mtime);
-
-    if (tm_info != nullptr) {
-    if ((buf.st_mtime + FTP_UNIX_SECONDS_180_DAYS) < now)
-        strftime(str_time, sizeof(str_time), "%b %d %Y", tm_info);
-    else
-        strftime(str_time, sizeof(str_time), "%b %d %H:%M", tm_info);
-    } else {
-        snprintf(str_time, sizeof(str_time), "Jan  1  1970");
-    }
-
-    int addsize = *destsize + 64;
-
-    while (addsize >= *destsize) {
-        if (ftp_nlist)
-            addsize = snprintf(*dest, *destsize, "%s\r\n", de->d_name);
-        else
-            addsize =
-                snprintf(*dest, *destsize,
-                         "%srw-rw-rw-   1 root  root %9" PRIu32 " %s %s\r\n",
-                         type, (uint32_t)buf.st_size, str_time, de->d_name);
-
-        if (addsize >= *destsize) {
-            ESP_LOGW(FTP_TAG,
-                     "Buffer too small, reallocating [%d > %" PRIi32 "]",
-                     ftp_buff_size, ftp_buff_size + (addsize - *destsize) + 64);
-            char* new_dest =
-                (char*)realloc(*dest, ftp_buff_size + (addsize - *destsize) + 65);
-            if (new_dest) {
-                ftp_buff_size += (addsize - *destsize) + 64;
-                *destsize += (addsize - *destsize) + 64;
-                *dest = new_dest;
-                addsize = *destsize + 64;
-            } else {
-                ESP_LOGE(FTP_TAG, "Buffer reallocation ERROR");
-                addsize = 0;
-            }
+// Supported fact names for FEAT, with the selected ones marked '*', or
+// only the selected ones for the reply to OPTS MLST
+void Server::Session::get_mlst_fact_names(char* dest, size_t destsize, bool feat) {
+    size_t len = 0;
+    dest[0] = '\0';
+    for (uint8_t fact = 0; fact < FTP_FACT_COUNT && len < destsize; fact++) {
+        bool selected = ftp_mlst_facts & (1 << fact);
+        if (selected || feat) {
+            len += snprintf(dest + len, destsize - len, "%s%s;",
+                            FTP_FACT_NAMES[fact], (selected && feat) ? "*" : "");
+        }
+    }
+}
+
+// Supported algorithms for FEAT, with the selected one marked '*'
+void Server::Session::get_hash_names(char* dest, size_t destsize) {
+    size_t len = 0;
+    dest[0] = '\0';
+    for (uint8_t algo = 0; algo < Hasher::E_HASH_COUNT && len < destsize; algo++) {
+        len += snprintf(dest + len, destsize - len, "%c%s%s", (algo == 0) ? ' ' : ';',
+                        Hasher::name((Hasher::algo_t)algo), (algo == ftp_hash_algo) ? "*" : "");
+    }
+}
+
+// Next entry of the open listing, from the cache on a hit, otherwise from
+// the directory itself while recording it for the next LIST
+bool Server::Session::next_dir_entry(storage_dirent_t* de) {
+    if (ftp_data.list_cached) {
+        return server->ftp_list_cache.next(&ftp_data.list_cursor, de);
+    }
+    // NLST only prints names, so skip decoding size and date unless the
+    // entry is going into the cache or index
+    bool with_meta = (ftp_list_format != E_FTP_LIST_NAMES) || ftp_data.list_fill ||
+                     ftp_data.index_build;
+    if (!storage_readdir(ftp_data.dp, de, with_meta)) {
+        if (ftp_data.list_fill) {
+            server->ftp_list_cache.end_fill(&ftp_data.list_cursor, true);
+            ftp_data.list_fill = false;
+        }
+        if (ftp_data.index_build) {
+            server->ftp_dir_index.end_build(ftp_data.index_slot, true);
+            ftp_data.index_build = false;
         }
+        return false;
+    }
+    if (ftp_data.list_fill && !server->ftp_list_cache.fill(&ftp_data.list_cursor, de)) {
+        ftp_data.list_fill = false;  // Too big to cache
     }
-    return addsize;
+    if (ftp_data.index_build) {
+        server->ftp_dir_index.add(ftp_data.index_slot, de);
+    }
+    return true;
 }
 
-Server::ftp_result_t Server::list_dir(char* list, uint32_t maxlistsize, uint32_t* listsize) {
+// Streams the open directory into a fixed window of maxlistsize bytes. An
+// entry that does not fit is kept and starts the next window, so the
+// window never grows and no entry is lost at a window boundary.
+Server::ftp_result_t Server::Session::list_dir(char* list, uint32_t maxlistsize, uint32_t* listsize) {
     uint32_t next = 0;
-    uint32_t listcount = 0;
     ftp_result_t result = E_FTP_RESULT_CONTINUE;
     if (ftp_data.listroot) {
         // Add virtual directories for mounted storage devices
@@ -363,19 +1144,27 @@ Server::ftp_result_t Server::list_dir(char* list, uint32_t maxlistsize, uint32_t
                                     list, maxlistsize, &next);
         result = E_FTP_RESULT_OK;
     } else {
-        struct dirent* de;
-        while (((maxlistsize - next) > 64) && (listcount < 8)) {
-            de = readdir(ftp_data.dp);
-            if (de == nullptr) {
-                result = E_FTP_RESULT_OK;
-                break;
+        storage_dirent_t& de = ftp_data.list_entry;
+        for (;;) {
+            if (!ftp_data.list_pending) {
+                if (!next_dir_entry(&de)) {
+                    result = E_FTP_RESULT_OK;
+                    break;
+                }
+                if (de.name[0] == '.' && de.name[1] == 0) continue;
+                if (de.name[0] == '.' && de.name[1] == '.' && de.name[2] == 0) continue;
+                ftp_data.list_pending = true;
+            }
+            int len = get_eplf_item(list + next, maxlistsize - next, &de);
+            if (len < 0) {
+                if (next > 0) {
+                    break;  // Window full, entry goes first in the next one
+                }
+                ESP_LOGW(FTP_TAG, "Listing entry too long, skipped: %s", de.name);
+            } else {
+                next += len;
             }
-            if (de->d_name[0] == '.' && de->d_name[1] == 0) continue;
-            if (de->d_name[0] == '.' && de->d_name[1] == '.' && de->d_name[2] == 0) continue;
-            char* list_ptr = list + next;
-            uint32_t remaining = maxlistsize - next;
-            next += get_eplf_item(&list_ptr, &remaining, de);
-            listcount++;
+            ftp_data.list_pending = false;
         }
     }
     if (result == E_FTP_RESULT_OK) {
@@ -386,7 +1175,7 @@ Server::ftp_result_t Server::list_dir(char* list, uint32_t maxlistsize, uint32_t
 }
 
 // Socket operations
-void Server::close_cmd_data() {
+void Server::Session::close_cmd_data() {
     closesocket(ftp_data.c_sd);
     closesocket(ftp_data.d_sd);
     ftp_data.c_sd = -1;
@@ -394,16 +1183,94 @@ void Server::close_cmd_data() {
     close_filesystem_on_error();
 }
 
-void Server::reset() {
-    ESP_LOGW(FTP_TAG, "FTP RESET");
-    closesocket(ftp_data.lc_sd);
-    closesocket(ftp_data.ld_sd);
-    ftp_data.lc_sd = -1;
-    ftp_data.ld_sd = -1;
+void Server::Session::reset() {
+    ESP_LOGW(FTP_TAG, "Session %u RESET", index);
+    release_listener();
     close_cmd_data();
     ftp_data.e_open = E_FTP_NOTHING_OPEN;
-    ftp_data.state = E_FTP_STE_START;
+    ftp_data.state = E_FTP_STE_READY;
     ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
+    ftp_data.list_control = false;
+    ftp_data.restart = 0;
+    ftp_data.range_set = false;
+    ftp_data.range_start = 0;
+    ftp_data.range_end = 0;
+    ftp_data.tx_len = 0;
+    ftp_reply_head = 0;
+    ftp_reply_len = 0;
+}
+
+void Server::reset() {
+    ESP_LOGW(FTP_TAG, "FTP RESET");
+    closesocket(lc_sd);
+    lc_sd = -1;
+    for (Session& session : ftp_sessions) {
+        session.reset();
+    }
+    close_passive_listeners();
+    ftp_state = E_FTP_STE_START;
+}
+
+// Binds the passive port range up front. A port that cannot be bound now
+// is retried when a session asks for it.
+void Server::open_passive_listeners() {
+    for (uint8_t i = 0; i < FTP_PASSIVE_PORTS; i++) {
+        if (ftp_pasv_sd[i] < 0 &&
+            !create_listening_socket(&ftp_pasv_sd[i], FTP_PASSIVE_PORT_BASE + i,
+                                     FTP_DATA_CLIENTS_MAX - 1)) {
+            ftp_pasv_sd[i] = -1;
+            ESP_LOGW(FTP_TAG, "Passive port %d unavailable", FTP_PASSIVE_PORT_BASE + i);
+        }
+    }
+}
+
+void Server::close_passive_listeners() {
+    for (uint8_t i = 0; i < FTP_PASSIVE_PORTS; i++) {
+        if (ftp_pasv_sd[i] >= 0) {
+            closesocket(ftp_pasv_sd[i]);
+            ftp_pasv_sd[i] = -1;
+        }
+        ftp_pasv_busy[i] = false;
+    }
+}
+
+// Drops connections queued on an idle listener, so a session never picks
+// up a late or foreign connection meant for the previous transfer
+void Server::drain_listener(int32_t sd) {
+    int32_t stray;
+    while ((stray = accept(sd, nullptr, nullptr)) >= 0) {
+        closesocket(stray);
+    }
+}
+
+int8_t Server::acquire_passive_listener() {
+    for (uint8_t n = 0; n < FTP_PASSIVE_PORTS; n++) {
+        uint8_t slot = (ftp_pasv_next + n) % FTP_PASSIVE_PORTS;
+        if (ftp_pasv_busy[slot]) {
+            continue;
+        }
+        if (ftp_pasv_sd[slot] < 0 &&
+            !create_listening_socket(&ftp_pasv_sd[slot], FTP_PASSIVE_PORT_BASE + slot,
+                                     FTP_DATA_CLIENTS_MAX - 1)) {
+            ftp_pasv_sd[slot] = -1;
+            continue;
+        }
+        drain_listener(ftp_pasv_sd[slot]);
+        ftp_pasv_busy[slot] = true;
+        ftp_pasv_next = (slot + 1) % FTP_PASSIVE_PORTS;
+        return slot;
+    }
+    return -1;
+}
+
+void Server::release_passive_listener(int8_t slot) {
+    if (slot < 0) {
+        return;
+    }
+    if (ftp_pasv_sd[slot] >= 0) {
+        drain_listener(ftp_pasv_sd[slot]);
+    }
+    ftp_pasv_busy[slot] = false;
 }
 
 bool Server::create_listening_socket(int32_t* sd, uint32_t port,
@@ -442,9 +1309,9 @@ bool Server::create_listening_socket(int32_t* sd, uint32_t port,
 }
 
 Server::ftp_result_t Server::wait_for_connection(int32_t l_sd, int32_t* n_sd,
-                                                 uint32_t* ip_addr) {
+                                                 uint32_t* ip_addr, bool nonblocking) {
     struct sockaddr_in sClientAddress;
-    socklen_t in_addrSize;
+    socklen_t in_addrSize = sizeof(sClientAddress);
 
     *n_sd = accept(l_sd, (struct sockaddr*)&sClientAddress,
                    (socklen_t*)&in_addrSize);
@@ -453,7 +1320,6 @@ Server::ftp_result_t Server::wait_for_connection(int32_t l_sd, int32_t* n_sd,
         if (errno == EAGAIN) {
             return E_FTP_RESULT_CONTINUE;
         }
-        reset();
         return E_FTP_RESULT_FAILED;
     }
 
@@ -472,123 +1338,301 @@ Server::ftp_result_t Server::wait_for_connection(int32_t l_sd, int32_t* n_sd,
     }
 
     uint32_t option = fcntl(_sd, F_GETFL, 0);
-    if (l_sd != ftp_data.ld_sd) option |= O_NONBLOCK;
+    if (nonblocking) option |= O_NONBLOCK;
     fcntl(_sd, F_SETFL, option);
 
     return E_FTP_RESULT_OK;
 }
 
 // Communication
-void Server::send_reply(uint32_t status, char* message) {
+void Server::Session::send_reply(uint32_t status, char* message) {
     if (!message) {
         message = (char*)"";
     }
-    snprintf((char*)ftp_cmd_buffer, 4, "%" PRIu32, status);
-    strcat((char*)ftp_cmd_buffer, " ");
-    strcat((char*)ftp_cmd_buffer, message);
-    strcat((char*)ftp_cmd_buffer, "\r\n");
+    if (ftp_data.c_sd < 0) {
+        return;
+    }
 
-    int32_t timeout = 200;
-    ftp_result_t result;
-    size_t size = strlen((char*)ftp_cmd_buffer);
+    if (ftp_reply_head > 0) {
+        memmove(ftp_reply_queue, ftp_reply_queue + ftp_reply_head, ftp_reply_len);
+        ftp_reply_head = 0;
+    }
+    uint32_t space = FTP_REPLY_QUEUE_SIZE - ftp_reply_len;
+    // A message starting with '-' is a multi-line reply that carries its
+    // own continuation lines and final "<status> " line
+    int len = snprintf(ftp_reply_queue + ftp_reply_len, space, "%" PRIu32 "%s%s\r\n",
+                       status, (message[0] == '-') ? "" : " ", message);
+    if (len < 0 || (uint32_t)len >= space) {
+        // The client has stopped reading its control connection
+        reset();
+        ESP_LOGW(FTP_TAG, "Reply queue overflow.");
+        return;
+    }
+    ftp_reply_len += len;
 
-    vTaskDelay(1);
+    if (status == 221) {
+        flush_replies();
+        closesocket(ftp_data.d_sd);
+        ftp_data.d_sd = -1;
+        release_listener();
+        closesocket(ftp_data.c_sd);
+        ftp_data.c_sd = -1;
+        ftp_reply_len = 0;
+        ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
+        close_filesystem_on_error();
+    }
+}
 
-    while (1) {
-        result = (ftp_result_t)send(ftp_data.c_sd, ftp_cmd_buffer, size, 0);
-        if (result == size) {
-            if (status == 221) {
-                closesocket(ftp_data.d_sd);
-                ftp_data.d_sd = -1;
-                closesocket(ftp_data.ld_sd);
-                ftp_data.ld_sd = -1;
-                closesocket(ftp_data.c_sd);
-                ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
-                close_filesystem_on_error();
-            } else if (status == 426 || status == 451 || status == 550) {
-                closesocket(ftp_data.d_sd);
-                ftp_data.d_sd = -1;
-                close_filesystem_on_error();
-            }
-            vTaskDelay(1);
-            break;
+// Sends as much of the reply queue as the control socket accepts. Called
+// once per step so consecutive replies share a segment.
+Server::ftp_result_t Server::Session::flush_replies() {
+    while (ftp_reply_len > 0) {
+        int32_t sent = send(ftp_data.c_sd, ftp_reply_queue + ftp_reply_head,
+                            ftp_reply_len, 0);
+        if (sent > 0) {
+            ftp_reply_head += sent;
+            ftp_reply_len -= sent;
+        } else if (sent < 0 && errno == EAGAIN) {
+            return E_FTP_RESULT_CONTINUE;
         } else {
-            vTaskDelay(1);
-            if ((timeout <= 0) || (errno != EAGAIN)) {
-                reset();
-                ESP_LOGW(FTP_TAG, "Error sending command reply.");
-                break;
-            }
+            reset();
+            ESP_LOGW(FTP_TAG, "Error sending command reply.");
+            return E_FTP_RESULT_FAILED;
         }
-        timeout -= portTICK_PERIOD_MS;
     }
+    ftp_reply_head = 0;
+    return E_FTP_RESULT_OK;
 }
 
-void Server::send_list(uint32_t datasize) {
-    int32_t timeout = 200;
-    ftp_result_t result;
+// Queues the next piece of a transfer. File data in TYPE A or MODE Z is
+// only taken by send_pending_data() as it makes room, through encode_data().
+void Server::Session::queue_data(const uint8_t* data, uint32_t len, bool last) {
+    ftp_data.z_in_len = 0;
+    ftp_data.z_last = false;
+    ftp_data.src_len = 0;
+    ftp_data.tx_len = 0;
+    ftp_data.tx_sent = 0;
+    if (!ftp_data.list_control) {
+        // Listings are generated with CRLF already
+        if (ftp_data.ascii && ftp_data.state == E_FTP_STE_CONTINUE_FILE_TX && len > 0) {
+            ftp_data.src = data;
+            ftp_data.src_len = len;
+            ftp_data.src_last = last;
+            return;
+        }
+        if (ftp_data.mode == E_FTP_MODE_DEFLATE) {
+            ftp_data.z_in = data;
+            ftp_data.z_in_len = len;
+            ftp_data.z_last = last;
+            return;
+        }
+    }
+    queue_tx(data, len, last);
+}
 
-    vTaskDelay(1);
+// Queues data to go out as it is. In block mode it is sent as one block,
+// and last marks it as the end of the file.
+void Server::Session::queue_tx(const uint8_t* data, uint32_t len, bool last) {
+    ftp_data.tx_header_len = 0;
+    if (ftp_data.mode == E_FTP_MODE_BLOCK && !ftp_data.list_control) {
+        ftp_data.tx_header[0] = last ? FTP_BLOCK_EOF : 0;
+        ftp_data.tx_header[1] = (uint8_t)(len >> 8);
+        ftp_data.tx_header[2] = (uint8_t)len;
+        ftp_data.tx_header_len = FTP_BLOCK_HEADER_SIZE;
+    }
+    ftp_data.tx_data = data;
+    ftp_data.tx_len = ftp_data.tx_header_len + len;
+    ftp_data.tx_sent = 0;
+}
 
-    while (1) {
-        result =
-            (ftp_result_t)send(ftp_data.d_sd, ftp_data.dBuffer, datasize, 0);
-        if (result == datasize) {
-            vTaskDelay(1);
-            ESP_LOGI(FTP_TAG, "Send OK");
-            break;
-        } else {
-            vTaskDelay(1);
-            if ((timeout <= 0) || (errno != EAGAIN)) {
-                reset();
-                ESP_LOGW(FTP_TAG, "Error sending list data.");
-                break;
+// Resumes the pending data-channel write. A short send() just leaves the
+// rest queued; only a hard socket error or FTP_DATA_TIMEOUT_MS without any
+// progress fails the transfer.
+Server::ftp_result_t Server::Session::send_pending_data() {
+    int32_t sd = ftp_data.list_control ? ftp_data.c_sd : ftp_data.d_sd;
+    for (;;) {
+        if (ftp_data.tx_sent >= ftp_data.tx_len) {
+            ftp_data.tx_len = 0;
+            ftp_data.tx_sent = 0;
+            if (ftp_data.list_control) {
+                return E_FTP_RESULT_OK;
+            }
+            ftp_result_t result = encode_data();
+            if (result != E_FTP_RESULT_CONTINUE) {
+                return result;
             }
         }
-        timeout -= portTICK_PERIOD_MS;
+        int32_t sent;
+        if (ftp_data.tx_sent < ftp_data.tx_header_len) {
+            // The block follows right away, so let it share the segment
+            sent = send(sd, ftp_data.tx_header + ftp_data.tx_sent,
+                        ftp_data.tx_header_len - ftp_data.tx_sent, MSG_MORE);
+        } else {
+            sent = send(sd, ftp_data.tx_data + (ftp_data.tx_sent - ftp_data.tx_header_len),
+                        ftp_data.tx_len - ftp_data.tx_sent, 0);
+        }
+        if (sent > 0) {
+            ftp_data.tx_sent += sent;
+            ftp_data.dtimeout = 0;
+        } else if (sent < 0 && errno == EAGAIN &&
+                   ftp_data.dtimeout <= FTP_DATA_TIMEOUT_MS) {
+            return E_FTP_RESULT_CONTINUE;
+        } else {
+            ESP_LOGW(FTP_TAG, "Error sending data.");
+            return E_FTP_RESULT_FAILED;
+        }
     }
 }
 
-void Server::send_file_data(uint32_t datasize) {
-    ftp_result_t result;
-    uint32_t timeout = 200;
-
-    vTaskDelay(1);
-
-    while (1) {
-        result =
-            (ftp_result_t)send(ftp_data.d_sd, ftp_data.dBuffer, datasize, 0);
-        if (result == datasize) {
-            vTaskDelay(1);
-            ESP_LOGI(FTP_TAG, "Send OK");
-            break;
-        } else {
-            vTaskDelay(1);
-            if ((timeout <= 0) || (errno != EAGAIN)) {
-                reset();
-                ESP_LOGW(FTP_TAG, "Error sending file data.");
-                break;
+// Converts and compresses the data queue_data() left pending until there
+// is output to send. Returns E_FTP_RESULT_CONTINUE with that output queued,
+// or E_FTP_RESULT_OK once all input is consumed (and the MODE Z stream
+// finished after the last piece).
+Server::ftp_result_t Server::Session::encode_data() {
+    for (;;) {
+        if (ftp_data.mode == E_FTP_MODE_DEFLATE && !ftp_deflater.finished() &&
+            (ftp_data.z_in_len > 0 || ftp_data.z_last)) {
+            size_t in_len = ftp_data.z_in_len;
+            size_t out_len;
+            const uint8_t* out = ftp_deflater.compress(ftp_data.z_in, &in_len,
+                                                       ftp_data.z_last, &out_len);
+            if (out == nullptr) {
+                return E_FTP_RESULT_FAILED;
+            }
+            ftp_data.z_in += in_len;
+            ftp_data.z_in_len -= in_len;
+            if (out_len > 0) {
+                ftp_data.tx_header_len = 0;
+                ftp_data.tx_data = out;
+                ftp_data.tx_len = out_len;
+                return E_FTP_RESULT_CONTINUE;
             }
+            continue;
+        }
+        if (ftp_data.src_len == 0) {
+            return E_FTP_RESULT_OK;
+        }
+        // TYPE A: expand the next piece, which at most doubles it
+        uint32_t len = MIN(ftp_data.src_len, (uint32_t)FTP_ASCII_BUFFER_SIZE / 2);
+        uint32_t out_len = ascii_encode(ftp_ascii_buffer, ftp_data.src, len, &ftp_data.ascii_cr);
+        ftp_data.src += len;
+        ftp_data.src_len -= len;
+        bool last = ftp_data.src_last && ftp_data.src_len == 0;
+        if (ftp_data.mode != E_FTP_MODE_DEFLATE) {
+            queue_tx(ftp_ascii_buffer, out_len, last);
+            return E_FTP_RESULT_CONTINUE;
         }
-        timeout -= portTICK_PERIOD_MS;
+        ftp_data.z_in = ftp_ascii_buffer;
+        ftp_data.z_in_len = out_len;
+        ftp_data.z_last = last;
+    }
+}
+
+// Prepares the MODE Z compressor for a download, or the decompressor for
+// an upload
+bool Server::Session::start_codec(bool upload) {
+    if (upload) {
+        return ftp_inflater.begin();
     }
+    return ftp_deflater.begin(CONFIG_FTP_DEFLATE_LEVEL);
 }
 
-Server::ftp_result_t Server::recv_non_blocking(int32_t sd, void* buff,
+void Server::Session::abort_transfer() {
+    ftp_data.tx_len = 0;
+    ftp_data.tx_sent = 0;
+    close_files_dir();
+    transfer_reply(426);
+    ftp_data.state = E_FTP_STE_END_TRANSFER;
+}
+
+Server::ftp_result_t Server::Session::recv_non_blocking(int32_t sd, void* buff,
                                                int32_t Maxlen, int32_t* rxLen) {
     if (sd < 0) return E_FTP_RESULT_FAILED;
 
-    *rxLen = recv(sd, buff, Maxlen, 0);
+    *rxLen = recv(sd, buff, Maxlen, MSG_DONTWAIT);
     if (*rxLen > 0)
         return E_FTP_RESULT_OK;
-    else if (errno != EAGAIN)
+    else if (*rxLen == 0 || errno != EAGAIN)
         return E_FTP_RESULT_FAILED;
 
     return E_FTP_RESULT_CONTINUE;
 }
 
+// Receives file data from the data connection. In block mode the block
+// headers are stripped and nothing is read past the EOF block, since the
+// connection stays open for the next transfer. In MODE Z the data is
+// decompressed and ends with the zlib stream. Like recv_non_blocking(),
+// E_FTP_RESULT_FAILED ends the file; rx_complete() tells whether it was
+// complete.
+Server::ftp_result_t Server::Session::recv_data(uint8_t* buff, uint32_t maxlen, int32_t* len) {
+    if (ftp_data.mode == E_FTP_MODE_DEFLATE) {
+        for (;;) {
+            size_t got;
+            if (ftp_inflater.read(buff, maxlen, &got) != Inflater::E_INFLATE_OK) {
+                return E_FTP_RESULT_FAILED;
+            }
+            if (got > 0) {
+                *len = got;
+                return E_FTP_RESULT_OK;
+            }
+            if (ftp_inflater.finished()) {
+                return E_FTP_RESULT_FAILED;
+            }
+            size_t space;
+            uint8_t* in = ftp_inflater.input(&space);
+            ftp_result_t result = recv_non_blocking(ftp_data.d_sd, in, space, len);
+            if (result != E_FTP_RESULT_OK) {
+                return result;
+            }
+            ftp_inflater.received(*len);
+        }
+    }
+    if (ftp_data.mode != E_FTP_MODE_BLOCK) {
+        return recv_non_blocking(ftp_data.d_sd, buff, maxlen, len);
+    }
+    while (ftp_data.rx_left == 0) {
+        if (ftp_data.rx_desc & FTP_BLOCK_EOF) {
+            return E_FTP_RESULT_FAILED;
+        }
+        int32_t got;
+        ftp_result_t result = recv_non_blocking(ftp_data.d_sd,
+                                                ftp_data.rx_header + ftp_data.rx_header_len,
+                                                FTP_BLOCK_HEADER_SIZE - ftp_data.rx_header_len,
+                                                &got);
+        if (result != E_FTP_RESULT_OK) {
+            return result;
+        }
+        ftp_data.rx_header_len += got;
+        if (ftp_data.rx_header_len < FTP_BLOCK_HEADER_SIZE) {
+            return E_FTP_RESULT_CONTINUE;
+        }
+        ftp_data.rx_header_len = 0;
+        ftp_data.rx_desc = ftp_data.rx_header[0];
+        ftp_data.rx_left = (ftp_data.rx_header[1] << 8) | ftp_data.rx_header[2];
+    }
+    ftp_result_t result = recv_non_blocking(ftp_data.d_sd, buff,
+                                            MIN(maxlen, (uint32_t)ftp_data.rx_left), len);
+    if (result == E_FTP_RESULT_OK) {
+        ftp_data.rx_left -= *len;
+        if (ftp_data.rx_desc & FTP_BLOCK_RESTART) {
+            return E_FTP_RESULT_CONTINUE;  // Restart marker, not file data
+        }
+    }
+    return result;
+}
+
+// Whether the upload that just ended was received in full. Stream mode
+// cannot tell a dropped connection from the end of the file.
+bool Server::Session::rx_complete() const {
+    if (ftp_data.mode == E_FTP_MODE_DEFLATE) {
+        return ftp_inflater.finished();
+    }
+    return ftp_data.mode != E_FTP_MODE_BLOCK ||
+           (ftp_data.rx_left == 0 && (ftp_data.rx_desc & FTP_BLOCK_EOF));
+}
+
 // Path operations
-void Server::open_child(char* pwd, char* dir) {
+void Server::Session::open_child(char* pwd, char* dir) {
     ESP_LOGD(FTP_TAG, "open_child: [%s] + [%s]", pwd, dir);
     if (strlen(dir) > 0) {
         if (dir[0] == '/') {
@@ -612,8 +1656,8 @@ void Server::open_child(char* pwd, char* dir) {
     ESP_LOGD(FTP_TAG, "open_child, New pwd: %s", pwd);
 }
 
-void Server::close_child(char* pwd) {
-    ESP_LOGD(FTP_TAG, "close_child: [%s] (len=%d)", pwd, strlen(pwd));
+void Server::Session::close_child(char* pwd) {
+    ESP_LOGD(FTP_TAG, "close_child: [%s] (len=%zu)", pwd, strlen(pwd));
 
     // Remove last path component
     uint len = strlen(pwd);
@@ -646,17 +1690,8 @@ void Server::close_child(char* pwd) {
     ESP_LOGD(FTP_TAG, "close_child, New pwd: %s", pwd);
 }
 
-void Server::remove_fname_from_path(char* pwd, char* fname) {
-    ESP_LOGD(FTP_TAG, "remove_fname_from_path: %s - %s", pwd, fname);
-    if (strlen(fname) == 0) return;
-    char* xpwd = strstr(pwd, fname);
-    if (xpwd == nullptr) return;
-    xpwd[0] = '\0';
-    ESP_LOGD(FTP_TAG, "remove_fname_from_path: New pwd: %s", pwd);
-}
-
 // Command parsing
-void Server::pop_param(char** str, char* param, size_t maxlen,
+void Server::Session::pop_param(char** str, char* param, size_t maxlen,
                        bool stop_on_space, bool stop_on_newline) {
     char lastc = '\0';
     size_t copied = 0;
@@ -707,454 +1742,877 @@ void Server::pop_param(char** str, char* param, size_t maxlen,
     }
 }
 
-Server::ftp_cmd_index_t Server::pop_command(char** str) {
-    char _cmd[FTP_CMD_SIZE_MAX];
-    pop_param(str, _cmd, FTP_CMD_SIZE_MAX, true, true);
-    stoupper(_cmd);
-    for (ftp_cmd_index_t i = (ftp_cmd_index_t)0; i < E_FTP_NUM_FTP_CMDS;
-         i = (ftp_cmd_index_t)(i + 1)) {
-        if (!strcmp(_cmd, ftp_cmd_table[i].cmd)) {
-            (*str)++;
-            return i;
+// Packs the verb at *str into its registry key and looks it up. Returns
+// nullptr for unknown verbs; *str is left on the argument either way.
+const Server::Session::ftp_cmd_t* Server::Session::pop_command(char** str) {
+    uint64_t key = 0;
+    uint32_t len = 0;
+
+    while (**str == ' ') (*str)++;
+    while (**str != '\0' && **str != ' ' && **str != '\r' && **str != '\n') {
+        if (len < FTP_CMD_KEY_LEN) {
+            key |= (uint64_t)(uint8_t)toupper((int)**str) << (8 * len);
+        }
+        len++;
+        (*str)++;
+    }
+    if (**str != '\0') {
+        (*str)++;
+    }
+    if (len == 0 || len > FTP_CMD_KEY_LEN) {
+        return nullptr;
+    }
+    for (uint32_t i = ftp_cmd_hash(key);; i = (i + 1) & (FTP_CMD_LOOKUP_SIZE - 1)) {
+        uint8_t entry = ftp_cmd_lookup.slot[i];
+        if (entry == FTP_CMD_LOOKUP_EMPTY) {
+            return nullptr;
+        }
+        if (ftp_cmd_table[entry].key == key) {
+            return &ftp_cmd_table[entry];
         }
     }
-    return E_FTP_CMD_NOT_SUPPORTED;
 }
 
-void Server::get_param_and_open_child(char** bufptr) {
+// The working directory is saved rather than trimmed afterwards, since an
+// absolute argument replaces ftp_path instead of extending it
+void Server::Session::get_param_and_open_child(char** bufptr) {
     pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, false, false);
+    strcpy(ftp_saved_path, ftp_path);
     open_child(ftp_path, ftp_scratch_buffer);
     ftp_data.closechild = true;
 }
 
-// Main command processing
-void Server::process_cmd() {
-    int32_t len;
-    char* bufptr = (char*)ftp_cmd_buffer;
-    ftp_result_t result;
-    struct stat buf;
-    int res;
+// Command handlers. Commands flagged FTP_CMD_PATH_ARG find their argument
+// already appended to ftp_path; it is removed again after the handler.
+void Server::Session::cmd_feat(char** bufptr) {
+    char features[256];
+    size_t len = snprintf(features, sizeof(features), "-Features:\r\n");
+    for (const ftp_cmd_t& cmd : ftp_cmd_table) {
+        if (cmd.feat && len < sizeof(features)) {
+            char facts[64] = "";
+            if (cmd.key == ftp_cmd_key("MLST")) {
+                facts[0] = ' ';
+                get_mlst_fact_names(facts + 1, sizeof(facts) - 1, true);
+            } else if (cmd.key == ftp_cmd_key("HASH")) {
+                get_hash_names(facts, sizeof(facts));
+            }
+            len += snprintf(features + len, sizeof(features) - len, " %s%s\r\n",
+                            cmd.feat, facts);
+        }
+    }
+    if (len < sizeof(features)) {
+        snprintf(features + len, sizeof(features) - len, "211 End");
+    }
+    send_reply(211, features);
+}
 
-    memset(bufptr, 0, FTP_MAX_PARAM_SIZE + FTP_CMD_SIZE_MAX);
-    ftp_data.closechild = false;
+void Server::Session::cmd_opts(char** bufptr) {
+    pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+#ifdef CONFIG_FATFS_API_ENCODING_UTF_8
+    if (strcasecmp(ftp_scratch_buffer, "UTF8") == 0) {
+        // Names are always UTF-8, so the mode can't be switched off
+        pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+        if (ftp_scratch_buffer[0] == '\0' || strcasecmp(ftp_scratch_buffer, "ON") == 0) {
+            send_reply(200, (char*)"UTF8 mode enabled");
+        } else {
+            send_reply(504, (char*)"UTF8 mode can't be disabled");
+        }
+        return;
+    }
+#endif
+    if (strcasecmp(ftp_scratch_buffer, "MLST") == 0) {
+        // Unknown facts are ignored and an empty list selects none
+        pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+        uint8_t facts = 0;
+        char* save = nullptr;
+        for (char* name = strtok_r(ftp_scratch_buffer, ";", &save); name != nullptr;
+             name = strtok_r(nullptr, ";", &save)) {
+            for (uint8_t fact = 0; fact < FTP_FACT_COUNT; fact++) {
+                if (strcasecmp(name, FTP_FACT_NAMES[fact]) == 0) {
+                    facts |= (1 << fact);
+                }
+            }
+        }
+        ftp_mlst_facts = facts;
+        char names[64];
+        get_mlst_fact_names(names, sizeof(names), false);
+        snprintf((char*)ftp_data.dBuffer, ftp_buff_size, "MLST OPTS %s", names);
+        send_reply(200, (char*)ftp_data.dBuffer);
+        return;
+    }
+    if (strcasecmp(ftp_scratch_buffer, "HASH") == 0) {
+        // Without an algorithm, reports the selected one
+        pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+        Hasher::algo_t algo;
+        if (ftp_scratch_buffer[0] != '\0') {
+            if (!Hasher::parse(ftp_scratch_buffer, &algo)) {
+                send_reply(501, (char*)"Unknown algorithm");
+                return;
+            }
+            ftp_hash_algo = algo;
+        }
+        send_reply(200, (char*)Hasher::name((Hasher::algo_t)ftp_hash_algo));
+        return;
+    }
+    send_reply(501, (char*)"Option not understood");
+}
 
-    result = recv_non_blocking(ftp_data.c_sd, ftp_cmd_buffer,
-                               FTP_MAX_PARAM_SIZE + FTP_CMD_SIZE_MAX, &len);
-    if (result == E_FTP_RESULT_FAILED) {
-        ESP_LOGI(FTP_TAG, "Client disconnected");
-        close_cmd_data();
-        ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
+void Server::Session::cmd_auth(char** bufptr) {
+    send_reply(504, (char*)"not-supported");
+}
+
+void Server::Session::cmd_syst(char** bufptr) {
+    send_reply(215, (char*)"UNIX Type: L8");
+}
+
+void Server::Session::cmd_cdup(char** bufptr) {
+    ESP_LOGI(FTP_TAG, "CDUP from %s", ftp_path);
+    close_child(ftp_path);
+    ESP_LOGI(FTP_TAG, "CDUP to %s", ftp_path);
+    send_reply(250, nullptr);
+}
+
+void Server::Session::cmd_cwd(char** bufptr) {
+    pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE,
+              false, true);  // Don't stop on space, DO stop on newline
+    if (strlen(ftp_scratch_buffer) > 0) {
+        if ((ftp_scratch_buffer[0] == '.') &&
+            (ftp_scratch_buffer[1] == '\0')) {
+            ftp_data.dp = nullptr;
+            send_reply(250, nullptr);
+            return;
+        }
+        if ((ftp_scratch_buffer[0] == '.') &&
+            (ftp_scratch_buffer[1] == '.') &&
+            (ftp_scratch_buffer[2] == '\0')) {
+            close_child(ftp_path);
+            send_reply(250, nullptr);
+            return;
+        } else {
+            open_child(ftp_path, ftp_scratch_buffer);
+        }
+    }
+    if ((ftp_path[0] == '/') && (ftp_path[1] == '\0')) {
+        ftp_data.dp = nullptr;
+        send_reply(250, nullptr);
+    } else {
+        char fullname[128];
+        get_full_path(fullname, sizeof(fullname), ftp_path);
+        ESP_LOGI(FTP_TAG, "E_FTP_CMD_CWD fullname=[%s]", fullname);
+        DIR* dir = opendir(fullname);
+        if (dir != nullptr) {
+            closedir(dir);
+            ESP_LOGI(FTP_TAG, "Changed directory to: %s", ftp_path);
+            send_reply(250, nullptr);
+        } else {
+            close_child(ftp_path);
+            send_reply(550, nullptr);
+        }
+    }
+}
+
+void Server::Session::cmd_pwd(char** bufptr) {
+    char lpath[256];
+    // RFC 959 requires quoted path: 257 "pathname" is current directory
+    snprintf(lpath, sizeof(lpath), "\"%s\"", ftp_path);
+    send_reply(257, lpath);
+}
+
+void Server::Session::cmd_size(char** bufptr) {
+    char fullname[128];
+    fs_stat_t st;
+    get_full_path(fullname, sizeof(fullname), ftp_path);
+    ESP_LOGI(FTP_TAG, "E_FTP_CMD_SIZE fullname=[%s]", fullname);
+    if (stat_cached(fullname, &st)) {
+        snprintf((char*)ftp_data.dBuffer, ftp_buff_size, "%" PRIu64, st.size);
+        send_reply(213, (char*)ftp_data.dBuffer);
+    } else {
+        send_reply(550, nullptr);
+    }
+}
+
+void Server::Session::cmd_mdtm(char** bufptr) {
+    char fullname[128];
+    fs_stat_t st;
+    get_full_path(fullname, sizeof(fullname), ftp_path);
+    ESP_LOGI(FTP_TAG, "E_FTP_CMD_MDTM fullname=[%s]", fullname);
+    if (stat_cached(fullname, &st)) {
+        time_t time = st.mtime;
+        struct tm* ptm = localtime(&time);
+        strftime((char*)ftp_data.dBuffer, ftp_buff_size, "%Y%m%d%H%M%S", ptm);
+        ESP_LOGI(FTP_TAG, "E_FTP_CMD_MDTM ftp_data.dBuffer=[%s]",
+                 ftp_data.dBuffer);
+        send_reply(213, (char*)ftp_data.dBuffer);
+    } else {
+        send_reply(550, nullptr);
+    }
+}
+
+void Server::Session::cmd_type(char** bufptr) {
+    pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+    if (strcasecmp(ftp_scratch_buffer, "A") == 0) {
+        pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+        if (ftp_scratch_buffer[0] != '\0' && strcasecmp(ftp_scratch_buffer, "N") != 0) {
+            send_reply(504, (char*)"Only non-print format is supported");  // No Telnet or ASA carriage control
+            return;
+        }
+        ftp_data.ascii = true;
+    } else if (strcasecmp(ftp_scratch_buffer, "I") == 0) {
+        ftp_data.ascii = false;
+    } else if (strcasecmp(ftp_scratch_buffer, "L") == 0) {
+        pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+        if (strcmp(ftp_scratch_buffer, "8") != 0) {
+            send_reply(504, (char*)"Only 8-bit bytes are supported");
+            return;
+        }
+        ftp_data.ascii = false;
+    } else {
+        send_reply(504, (char*)"Unsupported type");
         return;
     }
-    if (result == E_FTP_RESULT_OK) {
-        ftp_cmd_buffer[len] = '\0';
-        ftp_cmd_index_t cmd = pop_command(&bufptr);
-        if (!ftp_data.loggin.passvalid &&
-            ((cmd != E_FTP_CMD_USER) && (cmd != E_FTP_CMD_PASS) &&
-             (cmd != E_FTP_CMD_QUIT) && (cmd != E_FTP_CMD_FEAT) &&
-             (cmd != E_FTP_CMD_AUTH))) {
-            send_reply(332, nullptr);
+    send_reply(200, nullptr);
+}
+
+void Server::Session::cmd_mode(char** bufptr) {
+    pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+    if (strcasecmp(ftp_scratch_buffer, "S") == 0) {
+        ftp_data.mode = E_FTP_MODE_STREAM;
+    } else if (strcasecmp(ftp_scratch_buffer, "B") == 0) {
+        ftp_data.mode = E_FTP_MODE_BLOCK;
+    } else if (strcasecmp(ftp_scratch_buffer, "Z") == 0) {
+        ftp_data.mode = E_FTP_MODE_DEFLATE;
+    } else {
+        send_reply(504, (char*)"Unsupported transfer mode");
+        return;
+    }
+    if (ftp_data.mode != E_FTP_MODE_DEFLATE) {
+        // The codec state is large, so it is only kept while MODE Z is in use
+        ftp_deflater.release();
+        ftp_inflater.release();
+    }
+    send_reply(200, nullptr);
+}
+
+void Server::Session::cmd_user(char** bufptr) {
+    pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+    size_t user_len = strlen(server->ftp_user);
+    size_t input_len = strlen(ftp_scratch_buffer);
+    if (user_len == input_len && user_len > 0 &&
+        secure_compare(ftp_scratch_buffer, server->ftp_user, user_len)) {
+        ftp_data.loggin.uservalid = true;
+    }
+    send_reply(331, nullptr);
+}
+
+void Server::Session::cmd_pass(char** bufptr) {
+    pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+    size_t pass_len = strlen(server->ftp_pass);
+    size_t input_len = strlen(ftp_scratch_buffer);
+    if (ftp_data.loggin.uservalid && pass_len == input_len &&
+        secure_compare(ftp_scratch_buffer, server->ftp_pass, pass_len)) {
+        ftp_data.loggin.passvalid = true;
+        send_reply(230, nullptr);
+        ESP_LOGW(FTP_TAG, "Connected.");
+        return;
+    }
+    send_reply(530, nullptr);
+}
+
+void Server::Session::cmd_pasv(char** bufptr) {
+    if (ftp_data.epsv_all) {
+        send_reply(503, (char*)"PASV not allowed after EPSV ALL");
+        return;
+    }
+    if (open_passive()) {
+        uint8_t* pip = (uint8_t*)&ftp_data.ip_addr;
+        uint32_t port = FTP_PASSIVE_PORT_BASE + ftp_data.pasv_slot;
+        snprintf((char*)ftp_data.dBuffer, ftp_buff_size,
+                 "(%u,%u,%u,%u,%u,%u)", pip[0], pip[1], pip[2], pip[3],
+                 (unsigned)(port >> 8), (unsigned)(port & 0xFF));
+        ESP_LOGI(FTP_TAG, "Data socket created");
+        send_reply(227, (char*)ftp_data.dBuffer);
+    } else {
+        ESP_LOGW(FTP_TAG, "Error creating data socket");
+        send_reply(425, nullptr);
+    }
+}
+
+// RFC 2428 extended passive mode: only the port is returned, the client
+// reuses the control connection's address
+void Server::Session::cmd_epsv(char** bufptr) {
+    pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+    if (strcasecmp(ftp_scratch_buffer, "ALL") == 0) {
+        // RFC 2428: the client won't use PASV or PORT again, and the
+        // server refuses them
+        ftp_data.epsv_all = true;
+        send_reply(200, (char*)"EPSV ALL ok");
+        return;
+    }
+    if (ftp_scratch_buffer[0] != '\0' && strcmp(ftp_scratch_buffer, "1") != 0) {
+        send_reply(522, (char*)"Network protocol not supported, use (1)");
+        return;
+    }
+    if (open_passive()) {
+        snprintf((char*)ftp_data.dBuffer, ftp_buff_size,
+                 "Entering Extended Passive Mode (|||%u|)",
+                 (unsigned)(FTP_PASSIVE_PORT_BASE + ftp_data.pasv_slot));
+        send_reply(229, (char*)ftp_data.dBuffer);
+    } else {
+        ESP_LOGW(FTP_TAG, "Error creating data socket");
+        send_reply(425, nullptr);
+    }
+}
+
+void Server::Session::start_listing(ftp_list_format_t format, bool control) {
+    ftp_list_format = format;
+    if (open_dir_for_listing(ftp_path) == E_FTP_RESULT_CONTINUE) {
+        ftp_data.listdone = false;
+        ftp_data.list_pending = false;
+        ftp_data.list_control = control;
+        ftp_data.tx_len = 0;
+        ftp_data.dtimeout = 0;
+        if (!control && ftp_data.mode == E_FTP_MODE_DEFLATE && !start_codec(false)) {
+            close_files_dir();
+            transfer_reply(451);
             return;
         }
-        if ((cmd >= 0) && (cmd < E_FTP_NUM_FTP_CMDS)) {
-            ESP_LOGI(FTP_TAG, "CMD: %s", ftp_cmd_table[cmd].cmd);
+        ftp_data.state = E_FTP_STE_CONTINUE_LISTING;
+        if (control) {
+            send_reply(213, (char*)"-Status follows:");
+        } else {
+            send_reply(150, nullptr);
+        }
+    } else {
+        send_reply(550, nullptr);
+    }
+}
+
+void Server::Session::cmd_list(char** bufptr) {
+    start_listing(E_FTP_LIST_UNIX, false);
+}
+
+void Server::Session::cmd_nlst(char** bufptr) {
+    start_listing(E_FTP_LIST_NAMES, false);
+}
+
+void Server::Session::cmd_mlsd(char** bufptr) {
+    start_listing(E_FTP_LIST_MLSD, false);
+}
+
+// Facts of a single file or directory, sent over the control connection
+void Server::Session::cmd_mlst(char** bufptr) {
+    char fullname[128];
+    fs_stat_t st;
+    get_full_path(fullname, sizeof(fullname), ftp_path);
+    ESP_LOGI(FTP_TAG, "E_FTP_CMD_MLST fullname=[%s]", fullname);
+    if (strcmp(ftp_path, "/") == 0) {
+        st = {0, 946684800, true};  // Virtual root of the storage devices
+    } else if (!stat_cached(fullname, &st)) {
+        // Mount points have no directory record to stat
+        DIR* dir = opendir(fullname);
+        if (dir == nullptr) {
+            send_reply(550, nullptr);
+            return;
+        }
+        closedir(dir);
+        st = {0, 946684800, true};
+    }
+    storage_dirent_t de = {ftp_path, st.size, st.mtime, st.is_dir};
+    char facts[96];
+    if (get_mlst_facts(facts, sizeof(facts), &de) < 0) {
+        send_reply(550, nullptr);
+        return;
+    }
+    snprintf((char*)ftp_data.dBuffer, ftp_buff_size, "-Listing\r\n %s %s\r\n250 End",
+             facts, ftp_path);
+    send_reply(250, (char*)ftp_data.dBuffer);
+}
+
+// With a RANG set, only that byte range of the file is sent, so segmented
+// downloaders can fetch disjoint parts over several sessions
+void Server::Session::cmd_retr(char** bufptr) {
+    ftp_data.total = 0;
+    ftp_data.time = 0;
+    bool ranged = ftp_data.range_set;
+    ftp_data.range_set = false;
+    if (ranged) {
+        ftp_data.restart = ftp_data.range_start;
+    }
+    if ((strlen(ftp_path) > 0) && (ftp_path[strlen(ftp_path) - 1] != '/')) {
+        if (open_transfer(ftp_path, "rb")) {
+            if (ranged) {
+                uint64_t span = ftp_data.range_end - ftp_data.range_start;
+                ftp_data.read_left = (span == UINT64_MAX) ? span : span + 1;
+                ftp_data.hash_whole = false;
+            }
+            server->log_to_screen("[<<] Download: %s", ftp_path);
+            start_readahead();
+            ftp_data.state = E_FTP_STE_CONTINUE_FILE_TX;
+            send_reply(150, nullptr);
+        } else {
+            ftp_data.state = E_FTP_STE_END_TRANSFER;
+            send_reply(550, nullptr);
+        }
+    } else {
+        ftp_data.state = E_FTP_STE_END_TRANSFER;
+        send_reply(550, nullptr);
+    }
+    ftp_data.restart = 0;
+}
+
+void Server::Session::cmd_appe(char** bufptr) {
+    ftp_data.total = 0;
+    ftp_data.time = 0;
+    if (ranged_upload()) {
+        return;
+    }
+    ftp_data.restart = 0;  // Appends always go to the end
+    if ((strlen(ftp_path) > 0) && (ftp_path[strlen(ftp_path) - 1] != '/')) {
+        if (open_transfer(ftp_path, "ab")) {
+            server->log_to_screen("[OK] Append: %s", ftp_path);
+            get_full_path(ftp_write_path, sizeof(ftp_write_path), ftp_path);
+            invalidate_cached(ftp_write_path, false);
+            if (ftp_spool) {
+                start_spool();
+            }
+            ftp_data.state = E_FTP_STE_CONTINUE_FILE_RX;
+            send_reply(150, nullptr);
         } else {
-            ESP_LOGI(FTP_TAG, "CMD: %d", cmd);
+            ftp_data.state = E_FTP_STE_END_TRANSFER;
+            send_reply(550, nullptr);
         }
+    } else {
+        ftp_data.state = E_FTP_STE_END_TRANSFER;
+        send_reply(550, nullptr);
+    }
+}
+
+// Ranged writes are not implemented: rather than silently storing the
+// whole file, an upload after RANG is refused and the range dropped
+bool Server::Session::ranged_upload() {
+    if (!ftp_data.range_set) {
+        return false;
+    }
+    ftp_data.range_set = false;
+    ftp_data.restart = 0;
+    ftp_data.state = E_FTP_STE_END_TRANSFER;
+    send_reply(504, (char*)"RANG is only supported for RETR and HASH");
+    return true;
+}
+
+void Server::Session::cmd_stor(char** bufptr) {
+    ftp_data.total = 0;
+    ftp_data.time = 0;
+    if (ranged_upload()) {
+        return;
+    }
+    if ((strlen(ftp_path) > 0) && (ftp_path[strlen(ftp_path) - 1] != '/')) {
+        ESP_LOGI(FTP_TAG, "E_FTP_CMD_STOR ftp_path=[%s]", ftp_path);
+        // A restarted upload overwrites the existing file from the offset on
+        bool restarted = ftp_data.restart > 0;
+        if (open_transfer(ftp_path, restarted ? "r+b" : "wb")) {
+            server->log_to_screen("[>>] Upload: %s", ftp_path);
+            get_full_path(ftp_write_path, sizeof(ftp_write_path), ftp_path);
+            invalidate_cached(ftp_write_path, false);
+            if (!restarted) {
+                index_changed(ftp_write_path);
+            }
+            if (ftp_spool) {
+                start_spool();
+            }
+            ftp_data.state = E_FTP_STE_CONTINUE_FILE_RX;
+            send_reply(150, nullptr);
+        } else {
+            ftp_data.state = E_FTP_STE_END_TRANSFER;
+            send_reply(550, nullptr);
+        }
+    } else {
+        ftp_data.state = E_FTP_STE_END_TRANSFER;
+        send_reply(550, nullptr);
+    }
+    ftp_data.restart = 0;
+}
+
+void Server::Session::cmd_dele(char** bufptr) {
+    if ((strlen(ftp_path) > 0) && (ftp_path[strlen(ftp_path) - 1] != '/')) {
+        ESP_LOGI(FTP_TAG, "E_FTP_CMD_DELE ftp_path=[%s]", ftp_path);
         char fullname[128];
-        char fullname2[128];
-        strcpy(fullname, MOUNT_POINT);
-        strcpy(fullname2, MOUNT_POINT);
+        get_full_path(fullname, sizeof(fullname), ftp_path);
+        ESP_LOGI(FTP_TAG, "E_FTP_CMD_DELE fullname=[%s]", fullname);
+        if (!known_missing(fullname) && unlink(fullname) == 0) {
+            invalidate_cached(fullname, false);
+            server->ftp_dir_index.remove(fullname);
+            ESP_LOGI(FTP_TAG, "File deleted: %s", ftp_path);
+            send_reply(250, nullptr);
+            server->log_to_screen("[OK] Deleted: %s", ftp_path);
+        } else
+            send_reply(550, nullptr);
+    } else
+        send_reply(250, nullptr);
+}
 
-        switch (cmd) {
-            case E_FTP_CMD_FEAT:
-                send_reply(502, (char*)"no-features");
-                break;
-            case E_FTP_CMD_AUTH:
-                send_reply(504, (char*)"not-supported");
-                break;
-            case E_FTP_CMD_SYST:
-                send_reply(215, (char*)"UNIX Type: L8");
-                break;
-            case E_FTP_CMD_CDUP:
-                ESP_LOGI(FTP_TAG, "CDUP from %s", ftp_path);
-                close_child(ftp_path);
-                ESP_LOGI(FTP_TAG, "CDUP to %s", ftp_path);
-                send_reply(250, nullptr);
-                break;
-            case E_FTP_CMD_CWD:
-                pop_param(&bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE,
-                          false, true);  // Don't stop on space, DO stop on newline
-                if (strlen(ftp_scratch_buffer) > 0) {
-                    if ((ftp_scratch_buffer[0] == '.') &&
-                        (ftp_scratch_buffer[1] == '\0')) {
-                        ftp_data.dp = nullptr;
-                        send_reply(250, nullptr);
-                        break;
-                    }
-                    if ((ftp_scratch_buffer[0] == '.') &&
-                        (ftp_scratch_buffer[1] == '.') &&
-                        (ftp_scratch_buffer[2] == '\0')) {
-                        close_child(ftp_path);
-                        send_reply(250, nullptr);
-                        break;
-                    } else {
-                        open_child(ftp_path, ftp_scratch_buffer);
-                    }
-                }
-                if ((ftp_path[0] == '/') && (ftp_path[1] == '\0')) {
-                    ftp_data.dp = nullptr;
-                    send_reply(250, nullptr);
-                } else {
-                    char actual_path[128];
-                    translate_path(actual_path, sizeof(actual_path), ftp_path);
-                    strcpy(fullname, MOUNT_POINT);
-                    strcat(fullname, actual_path);
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_CWD fullname=[%s]", fullname);
-                    ftp_data.dp = opendir(fullname);
-                    if (ftp_data.dp != nullptr) {
-                        closedir(ftp_data.dp);
-                        ftp_data.dp = nullptr;
-                        ESP_LOGI(FTP_TAG, "Changed directory to: %s", ftp_path);
-                        send_reply(250, nullptr);
-                    } else {
-                        close_child(ftp_path);
-                        send_reply(550, nullptr);
-                    }
-                }
-                break;
-            case E_FTP_CMD_PWD:
-            case E_FTP_CMD_XPWD: {
-                char lpath[256];
-                // RFC 959 requires quoted path: 257 "pathname" is current directory
-                snprintf(lpath, sizeof(lpath), "\"%s\"", ftp_path);
-                send_reply(257, lpath);
-            } break;
-            case E_FTP_CMD_SIZE: {
-                get_param_and_open_child(&bufptr);
-                char actual_path_size[128];
-                translate_path(actual_path_size, sizeof(actual_path_size), ftp_path);
-                snprintf(fullname, sizeof(fullname), "%s%s", MOUNT_POINT,
-                         actual_path_size);
-                ESP_LOGI(FTP_TAG, "E_FTP_CMD_SIZE fullname=[%s]", fullname);
-                int res = stat(fullname, &buf);
-                if (res == 0) {
-                    snprintf((char*)ftp_data.dBuffer, ftp_buff_size, "%" PRIu32,
-                             (uint32_t)buf.st_size);
-                    send_reply(213, (char*)ftp_data.dBuffer);
-                } else {
-                    send_reply(550, nullptr);
-                }
-            } break;
-            case E_FTP_CMD_MDTM:
-                get_param_and_open_child(&bufptr);
-                char actual_path_mdtm[128];
-                translate_path(actual_path_mdtm, sizeof(actual_path_mdtm), ftp_path);
-                snprintf(fullname, sizeof(fullname), "%s%s", MOUNT_POINT,
-                         actual_path_mdtm);
-                ESP_LOGI(FTP_TAG, "E_FTP_CMD_MDTM fullname=[%s]", fullname);
-                res = stat(fullname, &buf);
-                if (res == 0) {
-                    time_t time = buf.st_mtime;
-                    struct tm* ptm = localtime(&time);
-                    strftime((char*)ftp_data.dBuffer, ftp_buff_size,
-                             "%Y%m%d%H%M%S", ptm);
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_MDTM ftp_data.dBuffer=[%s]",
-                             ftp_data.dBuffer);
-                    send_reply(213, (char*)ftp_data.dBuffer);
-                } else {
-                    send_reply(550, nullptr);
-                }
-                break;
-            case E_FTP_CMD_TYPE:
-                send_reply(200, nullptr);
-                break;
-            case E_FTP_CMD_USER:
-                pop_param(&bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true,
-                          true);
-                {
-                    size_t user_len = strlen(ftp_user);
-                    size_t input_len = strlen(ftp_scratch_buffer);
-                    if (user_len == input_len && user_len > 0 &&
-                        secure_compare(ftp_scratch_buffer, ftp_user,
-                                       user_len)) {
-                        ftp_data.loggin.uservalid = true;
-                    }
-                }
-                send_reply(331, nullptr);
-                break;
-            case E_FTP_CMD_PASS:
-                pop_param(&bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true,
-                          true);
-                {
-                    size_t pass_len = strlen(ftp_pass);
-                    size_t input_len = strlen(ftp_scratch_buffer);
-                    if (ftp_data.loggin.uservalid && pass_len == input_len &&
-                        secure_compare(ftp_scratch_buffer, ftp_pass,
-                                       pass_len)) {
-                        ftp_data.loggin.passvalid = true;
-                        if (ftp_data.loggin.passvalid) {
-                            send_reply(230, nullptr);
-                            ESP_LOGW(FTP_TAG, "Connected.");
-                            break;
-                        }
-                    }
-                }
-                send_reply(530, nullptr);
-                break;
-            case E_FTP_CMD_PASV: {
-                closesocket(ftp_data.d_sd);
-                ftp_data.d_sd = -1;
-                ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
-                bool socketcreated = true;
-                if (ftp_data.ld_sd < 0) {
-                    socketcreated = create_listening_socket(
-                        &ftp_data.ld_sd, FTP_PASSIVE_DATA_PORT,
-                        FTP_DATA_CLIENTS_MAX - 1);
-                }
-                if (socketcreated) {
-                    uint8_t* pip = (uint8_t*)&ftp_data.ip_addr;
-                    ftp_data.dtimeout = 0;
-                    snprintf((char*)ftp_data.dBuffer, ftp_buff_size,
-                             "(%u,%u,%u,%u,%u,%u)", pip[0], pip[1], pip[2],
-                             pip[3], (FTP_PASSIVE_DATA_PORT >> 8),
-                             (FTP_PASSIVE_DATA_PORT & 0xFF));
-                    ftp_data.substate = E_FTP_STE_SUB_LISTEN_FOR_DATA;
-                    ESP_LOGI(FTP_TAG, "Data socket created");
-                    send_reply(227, (char*)ftp_data.dBuffer);
-                } else {
-                    ESP_LOGW(FTP_TAG, "Error creating data socket");
-                    send_reply(425, nullptr);
-                }
-            } break;
-            case E_FTP_CMD_LIST:
-            case E_FTP_CMD_NLST:
-                get_param_and_open_child(&bufptr);
-                if (cmd == E_FTP_CMD_LIST)
-                    ftp_nlist = 0;
-                else
-                    ftp_nlist = 1;
-                if (open_dir_for_listing(ftp_path) == E_FTP_RESULT_CONTINUE) {
-                    ftp_data.state = E_FTP_STE_CONTINUE_LISTING;
-                    send_reply(150, nullptr);
-                } else {
-                    send_reply(550, nullptr);
-                }
-                break;
-            case E_FTP_CMD_RETR:
-                ftp_data.total = 0;
-                ftp_data.time = 0;
-                get_param_and_open_child(&bufptr);
-                if ((strlen(ftp_path) > 0) &&
-                    (ftp_path[strlen(ftp_path) - 1] != '/')) {
-                    if (open_file(ftp_path, "rb")) {
-                        log_to_screen("[<<] Download: %s", ftp_path);
-                        ftp_data.state = E_FTP_STE_CONTINUE_FILE_TX;
-                        vTaskDelay(20 / portTICK_PERIOD_MS);
-                        send_reply(150, nullptr);
-                    } else {
-                        ftp_data.state = E_FTP_STE_END_TRANSFER;
-                        send_reply(550, nullptr);
-                    }
-                } else {
-                    ftp_data.state = E_FTP_STE_END_TRANSFER;
-                    send_reply(550, nullptr);
-                }
-                break;
-            case E_FTP_CMD_APPE:
-                ftp_data.total = 0;
-                ftp_data.time = 0;
-                get_param_and_open_child(&bufptr);
-                if ((strlen(ftp_path) > 0) &&
-                    (ftp_path[strlen(ftp_path) - 1] != '/')) {
-                    if (open_file(ftp_path, "ab")) {
-                        log_to_screen("[OK] Append: %s", ftp_path);
-                        ftp_data.state = E_FTP_STE_CONTINUE_FILE_RX;
-                        vTaskDelay(20 / portTICK_PERIOD_MS);
-                        send_reply(150, nullptr);
-                    } else {
-                        ftp_data.state = E_FTP_STE_END_TRANSFER;
-                        send_reply(550, nullptr);
-                    }
-                } else {
-                    ftp_data.state = E_FTP_STE_END_TRANSFER;
-                    send_reply(550, nullptr);
-                }
-                break;
-            case E_FTP_CMD_STOR:
-                ftp_data.total = 0;
-                ftp_data.time = 0;
-                get_param_and_open_child(&bufptr);
-                if ((strlen(ftp_path) > 0) &&
-                    (ftp_path[strlen(ftp_path) - 1] != '/')) {
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_STOR ftp_path=[%s]", ftp_path);
-                    if (open_file(ftp_path, "wb")) {
-                        log_to_screen("[>>] Upload: %s", ftp_path);
-                        ftp_data.state = E_FTP_STE_CONTINUE_FILE_RX;
-                        vTaskDelay(20 / portTICK_PERIOD_MS);
-                        send_reply(150, nullptr);
-                    } else {
-                        ftp_data.state = E_FTP_STE_END_TRANSFER;
-                        send_reply(550, nullptr);
-                    }
-                } else {
-                    ftp_data.state = E_FTP_STE_END_TRANSFER;
-                    send_reply(550, nullptr);
-                }
-                break;
-            case E_FTP_CMD_DELE:
-                get_param_and_open_child(&bufptr);
-                if ((strlen(ftp_path) > 0) &&
-                    (ftp_path[strlen(ftp_path) - 1] != '/')) {
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_DELE ftp_path=[%s]", ftp_path);
-                    char actual_path_dele[128];
-                    translate_path(actual_path_dele, sizeof(actual_path_dele), ftp_path);
-                    snprintf(fullname, sizeof(fullname), "%s%s", MOUNT_POINT,
-                             actual_path_dele);
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_DELE fullname=[%s]", fullname);
-                    if (unlink(fullname) == 0) {
-                        vTaskDelay(20 / portTICK_PERIOD_MS);
-                        ESP_LOGI(FTP_TAG, "File deleted: %s", ftp_path);
-                        send_reply(250, nullptr);
-                        log_to_screen("[OK] Deleted: %s", ftp_path);
-                    } else
-                        send_reply(550, nullptr);
-                } else
-                    send_reply(250, nullptr);
-                break;
-            case E_FTP_CMD_RMD:
-                get_param_and_open_child(&bufptr);
-                if ((strlen(ftp_path) > 0) &&
-                    (ftp_path[strlen(ftp_path) - 1] != '/')) {
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RMD ftp_path=[%s]", ftp_path);
-                    char actual_path_rmd[128];
-                    translate_path(actual_path_rmd, sizeof(actual_path_rmd), ftp_path);
-                    snprintf(fullname, sizeof(fullname), "%s%s", MOUNT_POINT,
-                             actual_path_rmd);
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RMD fullname=[%s]", fullname);
-                    if (rmdir(fullname) == 0) {
-                        vTaskDelay(20 / portTICK_PERIOD_MS);
-                        ESP_LOGI(FTP_TAG, "Directory removed: %s", ftp_path);
-                        send_reply(250, nullptr);
-                        log_to_screen("[OK] Removed dir: %s", ftp_path);
-                    } else
-                        send_reply(550, nullptr);
-                } else
-                    send_reply(250, nullptr);
-                break;
-            case E_FTP_CMD_MKD:
-                get_param_and_open_child(&bufptr);
-                if ((strlen(ftp_path) > 0) &&
-                    (ftp_path[strlen(ftp_path) - 1] != '/')) {
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_MKD ftp_path=[%s]", ftp_path);
-                    char actual_path_mkd[128];
-                    translate_path(actual_path_mkd, sizeof(actual_path_mkd), ftp_path);
-                    snprintf(fullname, sizeof(fullname), "%s%s", MOUNT_POINT,
-                             actual_path_mkd);
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_MKD fullname=[%s]", fullname);
-                    if (mkdir(fullname, 0755) == 0) {
-                        vTaskDelay(20 / portTICK_PERIOD_MS);
-                        ESP_LOGI(FTP_TAG, "Directory created: %s", ftp_path);
-                        send_reply(250, nullptr);
-                        log_to_screen("[OK] Created dir: %s", ftp_path);
-                    } else
-                        send_reply(550, nullptr);
-                } else
-                    send_reply(250, nullptr);
-                break;
-            case E_FTP_CMD_RNFR:
-                get_param_and_open_child(&bufptr);
-                ESP_LOGI(FTP_TAG, "E_FTP_CMD_RNFR ftp_path=[%s]", ftp_path);
-                {
-                    char actual_path_rnfr[128];
-                    translate_path(actual_path_rnfr, sizeof(actual_path_rnfr), ftp_path);
-                    snprintf(fullname, sizeof(fullname), "%s%s", MOUNT_POINT,
-                             actual_path_rnfr);
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RNFR fullname=[%s]", fullname);
-                    res = stat(fullname, &buf);
-                    if (res == 0) {
-                        send_reply(350, nullptr);
-                        strcpy((char*)ftp_data.dBuffer, ftp_path);
-                    } else {
-                        send_reply(550, nullptr);
-                    }
-                    log_to_screen("[**] Renaming: %s", ftp_path);
-                }
-                break;
-            case E_FTP_CMD_RNTO:
-                get_param_and_open_child(&bufptr);
-                ESP_LOGI(FTP_TAG,
-                         "E_FTP_CMD_RNTO ftp_path=[%s], ftp_data.dBuffer=[%s]",
-                         ftp_path, (char*)ftp_data.dBuffer);
-                {
-                    char actual_old[128];
-                    translate_path(actual_old, sizeof(actual_old), (char*)ftp_data.dBuffer);
-                    strcpy(fullname, MOUNT_POINT);
-                    strcat(fullname, actual_old);
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RNTO fullname=[%s]", fullname);
-                    char actual_new[128];
-                    translate_path(actual_new, sizeof(actual_new), ftp_path);
-                    strcpy(fullname2, MOUNT_POINT);
-                    strcat(fullname2, actual_new);
-                    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RNTO fullname2=[%s]",
-                             fullname2);
-                    if (rename(fullname, fullname2) == 0) {
-                        ESP_LOGI(FTP_TAG, "File renamed from %s to %s",
-                                 (char*)ftp_data.dBuffer, ftp_path);
-                        send_reply(250, nullptr);
-                    } else {
-                        send_reply(550, nullptr);
-                    }
-                }
-                log_to_screen("[OK] Renamed to: %s", ftp_path);
-                break;
-            case E_FTP_CMD_NOOP:
-                send_reply(200, nullptr);
-                break;
-            case E_FTP_CMD_QUIT:
-                ESP_LOGI(FTP_TAG, "Client disconnected (QUIT)");
-                send_reply(221, nullptr);
-                close_cmd_data();
-                ftp_data.state = E_FTP_STE_START;
-                break;
-            default:
-                send_reply(502, nullptr);
-                break;
+void Server::Session::cmd_rmd(char** bufptr) {
+    if ((strlen(ftp_path) > 0) && (ftp_path[strlen(ftp_path) - 1] != '/')) {
+        ESP_LOGI(FTP_TAG, "E_FTP_CMD_RMD ftp_path=[%s]", ftp_path);
+        char fullname[128];
+        get_full_path(fullname, sizeof(fullname), ftp_path);
+        ESP_LOGI(FTP_TAG, "E_FTP_CMD_RMD fullname=[%s]", fullname);
+        if (rmdir(fullname) == 0) {
+            invalidate_cached(fullname, true);
+            server->ftp_dir_index.remove(fullname);
+            server->ftp_dir_index.invalidate_tree(fullname);
+            ESP_LOGI(FTP_TAG, "Directory removed: %s", ftp_path);
+            send_reply(250, nullptr);
+            server->log_to_screen("[OK] Removed dir: %s", ftp_path);
+        } else
+            send_reply(550, nullptr);
+    } else
+        send_reply(250, nullptr);
+}
+
+void Server::Session::cmd_mkd(char** bufptr) {
+    if ((strlen(ftp_path) > 0) && (ftp_path[strlen(ftp_path) - 1] != '/')) {
+        ESP_LOGI(FTP_TAG, "E_FTP_CMD_MKD ftp_path=[%s]", ftp_path);
+        char fullname[128];
+        get_full_path(fullname, sizeof(fullname), ftp_path);
+        ESP_LOGI(FTP_TAG, "E_FTP_CMD_MKD fullname=[%s]", fullname);
+        if (mkdir(fullname, 0755) == 0) {
+            invalidate_cached(fullname, false);
+            index_changed(fullname);
+            ESP_LOGI(FTP_TAG, "Directory created: %s", ftp_path);
+            send_reply(250, nullptr);
+            server->log_to_screen("[OK] Created dir: %s", ftp_path);
+        } else
+            send_reply(550, nullptr);
+    } else
+        send_reply(250, nullptr);
+}
+
+void Server::Session::cmd_rnfr(char** bufptr) {
+    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RNFR ftp_path=[%s]", ftp_path);
+    char fullname[128];
+    fs_stat_t st;
+    get_full_path(fullname, sizeof(fullname), ftp_path);
+    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RNFR fullname=[%s]", fullname);
+    if (stat_cached(fullname, &st)) {
+        send_reply(350, nullptr);
+        strcpy((char*)ftp_data.dBuffer, ftp_path);
+    } else {
+        send_reply(550, nullptr);
+    }
+    server->log_to_screen("[**] Renaming: %s", ftp_path);
+}
+
+void Server::Session::cmd_rnto(char** bufptr) {
+    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RNTO ftp_path=[%s], ftp_data.dBuffer=[%s]",
+             ftp_path, (char*)ftp_data.dBuffer);
+    char fullname[128];
+    char fullname2[128];
+    get_full_path(fullname, sizeof(fullname), (char*)ftp_data.dBuffer);
+    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RNTO fullname=[%s]", fullname);
+    get_full_path(fullname2, sizeof(fullname2), ftp_path);
+    ESP_LOGI(FTP_TAG, "E_FTP_CMD_RNTO fullname2=[%s]", fullname2);
+    if (rename(fullname, fullname2) == 0) {
+        invalidate_cached(fullname, true);
+        invalidate_cached(fullname2, true);
+        server->ftp_dir_index.rename(fullname, fullname2);
+        ESP_LOGI(FTP_TAG, "File renamed from %s to %s",
+                 (char*)ftp_data.dBuffer, ftp_path);
+        send_reply(250, nullptr);
+    } else {
+        send_reply(550, nullptr);
+    }
+    server->log_to_screen("[OK] Renamed to: %s", ftp_path);
+}
+
+void Server::Session::cmd_rest(char** bufptr) {
+    pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+    char* end;
+    errno = 0;
+    uint64_t offset = strtoull(ftp_scratch_buffer, &end, 10);
+    if (!isdigit((unsigned char)ftp_scratch_buffer[0]) || *end != '\0' || errno == ERANGE) {
+        ftp_data.restart = 0;
+        send_reply(501, nullptr);
+        return;
+    }
+    ftp_data.restart = offset;
+    ftp_data.range_set = false;  // REST and RANG replace each other
+    snprintf((char*)ftp_data.dBuffer, ftp_buff_size, "Restarting at %" PRIu64, offset);
+    send_reply(350, (char*)ftp_data.dBuffer);
+}
+
+// RANG start end (draft-bryan-ftp-range): the byte range, end inclusive,
+// of the next RETR or HASH, in place of a REST. "RANG 1 0" clears it.
+void Server::Session::cmd_rang(char** bufptr) {
+    uint64_t bounds[2];
+    for (uint64_t& bound : bounds) {
+        pop_param(bufptr, ftp_scratch_buffer, FTP_MAX_PARAM_SIZE, true, true);
+        char* end;
+        errno = 0;
+        bound = strtoull(ftp_scratch_buffer, &end, 10);
+        if (!isdigit((unsigned char)ftp_scratch_buffer[0]) || *end != '\0' || errno == ERANGE) {
+            ftp_data.range_set = false;
+            send_reply(501, nullptr);
+            return;
+        }
+    }
+    if (bounds[0] == 1 && bounds[1] == 0) {
+        ftp_data.range_set = false;
+        send_reply(350, (char*)"Restarting at 0. Ending at end of file.");
+        return;
+    }
+    if (bounds[0] > bounds[1]) {
+        ftp_data.range_set = false;
+        send_reply(501, (char*)"Start of range after its end");
+        return;
+    }
+    ftp_data.range_set = true;
+    ftp_data.restart = 0;
+    ftp_data.range_start = bounds[0];
+    ftp_data.range_end = bounds[1];
+    snprintf((char*)ftp_data.dBuffer, ftp_buff_size,
+             "Restarting at %" PRIu64 ". Ending at %" PRIu64 ".", bounds[0], bounds[1]);
+    send_reply(350, (char*)ftp_data.dBuffer);
+}
+
+void Server::Session::cmd_hash(char** bufptr) {
+    start_hash((Hasher::algo_t)ftp_hash_algo, false);
+}
+
+void Server::Session::cmd_xcrc(char** bufptr) {
+    start_hash(Hasher::E_HASH_CRC32, true);
+}
+
+void Server::Session::cmd_xmd5(char** bufptr) {
+    start_hash(Hasher::E_HASH_MD5, true);
+}
+
+void Server::Session::cmd_xsha1(char** bufptr) {
+    start_hash(Hasher::E_HASH_SHA1, true);
+}
+
+void Server::Session::cmd_xsha256(char** bufptr) {
+    start_hash(Hasher::E_HASH_SHA256, true);
+}
+
+void Server::Session::cmd_xsha512(char** bufptr) {
+    start_hash(Hasher::E_HASH_SHA512, true);
+}
+
+void Server::Session::cmd_noop(char** bufptr) {
+    send_reply(200, nullptr);
+}
+
+// STAT with a path lists it over the control connection, which spares a
+// client browsing small directories the data connection round trips.
+// Without one it reports the state of the session.
+void Server::Session::cmd_stat(char** bufptr) {
+    if (ftp_scratch_buffer[0] == '\0') {
+        send_status();
+        return;
+    }
+    char fullname[128];
+    fs_stat_t st;
+    get_full_path(fullname, sizeof(fullname), ftp_path);
+    if (stat_cached(fullname, &st) && !st.is_dir) {
+        storage_dirent_t de = {ftp_scratch_buffer, st.size, st.mtime, false};
+        char* reply = (char*)ftp_data.dBuffer;
+        int len = snprintf(reply, ftp_buff_size, "-Status follows:\r\n");
+        ftp_list_format = E_FTP_LIST_UNIX;
+        int line_len = get_eplf_item(reply + len, ftp_buff_size - len, &de);
+        if (line_len < 0) {
+            send_reply(550, nullptr);
+            return;
         }
+        len += line_len;
+        snprintf(reply + len, ftp_buff_size - len, "213 End of status");
+        send_reply(213, reply);
+        return;
+    }
+    start_listing(E_FTP_LIST_UNIX, true);
+}
+
+void Server::Session::send_status() {
+    const char* data;
+    char listening[48];
+    switch (ftp_data.substate) {
+        case E_FTP_STE_SUB_LISTEN_FOR_DATA:
+            snprintf(listening, sizeof(listening), "listening on port %u",
+                     (unsigned)(FTP_PASSIVE_PORT_BASE + ftp_data.pasv_slot));
+            data = listening;
+            break;
+        case E_FTP_STE_SUB_DATA_CONNECTED:
+            data = "open";
+            break;
+        default:
+            data = "none";
+            break;
+    }
+    snprintf((char*)ftp_data.dBuffer, ftp_buff_size,
+             "-" FTP_SERVER_NAME " status:\r\n"
+             " Session %u, logged in as %s\r\n"
+             " Directory: %s\r\n"
+             " TYPE: %s, STRU: FILE, MODE: %s\r\n"
+             " Data connection: %s\r\n"
+             " Restart offset: %" PRIu64 "\r\n"
+             " Listing cache: %" PRIu32 " hits, %" PRIu32 " misses\r\n"
+             " Stat cache: %" PRIu32 " hits, %" PRIu32 " misses\r\n"
+             " Checksum cache: %" PRIu32 " hits, %" PRIu32 " misses\r\n"
+             "211 End of status",
+             (unsigned)index, server->ftp_user, ftp_path,
+             ftp_data.ascii ? "ASCII" : "BINARY", FTP_MODE_NAMES[ftp_data.mode], data, ftp_data.restart,
+             server->ftp_list_cache.hits(), server->ftp_list_cache.misses(),
+             server->ftp_stat_cache.hits(), server->ftp_stat_cache.misses(),
+             server->ftp_hash_cache.hits(), server->ftp_hash_cache.misses());
+    send_reply(211, (char*)ftp_data.dBuffer);
+}
+
+void Server::Session::cmd_quit(char** bufptr) {
+    ESP_LOGI(FTP_TAG, "Client disconnected (QUIT)");
+    send_reply(221, nullptr);
+    close_cmd_data();
+    ftp_data.state = E_FTP_STE_READY;
+}
 
-        if (ftp_data.closechild) {
-            remove_fname_from_path(ftp_path, ftp_scratch_buffer);
-        }
-    } else if (result == E_FTP_RESULT_CONTINUE) {
-        if (ftp_data.ctimeout > ftp_timeout) {
+// True when a complete command line is buffered and the session is in a
+// state to run it
+bool Server::Session::command_ready() const {
+    return ftp_data.c_sd >= 0 && ftp_data.state == E_FTP_STE_READY &&
+           ftp_data.substate != E_FTP_STE_SUB_LISTEN_FOR_DATA &&
+           ftp_reply_len <= FTP_REPLY_QUEUE_SIZE / 2 &&
+           memchr(ftp_cmd_buffer, '\n', ftp_cmd_len) != nullptr;
+}
+
+// Appends whatever the client has sent to the line buffer
+void Server::Session::receive_commands() {
+    int32_t len;
+    ftp_result_t result = recv_non_blocking(ftp_data.c_sd, ftp_cmd_buffer + ftp_cmd_len,
+                                            FTP_CMD_BUFFER_SIZE - 1 - ftp_cmd_len, &len);
+    if (result == E_FTP_RESULT_FAILED) {
+        ESP_LOGI(FTP_TAG, "Client disconnected");
+        close_cmd_data();
+        ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
+        return;
+    }
+    if (result == E_FTP_RESULT_CONTINUE) {
+        if (ftp_data.ctimeout > (uint32_t)server->ftp_timeout) {
             send_reply(221, nullptr);
             ESP_LOGW(FTP_TAG, "Connection timeout");
         }
+        return;
+    }
+    ftp_data.ctimeout = 0;
+    ftp_cmd_len += len;
+
+    if (ftp_cmd_discard) {
+        // Skipping the tail of an overlong line
+        char* eol = (char*)memchr(ftp_cmd_buffer, '\n', ftp_cmd_len);
+        if (eol == nullptr) {
+            ftp_cmd_len = 0;
+            return;
+        }
+        ftp_cmd_discard = false;
+        ftp_cmd_len -= eol + 1 - ftp_cmd_buffer;
+        memmove(ftp_cmd_buffer, eol + 1, ftp_cmd_len);
+    }
+    if (ftp_cmd_len == FTP_CMD_BUFFER_SIZE - 1 &&
+        memchr(ftp_cmd_buffer, '\n', ftp_cmd_len) == nullptr) {
+        ESP_LOGW(FTP_TAG, "Command line too long");
+        ftp_cmd_len = 0;
+        ftp_cmd_discard = true;
+        send_reply(500, nullptr);
+    }
+}
+
+// Runs the first buffered command line and drops it from the buffer
+void Server::Session::run_command() {
+    char* eol = (char*)memchr(ftp_cmd_buffer, '\n', ftp_cmd_len);
+    uint32_t line_len = eol + 1 - ftp_cmd_buffer;
+    char* bufptr = ftp_cmd_buffer;
+
+    *eol = '\0';
+    ftp_data.closechild = false;
+    const ftp_cmd_t* cmd = pop_command(&bufptr);
+    if (cmd == nullptr) {
+        ESP_LOGI(FTP_TAG, "CMD: not supported");
+        if (!ftp_data.loggin.passvalid) {
+            send_reply(332, nullptr);
+        } else {
+            send_reply(502, nullptr);
+        }
+    } else if ((cmd->flags & FTP_CMD_NEEDS_LOGIN) && !ftp_data.loggin.passvalid) {
+        send_reply(332, nullptr);
     } else {
-        close_cmd_data();
+        ESP_LOGI(FTP_TAG, "CMD: %s", cmd->name);
+        if (cmd->flags & FTP_CMD_PATH_ARG) {
+            get_param_and_open_child(&bufptr);
+        }
+        (this->*cmd->handler)(&bufptr);
+
+        if (ftp_data.closechild) {
+            strcpy(ftp_path, ftp_saved_path);
+        }
+    }
+
+    if (ftp_data.c_sd < 0) {
+        ftp_cmd_len = 0;  // QUIT or a reset, the rest is moot
+        return;
+    }
+    ftp_cmd_len -= line_len;
+    memmove(ftp_cmd_buffer, ftp_cmd_buffer + line_len, ftp_cmd_len);
+}
+
+// Main command processing. The control connection is framed into CRLF
+// lines here, since one recv() can carry several pipelined commands or
+// only part of one. Buffered commands run back to back, in order, until
+// one of them starts a transfer or opens a passive port; the rest wait
+// until the session is ready again.
+void Server::Session::process_cmd() {
+    if (memchr(ftp_cmd_buffer, '\n', ftp_cmd_len) == nullptr) {
+        receive_commands();
+    }
+    while (command_ready()) {
+        run_command();
     }
 }
 
 void Server::wait_for_enabled() {
-    if (ftp_data.enabled) {
-        ftp_data.state = E_FTP_STE_START;
+    if (ftp_enabled) {
+        ftp_state = E_FTP_STE_START;
     }
 }
 
-void Server::deinit() {
+void Server::Session::deinit() {
+    if (ftp_spool) heap_caps_free(ftp_spool);
+    ftp_spool = nullptr;
+    if (ftp_ascii_buffer) heap_caps_free(ftp_ascii_buffer);
+    ftp_ascii_buffer = nullptr;
+    ftp_deflater.release();
+    ftp_inflater.release();
+    for (ftp_io_buf_t& io : ftp_io_bufs) {
+        if (io.data) heap_caps_free(io.data);
+        io.data = nullptr;
+    }
     if (ftp_path) free(ftp_path);
+    if (ftp_saved_path) free(ftp_saved_path);
     if (ftp_cmd_buffer) free(ftp_cmd_buffer);
+    if (ftp_reply_queue) free(ftp_reply_queue);
     if (ftp_data.dBuffer) free(ftp_data.dBuffer);
     if (ftp_scratch_buffer) free(ftp_scratch_buffer);
     ftp_path = nullptr;
+    ftp_saved_path = nullptr;
     ftp_cmd_buffer = nullptr;
+    ftp_reply_queue = nullptr;
     ftp_data.dBuffer = nullptr;
     ftp_scratch_buffer = nullptr;
 }
 
-bool Server::init() {
-    ftp_stop = 0;
+bool Server::Session::init(Server* owner, uint8_t slot) {
     deinit();
+    server = owner;
+    index = slot;
+    MOUNT_POINT = owner->MOUNT_POINT;
+    ftp_buff_size = FTPSERVER_BUFFER_SIZE;
     memset(&ftp_data, 0, sizeof(ftp_data_t));
     ftp_data.dBuffer = (uint8_t*)malloc(ftp_buff_size + 1);
     if (ftp_data.dBuffer == nullptr) {
@@ -1165,80 +2623,341 @@ bool Server::init() {
         goto error_path;
     }
     strcpy(ftp_path, "/");
+    ftp_saved_path = (char*)malloc(FTP_MAX_PARAM_SIZE);
+    if (ftp_saved_path == nullptr) {
+        goto error_saved_path;
+    }
     ftp_scratch_buffer = (char*)malloc(FTP_MAX_PARAM_SIZE);
     if (ftp_scratch_buffer == nullptr) {
         goto error_scratch;
     }
-    ftp_cmd_buffer = (char*)malloc(FTP_MAX_PARAM_SIZE + FTP_CMD_SIZE_MAX);
+    ftp_cmd_buffer = (char*)malloc(FTP_CMD_BUFFER_SIZE);
     if (ftp_cmd_buffer == nullptr) {
         goto error_cmd;
     }
+    ftp_reply_queue = (char*)malloc(FTP_REPLY_QUEUE_SIZE);
+    if (ftp_reply_queue == nullptr) {
+        goto error_reply;
+    }
+    ftp_reply_head = 0;
+    ftp_reply_len = 0;
+    ftp_cmd_len = 0;
+    ftp_cmd_discard = false;
+    for (ftp_io_buf_t& io : ftp_io_bufs) {
+        // DMA-capable and cache-line aligned so the SD/flash driver can
+        // transfer straight into the buffer without bouncing
+        io.data = (uint8_t*)heap_caps_aligned_alloc(FTP_IO_BUFFER_ALIGN, FTP_IO_BUFFER_SIZE,
+                                                    MALLOC_CAP_DMA);
+        if (io.data == nullptr) {
+            io.data = (uint8_t*)heap_caps_aligned_alloc(FTP_IO_BUFFER_ALIGN, FTP_IO_BUFFER_SIZE,
+                                                        MALLOC_CAP_DEFAULT);
+        }
+        if (io.data == nullptr) {
+            goto error_io;
+        }
+        io.state.store(E_FTP_IO_IDLE);
+    }
+    // TYPE A downloads are expanded piece by piece into their own buffer
+    ftp_ascii_buffer = (uint8_t*)heap_caps_malloc(FTP_ASCII_BUFFER_SIZE, MALLOC_CAP_SPIRAM);
+    if (ftp_ascii_buffer == nullptr) {
+        ftp_ascii_buffer = (uint8_t*)malloc(FTP_ASCII_BUFFER_SIZE);
+    }
+    if (ftp_ascii_buffer == nullptr) {
+        goto error_ascii;
+    }
+    if (FTP_SPOOL_SIZE > 0) {
+        // The spool is large and only touched by memcpy-speed code, so it
+        // goes to PSRAM. Without one, uploads are written synchronously.
+        ftp_spool = (uint8_t*)heap_caps_malloc(FTP_SPOOL_SIZE, MALLOC_CAP_SPIRAM);
+        if (ftp_spool == nullptr) {
+            ESP_LOGW(FTP_TAG, "No PSRAM for STOR spool, writing synchronously");
+        }
+    }
 
     ftp_data.c_sd = -1;
     ftp_data.d_sd = -1;
-    ftp_data.lc_sd = -1;
     ftp_data.ld_sd = -1;
+    ftp_data.pasv_slot = -1;
     ftp_data.e_open = E_FTP_NOTHING_OPEN;
-    ftp_data.state = E_FTP_STE_DISABLED;
+    ftp_data.state = E_FTP_STE_READY;
     ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
 
     return true;
 
+error_ascii:
+error_io:
+    for (ftp_io_buf_t& io : ftp_io_bufs) {
+        heap_caps_free(io.data);
+        io.data = nullptr;
+    }
+    free(ftp_reply_queue);
+error_reply:
+    free(ftp_cmd_buffer);
 error_cmd:
     free(ftp_scratch_buffer);
 error_scratch:
+    free(ftp_saved_path);
+error_saved_path:
     free(ftp_path);
 error_path:
     free(ftp_data.dBuffer);
 error_dbuffer:
     ftp_data.dBuffer = nullptr;
     ftp_path = nullptr;
+    ftp_saved_path = nullptr;
     ftp_scratch_buffer = nullptr;
     ftp_cmd_buffer = nullptr;
+    ftp_reply_queue = nullptr;
     return false;
 }
 
-int Server::run(uint32_t elapsed) {
+void Server::Session::open(int32_t sd, uint32_t ip_addr) {
+    // Replies are already batched per step, so Nagle would only hold back
+    // the tail of a pipelined batch until the client's delayed ACK
+    int option = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    ftp_data.c_sd = sd;
+    ftp_data.ip_addr = ip_addr;
+    ftp_data.state = E_FTP_STE_READY;
+    ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
+    ftp_data.list_control = false;
+    ftp_data.epsv_all = false;
+    ftp_data.logginRetries = 0;
+    ftp_data.ctimeout = 0;
+    ftp_reply_head = 0;
+    ftp_reply_len = 0;
+    ftp_cmd_len = 0;
+    ftp_cmd_discard = false;
+    ftp_data.restart = 0;
+    ftp_data.range_set = false;  // A RANG left by the slot's last client
+    ftp_data.range_start = 0;
+    ftp_data.range_end = 0;
+    ftp_data.mode = E_FTP_MODE_STREAM;
+    ftp_data.ascii = false;
+    ftp_deflater.release();
+    ftp_inflater.release();
+    ftp_mlst_facts = FTP_FACTS_ALL;
+    ftp_hash_algo = Hasher::E_HASH_SHA256;
+    ftp_hasher.abort();
+    ftp_data.loggin.uservalid = false;
+    ftp_data.loggin.passvalid = false;
+    strcpy(ftp_path, "/");
+    ESP_LOGI(FTP_TAG, "Session %u connected.", index);
+    send_reply(220, (char*)FTP_SERVER_NAME);
+    flush_replies();
+}
+
+// Data connections are only accepted from the client on the control
+// connection, since pooled ports are predictable
+bool Server::Session::data_peer_valid() {
+    struct sockaddr_in ctrl, data;
+    socklen_t len = sizeof(ctrl);
+    if (getpeername(ftp_data.c_sd, (struct sockaddr*)&ctrl, &len) != 0) {
+        return false;
+    }
+    len = sizeof(data);
+    if (getpeername(ftp_data.d_sd, (struct sockaddr*)&data, &len) != 0) {
+        return false;
+    }
+    return ctrl.sin_addr.s_addr == data.sin_addr.s_addr;
+}
+
+// Borrows a pre-armed listener from the pool for the next data connection
+bool Server::Session::open_passive() {
+    closesocket(ftp_data.d_sd);
+    ftp_data.d_sd = -1;
+    ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
+    release_listener();
+    ftp_data.pasv_slot = server->acquire_passive_listener();
+    if (ftp_data.pasv_slot < 0) {
+        return false;
+    }
+    ftp_data.ld_sd = server->ftp_pasv_sd[ftp_data.pasv_slot];
+    ftp_data.dtimeout = 0;
+    ftp_data.substate = E_FTP_STE_SUB_LISTEN_FOR_DATA;
+    return true;
+}
+
+void Server::Session::release_listener() {
+    server->release_passive_listener(ftp_data.pasv_slot);
+    ftp_data.pasv_slot = -1;
+    ftp_data.ld_sd = -1;
+}
+
+void Server::deinit() {
+    for (Session& session : ftp_sessions) {
+        session.deinit();
+    }
+    ftp_list_cache.deinit();
+    ftp_stat_cache.deinit();
+    ftp_dir_index.deinit();
+    ftp_hash_cache.deinit();
+}
+
+bool Server::init() {
+    ftp_stop = 0;
+    deinit();
+    lc_sd = -1;
+    ftp_state = E_FTP_STE_DISABLED;
+    for (uint8_t i = 0; i < FTP_CMD_CLIENTS_MAX; i++) {
+        if (!ftp_sessions[i].init(this, i)) {
+            deinit();
+            return false;
+        }
+    }
+    // Optional: without PSRAM every LIST simply reads the directory
+    ftp_list_cache.init(FTP_LIST_CACHE_SIZE, CONFIG_FTP_LIST_CACHE_DIRS);
+    ftp_stat_cache.init(CONFIG_FTP_STAT_CACHE_ENTRIES);
+    ftp_dir_index.init(FTP_DIR_INDEX_SIZE, CONFIG_FTP_DIR_INDEX_DIRS,
+                       CONFIG_FTP_DIR_INDEX_MIN_ENTRIES);
+    ftp_hash_cache.init(CONFIG_FTP_HASH_CACHE_ENTRIES);
+    return true;
+}
+
+void Server::storage_changed(const char* mount_point) {
+    if (ftp_mutex == nullptr) {
+        return;
+    }
     xSemaphoreTake(ftp_mutex, portMAX_DELAY);
+    ftp_list_cache.invalidate_tree(mount_point);
+    ftp_stat_cache.invalidate_tree(mount_point);
+    ftp_dir_index.invalidate_tree(mount_point);
+    ftp_hash_cache.invalidate_tree(mount_point);
+    xSemaphoreGive(ftp_mutex);
+}
 
-    if (ftp_stop) {
-        ESP_LOGI(FTP_TAG, "Stop flag detected in run()");
-        xSemaphoreGive(ftp_mutex);
-        return -2;
+void Server::get_cache_stats(ftp_cache_stats_t* stats) {
+    if (ftp_mutex == nullptr) {
+        return;
+    }
+    xSemaphoreTake(ftp_mutex, portMAX_DELAY);
+    stats->list_hits = ftp_list_cache.hits();
+    stats->list_misses = ftp_list_cache.misses();
+    stats->stat_hits = ftp_stat_cache.hits();
+    stats->stat_misses = ftp_stat_cache.misses();
+    xSemaphoreGive(ftp_mutex);
+}
+
+void Server::accept_session() {
+    int32_t sd;
+    uint32_t ip_addr;
+    ftp_result_t result = wait_for_connection(lc_sd, &sd, &ip_addr, true);
+    if (result == E_FTP_RESULT_CONTINUE) {
+        return;
+    }
+    if (result == E_FTP_RESULT_FAILED) {
+        ESP_LOGW(FTP_TAG, "Accept failed, restarting listener");
+        reset();
+        return;
     }
+    for (Session& session : ftp_sessions) {
+        if (!session.isConnected()) {
+            session.open(sd, ip_addr);
+            return;
+        }
+    }
+    static const char busy[] = "421 Too many users, try again later\r\n";
+    ESP_LOGW(FTP_TAG, "All %d sessions busy, rejecting client", FTP_CMD_CLIENTS_MAX);
+    send(sd, busy, sizeof(busy) - 1, 0);
+    closesocket(sd);
+}
 
-    ftp_data.dtimeout += elapsed;
-    ftp_data.ctimeout += elapsed;
-    ftp_data.time += elapsed;
+// Registers the sockets this session is waiting on and returns how long the
+// session can sleep before its next timeout has to be serviced (0 when it has
+// work pending that does not depend on socket readiness).
+uint32_t Server::Session::prepare_wait(fd_set* rfds, fd_set* wfds, int* maxfd) {
+    uint32_t wait_ms = UINT32_MAX;
+    int32_t sd = -1;
+    bool write = false;
 
     switch (ftp_data.state) {
-        case E_FTP_STE_DISABLED:
-            wait_for_enabled();
+        case E_FTP_STE_READY:
+            if (memchr(ftp_cmd_buffer, '\n', ftp_cmd_len) != nullptr) {
+                // A pipelined command is buffered; don't read further ahead
+                if (command_ready()) {
+                    return 0;
+                }
+            } else if (ftp_data.substate != E_FTP_STE_SUB_LISTEN_FOR_DATA) {
+                sd = ftp_data.c_sd;
+                if ((uint32_t)server->ftp_timeout > ftp_data.ctimeout) {
+                    wait_ms = server->ftp_timeout - ftp_data.ctimeout + 1;
+                } else {
+                    wait_ms = 0;
+                }
+            }
             break;
-        case E_FTP_STE_START:
-            if (create_listening_socket(&ftp_data.lc_sd, FTP_CMD_PORT,
-                                        FTP_CMD_CLIENTS_MAX - 1)) {
-                ftp_data.state = E_FTP_STE_READY;
+        case E_FTP_STE_CONTINUE_FILE_TX:
+            if (ftp_data.tx_len == 0 &&
+                ftp_io_bufs[ftp_io_head].state.load(std::memory_order_acquire) !=
+                    E_FTP_IO_READY) {
+                return 1;  // Storage task still filling the next buffer
             }
+            sd = ftp_data.d_sd;
+            write = true;
             break;
-        case E_FTP_STE_READY:
-            if (ftp_data.c_sd < 0 &&
-                ftp_data.substate == E_FTP_STE_SUB_DISCONNECTED) {
-                if (E_FTP_RESULT_OK == wait_for_connection(ftp_data.lc_sd,
-                                                           &ftp_data.c_sd,
-                                                           &ftp_data.ip_addr)) {
-                    ftp_data.txRetries = 0;
-                    ftp_data.logginRetries = 0;
-                    ftp_data.ctimeout = 0;
-                    ftp_data.loggin.uservalid = false;
-                    ftp_data.loggin.passvalid = false;
-                    strcpy(ftp_path, "/");
-                    ESP_LOGI(FTP_TAG, "Connected.");
-                    send_reply(220, (char*)FTP_SERVER_NAME);
-                    break;
-                }
+        case E_FTP_STE_CONTINUE_LISTING:
+            sd = ftp_data.list_control ? ftp_data.c_sd : ftp_data.d_sd;
+            write = true;
+            break;
+        case E_FTP_STE_CONTINUE_HASH:
+            if (ftp_io_bufs[ftp_io_head].state.load(std::memory_order_acquire) !=
+                E_FTP_IO_READY) {
+                return 1;  // Storage task still reading
             }
-            if (ftp_data.c_sd > 0 &&
+            return 0;
+        case E_FTP_STE_CONTINUE_FILE_RX:
+            if (ftp_data.spool &&
+                (ftp_spool_eof.load(std::memory_order_relaxed) ||
+                 ftp_spool_used.load(std::memory_order_acquire) == FTP_SPOOL_SIZE)) {
+                return 1;  // Waiting for the storage task to drain the spool
+            }
+            if (ftp_data.mode == E_FTP_MODE_BLOCK && ftp_data.rx_left == 0 &&
+                (ftp_data.rx_desc & FTP_BLOCK_EOF)) {
+                return 0;  // EOF block read, nothing more will arrive
+            }
+            if (ftp_data.mode == E_FTP_MODE_DEFLATE &&
+                (ftp_inflater.pending() || ftp_inflater.finished())) {
+                return 0;  // Decompressed data left over from the last recv()
+            }
+            sd = ftp_data.d_sd;
+            break;
+        default:
+            return 0;
+    }
+
+    if (sd >= 0) {
+        FD_SET(sd, write ? wfds : rfds);
+        *maxfd = MAX(*maxfd, (int)sd);
+    }
+    if (ftp_reply_len > 0 && ftp_data.c_sd >= 0) {
+        FD_SET(ftp_data.c_sd, wfds);
+        *maxfd = MAX(*maxfd, (int)ftp_data.c_sd);
+    }
+
+    if (ftp_data.substate == E_FTP_STE_SUB_LISTEN_FOR_DATA && ftp_data.ld_sd >= 0) {
+        FD_SET(ftp_data.ld_sd, rfds);
+        *maxfd = MAX(*maxfd, (int)ftp_data.ld_sd);
+    }
+
+    if (ftp_data.substate != E_FTP_STE_SUB_DISCONNECTED ||
+        ftp_data.state == E_FTP_STE_CONTINUE_FILE_RX) {
+        if (ftp_data.dtimeout < FTP_DATA_TIMEOUT_MS) {
+            wait_ms = MIN(wait_ms, (uint32_t)(FTP_DATA_TIMEOUT_MS - ftp_data.dtimeout + 1));
+        } else {
+            wait_ms = 0;
+        }
+    }
+    return wait_ms;
+}
+
+void Server::Session::run(uint32_t elapsed) {
+    ftp_data.dtimeout += elapsed;
+    ftp_data.ctimeout += elapsed;
+    ftp_data.time += elapsed;
+
+    switch (ftp_data.state) {
+        case E_FTP_STE_READY:
+            if (ftp_data.c_sd >= 0 &&
                 ftp_data.substate != E_FTP_STE_SUB_LISTEN_FOR_DATA) {
                 process_cmd();
                 if (ftp_data.state != E_FTP_STE_READY) {
@@ -1247,63 +2966,43 @@ int Server::run(uint32_t elapsed) {
             }
             break;
         case E_FTP_STE_END_TRANSFER:
-            if (ftp_data.d_sd >= 0) {
+            if (ftp_data.d_sd >= 0 && ftp_data.mode == E_FTP_MODE_BLOCK) {
+                // The EOF block ended the file, so the connection is kept
+                // for the next transfer
+                ftp_data.dtimeout = 0;
+                ftp_data.state = E_FTP_STE_READY;
+            } else if (ftp_data.d_sd >= 0) {
                 closesocket(ftp_data.d_sd);
                 ftp_data.d_sd = -1;
             }
             break;
-        case E_FTP_STE_CONTINUE_LISTING: {
-            uint32_t listsize = 0;
-            ftp_result_t list_res =
-                list_dir((char*)ftp_data.dBuffer, ftp_buff_size, &listsize);
-            if (listsize > 0) send_list(listsize);
-            if (list_res == E_FTP_RESULT_OK) {
-                send_reply(226, nullptr);
-                ftp_data.state = E_FTP_STE_END_TRANSFER;
-            }
+        case E_FTP_STE_CONTINUE_LISTING:
             ftp_data.ctimeout = 0;
-        } break;
-        case E_FTP_STE_CONTINUE_FILE_TX: {
-            uint32_t readsize;
-            ftp_result_t result;
+            continue_listing();
+            break;
+        case E_FTP_STE_CONTINUE_FILE_TX:
             ftp_data.ctimeout = 0;
-            result =
-                read_file((char*)ftp_data.dBuffer, ftp_buff_size, &readsize);
-            if (result == E_FTP_RESULT_FAILED) {
-                send_reply(451, nullptr);
-                ftp_data.state = E_FTP_STE_END_TRANSFER;
-            } else {
-                if (readsize > 0) {
-                    send_file_data(readsize);
-                    ftp_data.total += readsize;
-                    ESP_LOGI(FTP_TAG, "Sent %" PRIu32 ", total: %" PRIu32,
-                             readsize, ftp_data.total);
-                    if (ftp_data.total % 102400 == 0 && ftp_data.total > 0) {
-                        log_to_screen("[^^] Progress: %" PRIu32 " KB", ftp_data.total / 1024);
-                    }
-                }
-                if (result == E_FTP_RESULT_OK) {
-                    send_reply(226, nullptr);
-                    ftp_data.state = E_FTP_STE_END_TRANSFER;
-                    ESP_LOGI(FTP_TAG,
-                             "File sent (%" PRIu32 " bytes in %" PRIu32
-                             " msec).",
-                             ftp_data.total, ftp_data.time);
-                }
-            }
-        } break;
+            continue_readahead();
+            break;
+        case E_FTP_STE_CONTINUE_HASH:
+            ftp_data.ctimeout = 0;
+            continue_hash();
+            break;
         case E_FTP_STE_CONTINUE_FILE_RX: {
             int32_t len;
             ftp_result_t result = E_FTP_RESULT_OK;
+            if (ftp_data.spool) {
+                continue_spool();
+                break;
+            }
             ESP_LOGI(FTP_TAG, "ftp_buff_size=%d", ftp_buff_size);
-            result = recv_non_blocking(ftp_data.d_sd, ftp_data.dBuffer,
-                                       ftp_buff_size, &len);
+            result = recv_data(ftp_data.dBuffer, ftp_buff_size, &len);
             if (result == E_FTP_RESULT_OK) {
                 ftp_data.dtimeout = 0;
                 ftp_data.ctimeout = 0;
                 if (E_FTP_RESULT_OK !=
                     write_file((char*)ftp_data.dBuffer, len)) {
-                    send_reply(451, nullptr);
+                    transfer_reply(451);
                     ftp_data.state = E_FTP_STE_END_TRANSFER;
                     ESP_LOGW(FTP_TAG, "Error writing to file");
                 } else {
@@ -1311,19 +3010,20 @@ int Server::run(uint32_t elapsed) {
                     ESP_LOGI(FTP_TAG, "Received %" PRIu32 ", total: %" PRIu32,
                              len, ftp_data.total);
                     if (ftp_data.total % 102400 == 0 && ftp_data.total > 0) {
-                        log_to_screen("[^^] Progress: %" PRIu32 " KB", ftp_data.total / 1024);
+                        server->log_to_screen("[^^] Progress: %" PRIu32 " KB", ftp_data.total / 1024);
                     }
                 }
             } else if (result == E_FTP_RESULT_CONTINUE) {
                 if (ftp_data.dtimeout > FTP_DATA_TIMEOUT_MS) {
                     close_files_dir();
-                    send_reply(426, nullptr);
+                    transfer_reply(426);
                     ftp_data.state = E_FTP_STE_END_TRANSFER;
                     ESP_LOGW(FTP_TAG, "Receiving to file timeout");
                 }
             } else {
+                bool written = write_data(nullptr, 0);
                 close_files_dir();
-                send_reply(226, nullptr);
+                transfer_reply(!written ? 451 : rx_complete() ? 226 : 426);
                 ftp_data.state = E_FTP_STE_END_TRANSFER;
                 ESP_LOGI(FTP_TAG,
                          "File received (%" PRIu32 " bytes in %" PRIu32
@@ -1339,27 +3039,34 @@ int Server::run(uint32_t elapsed) {
     switch (ftp_data.substate) {
         case E_FTP_STE_SUB_DISCONNECTED:
             break;
-        case E_FTP_STE_SUB_LISTEN_FOR_DATA:
-            if (E_FTP_RESULT_OK ==
-                wait_for_connection(ftp_data.ld_sd, &ftp_data.d_sd, nullptr)) {
+        case E_FTP_STE_SUB_LISTEN_FOR_DATA: {
+            ftp_result_t result = server->wait_for_connection(
+                ftp_data.ld_sd, &ftp_data.d_sd, nullptr, true);
+            if (result == E_FTP_RESULT_OK && !data_peer_valid()) {
+                ESP_LOGW(FTP_TAG, "Data connection from a foreign address refused");
+                closesocket(ftp_data.d_sd);
+                ftp_data.d_sd = -1;
+                result = E_FTP_RESULT_CONTINUE;
+            }
+            if (result == E_FTP_RESULT_OK) {
                 ftp_data.dtimeout = 0;
                 ftp_data.substate = E_FTP_STE_SUB_DATA_CONNECTED;
+                release_listener();  // Back to the pool, still listening
+            } else if (result == E_FTP_RESULT_FAILED) {
+                reset();
             } else if (ftp_data.dtimeout > FTP_DATA_TIMEOUT_MS) {
                 ESP_LOGW(FTP_TAG,
                          "Waiting for data connection timeout (%" PRIi32 ")",
                          ftp_data.dtimeout);
                 ftp_data.dtimeout = 0;
-                closesocket(ftp_data.ld_sd);
-                ftp_data.ld_sd = -1;
+                release_listener();
                 ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
             }
-            break;
+        } break;
         case E_FTP_STE_SUB_DATA_CONNECTED:
             if (ftp_data.state == E_FTP_STE_READY &&
                 (ftp_data.dtimeout > FTP_DATA_TIMEOUT_MS)) {
-                closesocket(ftp_data.ld_sd);
                 closesocket(ftp_data.d_sd);
-                ftp_data.ld_sd = -1;
                 ftp_data.d_sd = -1;
                 close_filesystem_on_error();
                 ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
@@ -1370,19 +3077,108 @@ int Server::run(uint32_t elapsed) {
             break;
     }
 
-    if (ftp_data.d_sd < 0 && (ftp_data.state > E_FTP_STE_READY)) {
+    if (ftp_data.d_sd < 0 && (ftp_data.state > E_FTP_STE_READY) &&
+        !ftp_data.list_control && ftp_data.state != E_FTP_STE_CONTINUE_HASH) {
+        if (ftp_data.state != E_FTP_STE_END_TRANSFER) {
+            // Transfer started without a data connection, e.g. no PASV.
+            // Read-ahead and spool I/O may still be in flight on the file.
+            ftp_data.tx_len = 0;
+            ftp_data.tx_sent = 0;
+            close_files_dir();
+            transfer_reply(425, (char*)"Can't open data connection");
+        }
         ftp_data.substate = E_FTP_STE_SUB_DISCONNECTED;
         ftp_data.state = E_FTP_STE_READY;
     }
 
+    if (ftp_reply_len > 0 && ftp_data.c_sd >= 0) {
+        flush_replies();
+    }
+}
+
+int Server::run(uint32_t elapsed) {
+    xSemaphoreTake(ftp_mutex, portMAX_DELAY);
+
+    if (ftp_stop) {
+        ESP_LOGI(FTP_TAG, "Stop flag detected in run()");
+        xSemaphoreGive(ftp_mutex);
+        return -2;
+    }
+
+    switch (ftp_state) {
+        case E_FTP_STE_DISABLED:
+            wait_for_enabled();
+            break;
+        case E_FTP_STE_START:
+            if (create_listening_socket(&lc_sd, FTP_CMD_PORT,
+                                        FTP_CMD_CLIENTS_MAX)) {
+                open_passive_listeners();
+                ftp_state = E_FTP_STE_READY;
+            }
+            break;
+        case E_FTP_STE_READY:
+            accept_session();
+            for (Session& session : ftp_sessions) {
+                if (session.isConnected()) {
+                    session.run(elapsed);
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
     xSemaphoreGive(ftp_mutex);
     return 0;
 }
 
+// Blocks until a listening, control or data socket becomes ready or the
+// nearest session deadline expires, instead of polling every tick.
+void Server::wait_for_events() {
+    fd_set rfds, wfds;
+    int maxfd = -1;
+    uint32_t wait_ms = FTP_IDLE_WAIT_MS;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+
+    xSemaphoreTake(ftp_mutex, portMAX_DELAY);
+    if (ftp_state == E_FTP_STE_READY) {
+        if (lc_sd >= 0) {
+            FD_SET(lc_sd, &rfds);
+            maxfd = lc_sd;
+        }
+        for (Session& session : ftp_sessions) {
+            if (session.isConnected()) {
+                wait_ms = MIN(wait_ms, session.prepare_wait(&rfds, &wfds, &maxfd));
+            }
+        }
+    } else if (ftp_state == E_FTP_STE_START) {
+        wait_ms = 0;
+    }
+    xSemaphoreGive(ftp_mutex);
+
+    if (wait_ms == 0) {
+        return;
+    }
+    if (maxfd < 0) {
+        vTaskDelay(pdMS_TO_TICKS(wait_ms));
+        return;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = wait_ms / 1000;
+    tv.tv_usec = (wait_ms % 1000) * 1000;
+    if (select(maxfd + 1, &rfds, &wfds, nullptr, &tv) < 0 && errno != EINTR) {
+        ESP_LOGW(FTP_TAG, "select() failed (errno %d)", errno);
+        vTaskDelay(1);
+    }
+}
+
 bool Server::enable() {
     bool res = false;
-    if (ftp_data.state == E_FTP_STE_DISABLED) {
-        ftp_data.enabled = true;
+    if (ftp_state == E_FTP_STE_DISABLED) {
+        ftp_enabled = true;
         res = true;
     }
     return res;
@@ -1390,10 +3186,10 @@ bool Server::enable() {
 
 bool Server::disable() {
     bool res = false;
-    if (ftp_data.state == E_FTP_STE_READY) {
+    if (ftp_state == E_FTP_STE_READY) {
         reset();
-        ftp_data.enabled = false;
-        ftp_data.state = E_FTP_STE_DISABLED;
+        ftp_enabled = false;
+        ftp_state = E_FTP_STE_DISABLED;
         res = true;
     }
     return res;
@@ -1401,7 +3197,7 @@ bool Server::disable() {
 
 bool Server::terminate() {
     bool res = false;
-    if (ftp_data.state == E_FTP_STE_READY) {
+    if (ftp_state == E_FTP_STE_READY) {
         ftp_stop = 1;
         reset();
         res = true;
@@ -1411,6 +3207,68 @@ bool Server::terminate() {
 
 bool Server::stop_requested() { return (ftp_stop == 1); }
 
+bool Server::start_io_task() {
+    ftp_io_queue = xQueueCreate(FTP_CMD_CLIENTS_MAX * FTP_IO_BUFFERS + 1,
+                                sizeof(ftp_io_req_t));
+    if (!ftp_io_queue) {
+        return false;
+    }
+    xEventGroupClearBits(xEventTask, FTP_IO_FINISH_BIT);
+    BaseType_t result = xTaskCreatePinnedToCore(
+        io_task_wrapper, "FTP_IO", FTP_IO_TASK_STACK_SIZE, this,
+        FTP_IO_TASK_PRIORITY, &ftp_io_task_handle, FTP_IO_TASK_CORE);
+    if (result != pdPASS) {
+        ftp_io_task_handle = nullptr;
+        vQueueDelete(ftp_io_queue);
+        ftp_io_queue = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void Server::stop_io_task() {
+    if (!ftp_io_task_handle) {
+        return;
+    }
+    ftp_io_req_t req = {nullptr, E_FTP_IO_READ, 0};
+    xQueueSend(ftp_io_queue, &req, portMAX_DELAY);
+    EventBits_t bits = xEventGroupWaitBits(xEventTask, FTP_IO_FINISH_BIT,
+                                           pdFALSE, pdFALSE, pdMS_TO_TICKS(1000));
+    if (!(bits & FTP_IO_FINISH_BIT)) {
+        ESP_LOGE(FTP_TAG, "I/O task did not finish in time!");
+        vTaskDelete(ftp_io_task_handle);
+    }
+    ftp_io_task_handle = nullptr;
+    vQueueDelete(ftp_io_queue);
+    ftp_io_queue = nullptr;
+}
+
+bool Server::queue_io(Session* session, uint8_t op, uint8_t buf) {
+    if (!ftp_io_task_handle) {
+        return false;
+    }
+    ftp_io_req_t req = {session, op, buf};
+    return xQueueSend(ftp_io_queue, &req, 0) == pdTRUE;
+}
+
+// Storage I/O task - fills read-ahead buffers and drains receive spools so
+// the SD card / flash and the network are busy at the same time
+void Server::io_task_loop() {
+    ftp_io_req_t req;
+    while (xQueueReceive(ftp_io_queue, &req, portMAX_DELAY) == pdTRUE) {
+        if (!req.session) {
+            break;
+        }
+        if (req.op == E_FTP_IO_FLUSH) {
+            req.session->flush_spool();
+        } else {
+            req.session->fill_io_buffer(req.buf);
+        }
+    }
+    xEventGroupSetBits(xEventTask, FTP_IO_FINISH_BIT);
+    vTaskDelete(nullptr);
+}
+
 // Task loop - the main FTP server loop running in FreeRTOS task
 void Server::task_loop() {
     ESP_LOGI(FTP_TAG, "ftp_task start");
@@ -1430,6 +3288,10 @@ void Server::task_loop() {
         return;
     }
 
+    if (!start_io_task()) {
+        ESP_LOGW(FTP_TAG, "I/O task not started, transfers will read synchronously");
+    }
+
     enable();
 
     time_ms = mp_hal_ticks_ms();
@@ -1455,12 +3317,13 @@ void Server::task_loop() {
             break;
         }
 
-        vTaskDelay(1);
+        wait_for_events();
     }
 
     ESP_LOGW(FTP_TAG, "Task terminating, cleaning up...");
     // Cleanup before exit
     reset();  // Close all sockets
+    stop_io_task();
     deinit(); // Free memory
 
     ESP_LOGW(FTP_TAG, "Task terminated!");
@@ -1474,6 +3337,11 @@ void Server::task_wrapper(void* pvParameters) {
     server->task_loop();
 }
 
+void Server::io_task_wrapper(void* pvParameters) {
+    Server* server = static_cast<Server*>(pvParameters);
+    server->io_task_loop();
+}
+
 // Public interface implementation
 void Server::start() {
     if (ftp_mutex) {
@@ -1569,6 +3437,7 @@ void Server::stop() {
         }
         // Task cleanup didn't run, do it here
         reset();
+        stop_io_task();
         deinit();
     }
 
@@ -1597,7 +3466,7 @@ bool Server::isEnabled() const {
     if (ftp_mutex) {
         xSemaphoreTake(ftp_mutex, portMAX_DELAY);
     }
-    enabled = ftp_data.enabled;
+    enabled = ftp_enabled;
     if (ftp_mutex) {
         xSemaphoreGive(ftp_mutex);
     }
@@ -1610,9 +3479,19 @@ int Server::getState() const {
         xSemaphoreTake(ftp_mutex, portMAX_DELAY);
     }
 
-    fstate = ftp_data.state | (ftp_data.substate << 8);
-    if ((ftp_data.state == E_FTP_STE_READY) && (ftp_data.c_sd > 0))
-        fstate = E_FTP_STE_CONNECTED;
+    // Report the busiest session: a transfer in progress wins over an idle
+    // connected client, which wins over the bare listener state.
+    fstate = ftp_state;
+    if (ftp_state == E_FTP_STE_READY) {
+        for (const Session& session : ftp_sessions) {
+            if (!session.isConnected()) continue;
+            if (session.getState() > E_FTP_STE_READY) {
+                fstate = session.getState() | (session.getSubstate() << 8);
+                break;
+            }
+            fstate = E_FTP_STE_CONNECTED;
+        }
+    }
 
     if (ftp_mutex) {
         xSemaphoreGive(ftp_mutex);
@@ -1,7 +1,14 @@
 #ifndef FTP_SERVER_H
 #define FTP_SERVER_H
 
+#include <sys/select.h>
+#include <atomic>
 #include "dirent.h"
+#include "filesystem.h"
+#include "fsCache.h"
+#include "ftpAscii.h"
+#include "ftpDeflate.h"
+#include "ftpHash.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
@@ -11,10 +18,16 @@
 namespace FtpServer {
 
 // Constants
+#ifndef FTP_CMD_PORT  // The host tests run unprivileged on another port
 #define FTP_CMD_PORT 21
-#define FTP_PASSIVE_DATA_PORT 2024
-#define FTP_CMD_SIZE_MAX 6
-#define FTP_CMD_CLIENTS_MAX 1
+#endif
+#define FTP_PASSIVE_PORT_BASE CONFIG_FTP_PASSIVE_PORT
+#define FTP_PASSIVE_PORTS CONFIG_FTP_PASSIVE_PORT_COUNT
+#define FTP_CMD_KEY_LEN 8  // Longest verb (XSHA256), packed into a uint64_t key
+#define FTP_CMD_LOOKUP_BITS 7
+#define FTP_CMD_LOOKUP_SIZE (1 << FTP_CMD_LOOKUP_BITS)
+#define FTP_CMD_LOOKUP_EMPTY 0xFF
+#define FTP_CMD_CLIENTS_MAX CONFIG_FTP_MAX_SESSIONS
 #define FTP_DATA_CLIENTS_MAX 1
 #define FTP_MAX_PARAM_SIZE ((512) + 1)
 // 180 days = 15552000 seconds
@@ -24,10 +37,29 @@ namespace FtpServer {
 #define FTP_SOCKETFIFO_ELEMENTS_MAX 4
 #define FTP_USER_PASS_LEN_MAX 32
 #define FTP_CMD_TIMEOUT_MS (300 * 1000)
-#define FTPSERVER_BUFFER_SIZE 1024
+#define FTPSERVER_BUFFER_SIZE 2048
+#define FTP_TX_SEGMENT_SIZE 1440  // CONFIG_LWIP_TCP_MSS
+#define FTP_REPLY_QUEUE_SIZE 1024
+#define FTP_CMD_BUFFER_SIZE 1024  // Longest command line plus pipelined ones
+// Large-block file I/O: transfers move whole clusters per call so FatFs can
+// issue multi-block reads/writes. Buffers are sized for the largest mount.
+#define FTP_IO_BUFFER_SIZE                                              \
+    ((CONFIG_FTP_SDCARD_IO_SIZE > CONFIG_FTP_DATA_IO_SIZE) ? CONFIG_FTP_SDCARD_IO_SIZE \
+                                                           : CONFIG_FTP_DATA_IO_SIZE)
+#define FTP_IO_BUFFER_ALIGN 64
+#define FTP_IO_BUFFERS 2
+#define FTP_ASCII_BUFFER_SIZE 8192  // TYPE A download output, from half as much file data
+#define FTP_SPOOL_SIZE (CONFIG_FTP_STOR_SPOOL_SIZE * 1024)
+#define FTP_LIST_CACHE_SIZE (CONFIG_FTP_LIST_CACHE_SIZE * 1024)
+#define FTP_DIR_INDEX_SIZE (CONFIG_FTP_DIR_INDEX_SIZE * 1024)
 
+// The host tests point these at directories under their build tree
+#ifndef VFS_NATIVE_INTERNAL_MP
 #define VFS_NATIVE_INTERNAL_MP "/data"
+#endif
+#ifndef VFS_NATIVE_EXTERNAL_MP
 #define VFS_NATIVE_EXTERNAL_MP "/sdcard"
+#endif
 #define FTP_STORAGE_NAME_INTERNAL "data"
 #define FTP_STORAGE_NAME_SDCARD "sdcard"
 #define FTP_SERVER_NAME "Tactility FTP Server"
@@ -52,6 +84,7 @@ public:
         E_FTP_STE_CONTINUE_LISTING,
         E_FTP_STE_CONTINUE_FILE_TX,
         E_FTP_STE_CONTINUE_FILE_RX,
+        E_FTP_STE_CONTINUE_HASH,
         E_FTP_STE_CONNECTED
     } ftp_state_t;
 
@@ -73,6 +106,36 @@ public:
         E_FTP_DIR_OPEN
     } ftp_e_open_t;
 
+    typedef enum {
+        E_FTP_IO_IDLE = 0,
+        E_FTP_IO_PENDING,
+        E_FTP_IO_READY
+    } ftp_io_state_t;
+
+    typedef enum {
+        E_FTP_IO_READ = 0,
+        E_FTP_IO_FLUSH
+    } ftp_io_op_t;
+
+    typedef enum {
+        E_FTP_MODE_STREAM = 0,
+        E_FTP_MODE_BLOCK,    // MODE B, RFC 959 blocks
+        E_FTP_MODE_DEFLATE   // MODE Z, one zlib stream per transfer
+    } ftp_mode_t;
+
+    typedef enum {
+        E_FTP_LIST_UNIX = 0,  // LIST, "ls -l" style
+        E_FTP_LIST_NAMES,     // NLST
+        E_FTP_LIST_MLSD       // MLSD, RFC 3659 facts
+    } ftp_list_format_t;
+
+    typedef struct {
+        uint32_t list_hits;
+        uint32_t list_misses;
+        uint32_t stat_hits;
+        uint32_t stat_misses;
+    } ftp_cache_stats_t;
+
     // Constructor/Destructor
     Server();
     ~Server();
@@ -83,13 +146,13 @@ public:
     bool isEnabled() const;
     int getState() const;
     void register_screen_log_callback(void (*callback)(const char*));
+    // Call after a mount point is mounted or unmounted so nothing cached
+    // from the previous medium is served
+    void storage_changed(const char* mount_point);
+    void get_cache_stats(ftp_cache_stats_t* stats);
 
 private:
     // Private structs
-    typedef struct {
-        const char* cmd;
-    } ftp_cmd_t;
-
     typedef struct {
         bool uservalid : 1;
         bool passvalid : 1;
@@ -99,127 +162,365 @@ private:
         uint8_t* dBuffer;
         uint32_t ctimeout;
         union {
-            DIR* dp;
-            FILE* fp;
+            storage_dir_t* dp;
+            storage_file_t* fp;
         };
-        int32_t lc_sd;
-        int32_t ld_sd;
+        int32_t ld_sd;     // Passive listener borrowed from the server's pool
+        int8_t pasv_slot;
+        bool epsv_all;  // EPSV ALL: only EPSV sets up data connections from now on
         int32_t c_sd;
         int32_t d_sd;
         int32_t dtimeout;
         uint32_t ip_addr;
         uint8_t state;
         uint8_t substate;
-        uint8_t txRetries;
         uint8_t logginRetries;
         ftp_loggin_t loggin;
         uint8_t e_open;
         bool closechild;
-        bool enabled;
         bool listroot;
+        bool readahead;
+        bool spool;
+        bool listdone;
+        bool list_pending;
+        bool list_control;  // Listing goes out on the control connection (STAT)
+        bool list_cached;
+        bool list_fill;
+        bool index_build;
+        int8_t index_slot;
+        storage_dirent_t list_entry;
+        ListCache::cursor_t list_cursor;
+        const uint8_t* tx_data;
+        uint32_t tx_len;       // Including tx_header
+        uint32_t tx_sent;
+        uint8_t mode;          // ftp_mode_t
+        bool ascii;            // TYPE A: LF in files, CRLF on the wire
+        bool ascii_cr;         // Line ending state of the file being converted
+        // MODE B framing: every block starts with a descriptor byte and a
+        // 16-bit big-endian byte count
+        uint8_t tx_header[3];
+        uint8_t tx_header_len;
+        uint8_t rx_header[3];
+        uint8_t rx_header_len;
+        uint8_t rx_desc;       // Descriptor of the block being received
+        uint16_t rx_left;      // Bytes of that block still to come
+        // TYPE A: file data queued for sending that is not converted yet
+        const uint8_t* src;
+        uint32_t src_len;
+        bool src_last;
+        // MODE Z: data queued for sending that the compressor has not taken yet
+        const uint8_t* z_in;
+        uint32_t z_in_len;
+        bool z_last;
+        uint64_t restart;  // REST offset for the next RETR or STOR
+        uint64_t read_left;  // Bytes the read-ahead may still read, for RANG
+        // RANG byte range (end inclusive) for the next HASH or RETR
+        bool range_set;
+        uint64_t range_start;
+        uint64_t range_end;
+        // HASH in progress, or the checksum taken inline with a transfer
+        uint8_t hash_algo;
+        bool hash_inline;      // RETR/STOR/APPE data goes through ftp_hasher
+        bool hash_legacy;      // X* command, replied to with just the digest
+        bool hash_whole;       // Whole file, so the result goes into the cache
+        uint64_t hash_start;
+        uint64_t hash_end;
+        uint64_t hash_left;
+        fs_stat_t hash_st;     // File as hashed, for the checksum cache
         uint32_t total;
         uint32_t time;
+        uint32_t io_size;
     } ftp_data_t;
 
-    typedef enum {
-        E_FTP_CMD_NOT_SUPPORTED = -1,
-        E_FTP_CMD_FEAT = 0,
-        E_FTP_CMD_SYST,
-        E_FTP_CMD_CDUP,
-        E_FTP_CMD_CWD,
-        E_FTP_CMD_PWD,
-        E_FTP_CMD_XPWD,
-        E_FTP_CMD_SIZE,
-        E_FTP_CMD_MDTM,
-        E_FTP_CMD_TYPE,
-        E_FTP_CMD_USER,
-        E_FTP_CMD_PASS,
-        E_FTP_CMD_PASV,
-        E_FTP_CMD_LIST,
-        E_FTP_CMD_RETR,
-        E_FTP_CMD_STOR,
-        E_FTP_CMD_DELE,
-        E_FTP_CMD_RMD,
-        E_FTP_CMD_MKD,
-        E_FTP_CMD_RNFR,
-        E_FTP_CMD_RNTO,
-        E_FTP_CMD_NOOP,
-        E_FTP_CMD_QUIT,
-        E_FTP_CMD_APPE,
-        E_FTP_CMD_NLST,
-        E_FTP_CMD_AUTH,
-        E_FTP_NUM_FTP_CMDS
-    } ftp_cmd_index_t;
+    // Per-client state: control/data sockets, cwd, login, open file or
+    // directory and transfer counters. The server owns one Session per slot
+    // and drives each of them from run().
+    class Session {
+    public:
+        Session();
+        ~Session();
+
+        bool init(Server* owner, uint8_t slot);
+        void deinit();
+        void open(int32_t sd, uint32_t ip_addr);
+        void reset();
+        void run(uint32_t elapsed);
+        uint32_t prepare_wait(fd_set* rfds, fd_set* wfds, int* maxfd);
+        bool isConnected() const { return ftp_data.c_sd >= 0; }
+        uint8_t getState() const { return ftp_data.state; }
+        uint8_t getSubstate() const { return ftp_data.substate; }
+        void fill_io_buffer(uint8_t buf);
+        void flush_spool();
+
+    private:
+        // Command registry. Verbs are packed into a 64-bit key, first letter
+        // in the low byte, and found through a hash table generated at
+        // compile time, so dispatch is a single integer lookup.
+        typedef void (Session::*ftp_cmd_handler_t)(char** bufptr);
+
+        typedef struct {
+            uint64_t key;
+            ftp_cmd_handler_t handler;
+            uint8_t flags;
+            const char* name;
+            const char* feat;  // FEAT line advertising the command, if any
+        } ftp_cmd_t;
+
+        typedef struct {
+            uint8_t slot[FTP_CMD_LOOKUP_SIZE];
+        } ftp_cmd_lookup_t;
+
+        static constexpr uint8_t FTP_CMD_NEEDS_LOGIN = (1 << 0);
+        static constexpr uint8_t FTP_CMD_PATH_ARG = (1 << 1);  // Argument is opened as a child of ftp_path
+
+        static constexpr uint64_t ftp_cmd_key(const char* verb) {
+            uint64_t key = 0;
+            for (uint32_t i = 0; i < FTP_CMD_KEY_LEN && verb[i] != '\0'; i++) {
+                key |= (uint64_t)(uint8_t)verb[i] << (8 * i);
+            }
+            return key;
+        }
+        static constexpr uint32_t ftp_cmd_hash(uint64_t key) {
+            return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - FTP_CMD_LOOKUP_BITS));
+        }
+        static constexpr ftp_cmd_lookup_t build_cmd_lookup();
+
+        static const ftp_cmd_t ftp_cmd_table[];
+        static const ftp_cmd_lookup_t ftp_cmd_lookup;
+
+        // Read-ahead buffer for pipelined RETR. The storage task fills one
+        // while the network side drains the other.
+        typedef struct {
+            uint8_t* data;
+            uint32_t len;
+            ftp_result_t result;
+            std::atomic<uint8_t> state;
+        } ftp_io_buf_t;
+
+        Server* server;
+        uint8_t index;
+        const char* FTP_TAG;
+        const char* MOUNT_POINT;
+
+        int ftp_buff_size;
+        ftp_data_t ftp_data;
+        char* ftp_path;
+        char* ftp_saved_path;    // ftp_path before a path argument was applied
+        char* ftp_scratch_buffer;
+        char* ftp_cmd_buffer;    // Received command lines not yet run
+        uint32_t ftp_cmd_len;
+        bool ftp_cmd_discard;    // Skipping the rest of an overlong line
+        ftp_list_format_t ftp_list_format;
+        uint8_t ftp_mlst_facts;  // Facts selected with OPTS MLST, one bit each
+        uint8_t ftp_hash_algo;   // Hasher::algo_t selected with OPTS HASH
+        Hasher ftp_hasher;
+
+        // Control replies waiting for the socket to become writable. Replies
+        // produced in one step go out together in a single send().
+        char* ftp_reply_queue;
+        uint32_t ftp_reply_head;
+        uint32_t ftp_reply_len;
+        ftp_io_buf_t ftp_io_bufs[FTP_IO_BUFFERS];
+        uint8_t ftp_io_head;
+
+        // Native path of the file open for STOR/APPE, so its directory
+        // listing can be invalidated once the upload has finished
+        char ftp_write_path[FS_CACHE_PATH_MAX];
+        // Native and client paths of the file being hashed; ftp_path goes
+        // back to the working directory once the command returns
+        char ftp_hash_path[FS_CACHE_PATH_MAX];
+        char ftp_hash_name[FS_CACHE_PATH_MAX];
+
+        // Receive spool for pipelined STOR/APPE. The network side appends at
+        // ftp_spool_head, the storage task writes out from ftp_spool_tail.
+        uint8_t* ftp_spool;
+        uint32_t ftp_spool_head;
+        uint32_t ftp_spool_tail;
+        std::atomic<uint32_t> ftp_spool_used;
+        std::atomic<bool> ftp_spool_busy;
+        std::atomic<bool> ftp_spool_eof;
+        std::atomic<bool> ftp_spool_done;  // Final write after EOF has run
+        std::atomic<bool> ftp_spool_error;
+        uint8_t* ftp_ascii_buffer;
+
+        // MODE Z codecs, allocated on the first compressed transfer
+        Deflater ftp_deflater;
+        Inflater ftp_inflater;
+
+        // Private helper methods
+        void translate_path(char* actual, size_t actual_size, const char* display);
+        void get_full_path(char* fullname, size_t size, const char* display_path);
+        bool stat_cached(const char* fullname, fs_stat_t* st);
+        bool stat_disk(const char* fullname, fs_stat_t* st);
+        void invalidate_cached(const char* fullname, bool tree);
+        bool known_missing(const char* fullname);
+        void index_changed(const char* fullname);
+        bool secure_compare(const char* a, const char* b, size_t len);
+        bool add_virtual_dir_if_mounted(const char* mount_point, const char* name,
+                                         char* list, uint32_t maxlistsize, uint32_t* next);
+
+        // File operations
+        bool open_file(const char* path, const char* mode);
+        bool open_transfer(const char* path, const char* mode);
+        void transfer_reply(uint32_t status, char* message = nullptr);
+        bool ranged_upload();
+        void close_files_dir();
+        void close_filesystem_on_error();
+        ftp_result_t write_file(char* filebuf, uint32_t size);
+        bool write_data(uint8_t* data, uint32_t len);
+        ftp_result_t open_dir_for_listing(const char* path);
+        int get_eplf_item(char* dest, uint32_t destsize, const storage_dirent_t* de);
+        int get_mlst_facts(char* dest, uint32_t destsize, const storage_dirent_t* de);
+        void get_mlst_fact_names(char* dest, size_t destsize, bool feat);
+        void get_hash_names(char* dest, size_t destsize);
+        bool next_dir_entry(storage_dirent_t* de);
+        ftp_result_t list_dir(char* list, uint32_t maxlistsize, uint32_t* listsize);
+        void start_readahead();
+        void queue_io_read(uint8_t buf);
+        void wait_for_io();
+        void continue_listing();
+        void continue_readahead();
+        void start_hash(Hasher::algo_t algo, bool legacy);
+        void continue_hash();
+        void finish_hash(const uint8_t* digest, size_t len);
+        void start_spool();
+        void kick_spool();
+        void continue_spool();
+
+        // Socket operations
+        void close_cmd_data();
+        bool open_passive();
+        bool data_peer_valid();
+        void release_listener();
+
+        // Communication
+        void send_reply(uint32_t status, char* message);
+        ftp_result_t flush_replies();
+        void queue_data(const uint8_t* data, uint32_t len, bool last);
+        void queue_tx(const uint8_t* data, uint32_t len, bool last);
+        ftp_result_t send_pending_data();
+        void abort_transfer();
+        ftp_result_t recv_non_blocking(int32_t sd, void* buff, int32_t Maxlen, int32_t* rxLen);
+        ftp_result_t recv_data(uint8_t* buff, uint32_t maxlen, int32_t* len);
+        bool start_codec(bool upload);
+        ftp_result_t encode_data();
+        bool rx_complete() const;
+
+        // Path operations
+        void open_child(char* pwd, char* dir);
+        void close_child(char* pwd);
+
+        // Command parsing
+        void pop_param(char** str, char* param, size_t maxlen, bool stop_on_space, bool stop_on_newline);
+        const ftp_cmd_t* pop_command(char** str);
+        void get_param_and_open_child(char** bufptr);
+
+        // Command handlers
+        void cmd_feat(char** bufptr);
+        void cmd_opts(char** bufptr);
+        void cmd_auth(char** bufptr);
+        void cmd_syst(char** bufptr);
+        void cmd_cdup(char** bufptr);
+        void cmd_cwd(char** bufptr);
+        void cmd_pwd(char** bufptr);
+        void cmd_size(char** bufptr);
+        void cmd_mdtm(char** bufptr);
+        void cmd_type(char** bufptr);
+        void cmd_user(char** bufptr);
+        void cmd_pass(char** bufptr);
+        void cmd_pasv(char** bufptr);
+        void cmd_epsv(char** bufptr);
+        void cmd_list(char** bufptr);
+        void cmd_nlst(char** bufptr);
+        void cmd_mlsd(char** bufptr);
+        void cmd_mlst(char** bufptr);
+        void cmd_retr(char** bufptr);
+        void cmd_stor(char** bufptr);
+        void cmd_appe(char** bufptr);
+        void cmd_dele(char** bufptr);
+        void cmd_rmd(char** bufptr);
+        void cmd_mkd(char** bufptr);
+        void cmd_rnfr(char** bufptr);
+        void cmd_rnto(char** bufptr);
+        void cmd_rest(char** bufptr);
+        void cmd_noop(char** bufptr);
+        void cmd_stat(char** bufptr);
+        void cmd_mode(char** bufptr);
+        void cmd_quit(char** bufptr);
+        void cmd_hash(char** bufptr);
+        void cmd_rang(char** bufptr);
+        void cmd_xcrc(char** bufptr);
+        void cmd_xmd5(char** bufptr);
+        void cmd_xsha1(char** bufptr);
+        void cmd_xsha256(char** bufptr);
+        void cmd_xsha512(char** bufptr);
+        void start_listing(ftp_list_format_t format, bool control);
+        void send_status();
+
+        // Main processing
+        bool command_ready() const;
+        void receive_commands();
+        void run_command();
+        void process_cmd();
+    };
+
+    typedef struct {
+        Session* session;
+        uint8_t op;
+        uint8_t buf;
+    } ftp_io_req_t;
 
     // Member variables (formerly global)
     static constexpr int FTP_STOP_BIT = (1 << 0);
     static constexpr int FTP_TASK_FINISH_BIT = (1 << 2);
+    static constexpr int FTP_IO_FINISH_BIT = (1 << 3);
     
     EventGroupHandle_t xEventTask;
     TaskHandle_t ftp_task_handle;
+    TaskHandle_t ftp_io_task_handle;
+    QueueHandle_t ftp_io_queue;
     SemaphoreHandle_t ftp_mutex;
     
-    int ftp_buff_size;
     int ftp_timeout;
     const char* FTP_TAG;
     const char* MOUNT_POINT;
     
-    ftp_data_t ftp_data;
-    char* ftp_path;
-    char* ftp_scratch_buffer;
-    char* ftp_cmd_buffer;
+    int32_t lc_sd;
+    // Passive data listeners, bound once and lent to one session per
+    // PASV/EPSV. They stay listening between transfers and are handed out
+    // round-robin, so consecutive transfers never reuse a port.
+    int32_t ftp_pasv_sd[FTP_PASSIVE_PORTS];
+    bool ftp_pasv_busy[FTP_PASSIVE_PORTS];
+    uint8_t ftp_pasv_next;
+    uint8_t ftp_state;
+    bool ftp_enabled;
+    Session ftp_sessions[FTP_CMD_CLIENTS_MAX];
+    ListCache ftp_list_cache;
+    StatCache ftp_stat_cache;
+    DirIndex ftp_dir_index;
+    HashCache ftp_hash_cache;
     uint8_t ftp_stop;
     char ftp_user[FTP_USER_PASS_LEN_MAX + 1];
     char ftp_pass[FTP_USER_PASS_LEN_MAX + 1];
-    uint8_t ftp_nlist;
-    
-    static const ftp_cmd_t ftp_cmd_table[];
 
     // Private helper methods
-    void translate_path(char* actual, size_t actual_size, const char* display);
-    void get_full_path(char* fullname, size_t size, const char* display_path);
-    bool secure_compare(const char* a, const char* b, size_t len);
-    bool add_virtual_dir_if_mounted(const char* mount_point, const char* name,
-                                     char* list, uint32_t maxlistsize, uint32_t* next);
     uint64_t mp_hal_ticks_ms();
-    void stoupper(char* str);
-    void log_to_screen(const char* format, ...);
-    
-    // File operations
-    bool open_file(const char* path, const char* mode);
-    void close_files_dir();
-    void close_filesystem_on_error();
-    ftp_result_t read_file(char* filebuf, uint32_t desiredsize, uint32_t* actualsize);
-    ftp_result_t write_file(char* filebuf, uint32_t size);
-    ftp_result_t open_dir_for_listing(const char* path);
-    int get_eplf_item(char** dest, uint32_t* destsize, struct dirent* de);
-    ftp_result_t list_dir(char* list, uint32_t maxlistsize, uint32_t* listsize);
-    
+    void log_to_screen(const char* format, ...) __attribute__((format(printf, 2, 3)));
+
     // Socket operations
-    void close_cmd_data();
     void reset();
     bool create_listening_socket(int32_t* sd, uint32_t port, uint8_t backlog);
-    ftp_result_t wait_for_connection(int32_t l_sd, int32_t* n_sd, uint32_t* ip_addr);
-    
-    // Communication
-    void send_reply(uint32_t status, char* message);
-    void send_list(uint32_t datasize);
-    void send_file_data(uint32_t datasize);
-    ftp_result_t recv_non_blocking(int32_t sd, void* buff, int32_t Maxlen, int32_t* rxLen);
-    
-    // Path operations
-    void open_child(char* pwd, char* dir);
-    void close_child(char* pwd);
-    void remove_fname_from_path(char* pwd, char* fname);
-    
-    // Command parsing
-    void pop_param(char** str, char* param, size_t maxlen, bool stop_on_space, bool stop_on_newline);
-    ftp_cmd_index_t pop_command(char** str);
-    void get_param_and_open_child(char** bufptr);
-    
+    void open_passive_listeners();
+    void close_passive_listeners();
+    int8_t acquire_passive_listener();
+    void release_passive_listener(int8_t slot);
+    void drain_listener(int32_t sd);
+    ftp_result_t wait_for_connection(int32_t l_sd, int32_t* n_sd, uint32_t* ip_addr, bool nonblocking);
+    void accept_session();
+
     // Main processing
-    void process_cmd();
     void wait_for_enabled();
+    void wait_for_events();
     
     // Initialization
     bool init();
@@ -230,9 +531,16 @@ private:
     bool terminate();
     bool stop_requested();
     
+    // Storage I/O task (read-ahead for pipelined transfers)
+    bool start_io_task();
+    void stop_io_task();
+    bool queue_io(Session* session, uint8_t op, uint8_t buf);
+    
     // Task wrapper (must be static for FreeRTOS)
     static void task_wrapper(void* pvParameters);
+    static void io_task_wrapper(void* pvParameters);
     void task_loop();
+    void io_task_loop();
 };
 
 } // namespace FtpServer
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include "ftpServer.h"
 #include "esp_log.h"
 #include "esp_wifi.h"
@@ -32,7 +33,7 @@ wl_handle_t wl_handle;
 
 #define CHECKPOINT(msg) \
     do { \
-        ESP_LOGI(TAG, "%s | Heap: %lu", msg, esp_get_free_heap_size()); \
+        ESP_LOGI(TAG, "%s | Heap: %" PRIu32, msg, esp_get_free_heap_size()); \
         vTaskDelay(pdMS_TO_TICKS(50)); \
     } while(0)
 
@@ -402,6 +403,14 @@ extern "C" void app_main(void) {
                     lv_unlock();
                     break;
                     
+                case FtpServer::Server::E_FTP_STE_CONTINUE_HASH:
+                    ESP_LOGI(TAG, "FTP: Computing checksum");
+                    lv_lock();
+                    addLog("#00ffff [##] Computing checksum...#");
+                    update_status("Computing Checksum");
+                    lv_unlock();
+                    break;
+                    
                 case FtpServer::Server::E_FTP_STE_END_TRANSFER:
                     ESP_LOGI(TAG, "FTP: Transfer complete");
                     lv_lock();
@@ -444,6 +453,9 @@ extern "C" void app_main(void) {
                     unmountSDCARD("/sdcard", sdcard);
                     sdcard = nullptr;
                 }
+                if (ftpServer) {
+                    ftpServer->storage_changed("/sdcard");
+                }
                 sdcard_was_present = false;
                 sdcard_mount_retry_count = 0;  // Reset retry counter for next insertion
 
@@ -458,6 +470,9 @@ extern "C" void app_main(void) {
                         lv_unlock();
                         sdcard_was_present = true;
                         sdcard_mount_retry_count = 0;  // Reset on success
+                        if (ftpServer) {
+                            ftpServer->storage_changed("/sdcard");
+                        }
                     } else {
                         sdcard_mount_retry_count++;
                         if (sdcard_mount_retry_count >= MAX_SD_MOUNT_RETRIES) {